@@ -1,61 +1,70 @@
-// This benchmark reports on the bulk insert and bulk query rates. It is invoked as:
+// This benchmark reports on the bulk insert and bulk query rates of every filter
+// configuration, over the same keys. It is invoked as:
 //
-//     ./bulk-insert-and-query.exe 158000
+//     ./bulk-insert-and-query.exe [--items=N] [--load=L] [--mix=P,P,...] [--threads=T]
+//                                 [--latency [--points=P,P,...]] [--filters=NAME,...]
+//                                 [--perf] [--json=FILE] [N]
 //
-// That invocation will test each probabilistic membership container type with 158000
-// randomly generated items. It tests bulk Add() from empty to full and Contain() on
-// filters with varying rates of expected success. For instance, at 75%, three out of
-// every four values passed to Contain() were earlier Add()ed.
+// --items (or a bare N) is the number of randomly generated keys to add; each filter is
+// sized for N / L of them (L = 1 by default), and keys are added until all are in or the
+// filter is full. The CuckooFilter has a fixed capacity instead, and gets L times that
+// many keys, or all N if there are fewer. Contain() is then tested on mixes with varying
+// rates of expected success, given as percents (0,25,50,75,100 by default). For instance,
+// at 75, three out of every four values passed to Contain() were earlier Add()ed. Filters
+// whose lookups are read-only split them across T threads. Finally filters that can
+// remove keys remove half of those added.
 //
-// Example output:
+// The results are printed as a table and, with --json, also written to FILE. ε is the
+// rate at which the filter alone, without remote checks, accepts the keys of the 0% mix;
+// "replay" is that rate again after the timed Contain() of those keys, which lowers it
+// for the adaptive CuckooFilter. The "optimal bits/item" are those of a filter
+// that achieves ε with no wasted space.
 //
-// $ for num in 55 75 85; do echo $num:; /usr/bin/time -f 'time: %e seconds' ./bulk-insert-and-query.exe ${num}00000; echo; done
-// 55:
-//                   Million    Find    Find    Find    Find    Find                       optimal  wasted
-//                  adds/sec      0%     25%     50%     75%    100%       ε  bits/item  bits/item   space
-//      Cuckoo12       23.78   37.24   35.04   37.17   37.35   36.35  0.131%      18.30       9.58   91.1%
-//    SemiSort13       11.63   17.55   17.08   17.14   17.54   22.32  0.064%      18.30      10.62   72.4%
-//       Cuckoo8       35.31   49.32   50.24   49.98   48.32   50.49  2.044%      12.20       5.61  117.4%
-//     SemiSort9       13.99   22.23   22.78   22.13   23.16   24.06  1.207%      12.20       6.37   91.5%
-//      Cuckoo16       27.06   36.94   37.12   35.31   36.81   35.10  0.009%      24.40      13.46   81.4%
-//    SemiSort17       10.37   15.70   15.84   15.78   15.55   15.93  0.004%      24.40      14.72   65.8%
-//    SimdBlock8       74.22   72.34   74.23   74.34   74.69   74.32  0.508%      12.20       7.62   60.1%
-// time: 14.34 seconds
+// With --perf, the hardware counters of each timed phase (adds, each lookup mix and
+// removes) are also read, and a second table gives them per operation next to the rate
+// of the phase: cycles, instructions, last level cache misses, data TLB misses and
+// branch misses. Counters that are not available, as in most containers and virtual
+// machines, are shown as "-" after a warning.
 //
-// 75:
-//                   Million    Find    Find    Find    Find    Find                       optimal  wasted
-//                  adds/sec      0%     25%     50%     75%    100%       ε  bits/item  bits/item   space
-//      Cuckoo12       15.61   37.24   37.23   37.34   37.15   37.36  0.173%      13.42       9.18   46.2%
-//    SemiSort13        8.77   17.11   15.70   17.34   17.73   18.86  0.087%      13.42      10.17   31.9%
-//       Cuckoo8       23.46   48.81   48.14   39.48   49.28   49.65  2.806%       8.95       5.16   73.6%
-//     SemiSort9       11.14   23.98   20.80   23.37   24.35   21.41  1.428%       8.95       6.13   46.0%
-//      Cuckoo16       15.08   36.64   36.75   36.83   36.59   36.74  0.011%      17.90      13.11   36.5%
-//    SemiSort17        8.02   15.63   15.66   15.87   15.67   15.88  0.006%      17.90      14.02   27.6%
-//    SimdBlock8       73.26   74.41   74.28   70.86   72.02   70.69  2.071%       8.95       5.59   60.0%
-// time: 18.06 seconds
+// With --latency, every operation is timed on its own with the time stamp counter instead,
+// less the overhead of reading it, while each filter fills up to the given percents of
+// its keys (50,75,90,95,100 by default). At each of those points it also times lookups,
+// half of them of added keys, and the removal of recently added keys. Lookups during
+// which the CuckooFilter adapted to a false positive are reported apart, as "adapt". The
+// table and JSON give percentiles of each operation, in nanoseconds, by load point.
 //
-// 85:
-//                   Million    Find    Find    Find    Find    Find                       optimal  wasted
-//                  adds/sec      0%     25%     50%     75%    100%       ε  bits/item  bits/item   space
-//      Cuckoo12       22.74   32.49   32.69   32.58   32.85   32.71  0.102%      23.69       9.94  138.3%
-//    SemiSort13        9.97   13.16   13.15   13.54   16.01   19.58  0.056%      23.69      10.80  119.4%
-//       Cuckoo8       30.67   36.86   36.79   37.09   36.97   36.87  1.581%      15.79       5.98  163.9%
-//     SemiSort9       10.96   15.49   15.37   15.40   15.18   15.63  1.047%      15.79       6.58  140.1%
-//      Cuckoo16       27.84   33.74   33.72   33.69   33.75   33.62  0.007%      31.58      13.80  128.8%
-//    SemiSort17        9.51   12.83   12.80   12.64   12.86   12.50  0.004%      31.58      14.65  115.6%
-//    SimdBlock8       54.84   58.37   59.73   59.13   60.11   60.12  0.144%      15.79       9.44   67.3%
-// time: 19.43 seconds
+// Example output:
 //
-
+// $ ./bulk-insert-and-query.exe --items=120000
+//                             Million    Find    Find    Find    Find    Find   Million                                optimal  wasted
+//                     items  adds/sec      0%     25%     50%     75%    100%   rms/sec       ε   replay  bits/item  bits/item   space
+//        Cuckoo12    120000      6.44   75.82   20.45   13.95   12.04   10.85      8.44  0.093%   0.001%      26.21      10.07  160.2%
+//         Cuckoo8    120000      8.15   45.20   18.64   12.51   10.71   11.01      8.34  1.433%   0.177%      17.48       6.12  185.4%
+//        Cuckoo16    120000      8.30   62.43   20.34   13.69   12.03   11.09      8.61  0.007%   0.000%      34.95      13.89  151.7%
+//        Packed13    120000     19.48   43.45   51.29   56.75   64.03   64.00     17.96  0.089%   0.089%      13.11      10.14   29.3%
+//      SimdBlock8    120000    317.96  390.98  390.17  385.73  386.98  389.61         -  3.357%   3.357%       8.00       4.90   63.4%
+//    SimdBlock512    120000    247.38  333.40  326.62  337.02  338.72  319.85         - 11.713%  11.713%       8.00       3.09  158.6%
+// CountingBlock32    120000    192.39  230.70  224.44  223.29  223.34  224.52    171.07  4.111%   4.111%      32.00       4.60  595.0%
+
+#include <algorithm>
 #include <climits>
+#include <cmath>
+#include <cstdlib>
 #include <iomanip>
 #include <map>
+#include <memory>
+#include <set>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
-#include "cuckoofilter.h"
+#include "driver.h"
+#include "filterapi.h"
+#include "histogram.h"
+#include "perfcounters.h"
 #include "random.h"
-#include "simd-block.h"
 #include "timing.h"
 
 using namespace std;
@@ -65,39 +74,66 @@ using namespace cuckoofilter;
 // The number of items sampled when determining the lookup performance
 const size_t SAMPLE_SIZE = 1000 * 1000;
 
+// The number of lookups timed one by one at each load point of the latency mode, and of
+// removals:
+const size_t LATENCY_SAMPLE_SIZE = 100 * 1000;
+const size_t LATENCY_REMOVE_SIZE = 10 * 1000;
+
+// The flags of this benchmark, on top of CommonOptions:
+struct Options : CommonOptions {
+  size_t items;
+  double load;
+  vector<int> find_percents;
+  unsigned threads;
+  set<string> filters;  // Empty for all of them
+  bool latency;         // Time single operations instead of bulk ones
+  vector<int> load_points;  // Percents of the items at which latency is reported
+  bool perf;            // Read the hardware counters of each bulk phase
+};
+
+// The hardware counts of one timed phase of a bulk run:
+struct PhaseCounts {
+  string phase;  // "add", "find P%" or "remove"
+  size_t operations;
+  double ops_per_nano;
+  PerfCounts counts;
+};
+
 // The statistics gathered for each table type:
 struct Statistics {
+  size_t items;  // The number of keys added, fewer than N if the filter filled up
   double adds_per_nano;
   map<int, double> finds_per_nano; // The key is the percent of queries that were expected
                                    // to be positive
+  unsigned find_threads;
+  double removes_per_nano;  // Zero if the filter cannot remove keys
   double false_positive_probabilty;
+  double false_positive_replay;
   double bits_per_item;
+  vector<PhaseCounts> perf;  // Empty without --perf
 };
 
 // Output for the first row of the table of results. type_width is the maximum number of
-// characters of the description of any table type, and find_percent_count is the number
-// of different lookup statistics gathered for each table. This function assumes the
-// lookup expected positive probabiilties are evenly distributed, with the first being 0%
-// and the last 100%.
-string StatisticsTableHeader(int type_width, int find_percent_count) {
+// characters of the description of any table type, and find_percents are the lookup
+// expected positive probabilities tested.
+string StatisticsTableHeader(int type_width, const vector<int>& find_percents) {
   ostringstream os;
 
   os << string(type_width, ' ');
-  os << setw(12) << right << "Million";
-  for (int i = 0; i < find_percent_count; ++i) {
+  os << setw(10) << right << "" << setw(10) << "Million";
+  for (size_t i = 0; i < find_percents.size(); ++i) {
     os << setw(8) << "Find";
   }
-  os << setw(8) << "" << setw(11) << "" << setw(11)
-     << "optimal" << setw(8) << "wasted" << endl;
+  os << setw(10) << "Million" << setw(8) << "" << setw(9) << "" << setw(11) << ""
+     << setw(11) << "optimal" << setw(8) << "wasted" << endl;
 
   os << string(type_width, ' ');
-  os << setw(12) << right << "adds/sec";
-  for (int i = 0; i < find_percent_count; ++i) {
-    os << setw(7)
-       << static_cast<int>(100 * i / static_cast<double>(find_percent_count - 1)) << '%';
+  os << setw(10) << right << "items" << setw(10) << "adds/sec";
+  for (const int percent : find_percents) {
+    os << setw(7) << percent << '%';
   }
-  os << setw(9) << "ε" << setw(11) << "bits/item" << setw(11)
-     << "bits/item" << setw(8) << "space";
+  os << setw(10) << "rms/sec" << setw(9) << "ε" << setw(9) << "replay" << setw(11)
+     << "bits/item" << setw(11) << "bits/item" << setw(8) << "space";
   return os.str();
 }
 
@@ -106,150 +142,509 @@ template <class CharT, class Traits>
 basic_ostream<CharT, Traits>& operator<<(
     basic_ostream<CharT, Traits>& os, const Statistics& stats) {
   constexpr double NANOS_PER_MILLION = 1000;
-  os << fixed << setprecision(2) << setw(12) << right
+  os << fixed << setprecision(2) << setw(10) << right << stats.items << setw(10)
      << stats.adds_per_nano * NANOS_PER_MILLION;
   for (const auto& fps : stats.finds_per_nano) {
     os << setw(8) << fps.second * NANOS_PER_MILLION;
   }
+  if (stats.removes_per_nano > 0) {
+    os << setw(10) << stats.removes_per_nano * NANOS_PER_MILLION;
+  } else {
+    os << setw(10) << "-";
+  }
   const auto minbits = log2(1 / stats.false_positive_probabilty);
   os << setw(7) << setprecision(3) << stats.false_positive_probabilty * 100 << '%'
+     << setw(8) << stats.false_positive_replay * 100 << '%'
      << setw(11) << setprecision(2) << stats.bits_per_item << setw(11) << minbits
      << setw(7) << setprecision(1) << 100 * (stats.bits_per_item / minbits - 1) << '%';
 
   return os;
 }
 
-template<typename Table>
-struct FilterAPI {};
-
-template <typename ItemType, size_t bits_per_item, template <size_t> class TableType>
-struct FilterAPI<CuckooFilter<ItemType, bits_per_item, TableType>> {
-  using Table = CuckooFilter<ItemType, bits_per_item, TableType>;
-  static Table ConstructFromAddCount(size_t add_count) { return Table(add_count); }
-  static void Add(uint64_t key, Table * table) {
-    if (0 != table->Add(key)) {
-      throw logic_error("The filter is too small to hold all of the elements");
+// Writes the results as a JSON object, with rates in operations per second.
+void WriteJson(ostream& os, const Options& options,
+    const vector<pair<string, Statistics>>& results) {
+  constexpr double NANOS_PER_SECOND = 1e9;
+  os << setprecision(10) << "{\n  \"items\": " << options.items
+     << ",\n  \"load\": " << options.load << ",\n  \"threads\": " << options.threads
+     << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Statistics& stats = results[i].second;
+    os << (i ? "," : "") << "\n    {\"name\": \"" << results[i].first
+       << "\", \"items\": " << stats.items
+       << ", \"adds_per_sec\": " << stats.adds_per_nano * NANOS_PER_SECOND
+       << ", \"finds_per_sec\": {";
+    bool first = true;
+    for (const auto& fps : stats.finds_per_nano) {
+      os << (first ? "" : ", ") << '"' << fps.first
+         << "\": " << fps.second * NANOS_PER_SECOND;
+      first = false;
     }
+    os << "}, \"find_threads\": " << stats.find_threads << ", \"removes_per_sec\": ";
+    if (stats.removes_per_nano > 0) {
+      os << stats.removes_per_nano * NANOS_PER_SECOND;
+    } else {
+      os << "null";
+    }
+    os << ", \"false_positive_probability\": " << stats.false_positive_probabilty
+       << ", \"false_positive_replay\": " << stats.false_positive_replay
+       << ", \"bits_per_item\": " << stats.bits_per_item;
+    if (!stats.perf.empty()) {
+      // Counts per operation:
+      os << ", \"perf\": [";
+      for (size_t j = 0; j < stats.perf.size(); ++j) {
+        const PhaseCounts& phase = stats.perf[j];
+        os << (j ? ", " : "") << "{\"phase\": \"" << phase.phase
+           << "\", \"operations\": " << phase.operations
+           << ", \"ops_per_sec\": " << phase.ops_per_nano * NANOS_PER_SECOND;
+        for (int event = 0; event < kNumPerfEvents; ++event) {
+          os << ", \"" << PerfEventName(event) << "\": ";
+          if (phase.counts.Valid(event)) {
+            os << phase.counts.count[event] / phase.operations;
+          } else {
+            os << "null";
+          }
+        }
+        os << "}";
+      }
+      os << "]";
+    }
+    os << "}";
   }
-  static bool Contain(uint64_t key, const Table * table) {
-    return (0 == table->Contain(key));
-  }
-};
+  os << "\n  ]\n}\n";
+}
 
-template <>
-struct FilterAPI<SimdBlockFilter<>> {
-  using Table = SimdBlockFilter<>;
-  static Table ConstructFromAddCount(size_t add_count) {
-    Table ans(ceil(log2(add_count * 8.0 / CHAR_BIT)));
-    return ans;
+// Counts the keys Contain() finds, on 'threads' threads if the filter allows it.
+template <typename Table>
+size_t CountFound(const vector<uint64_t>& keys, unsigned threads, Table* filter) {
+  if (threads <= 1 || !FilterAPI<Table>::kConcurrentContain) {
+    size_t found_count = 0;
+    for (const auto v : keys) found_count += FilterAPI<Table>::Contain(v, filter);
+    return found_count;
   }
-  static void Add(uint64_t key, Table* table) {
-    table->Add(key);
+  vector<size_t> found_counts(threads, 0);
+  vector<thread> workers;
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.emplace_back([&keys, &found_counts, threads, t, filter]() {
+      size_t found_count = 0;
+      for (size_t i = keys.size() * t / threads; i < keys.size() * (t + 1) / threads;
+           ++i) {
+        found_count += FilterAPI<Table>::Contain(keys[i], filter);
+      }
+      found_counts[t] = found_count;
+    });
   }
-  static bool Contain(uint64_t key, const Table * table) {
-    return table->Find(key);
+  size_t found_count = 0;
+  for (unsigned t = 0; t < threads; ++t) {
+    workers[t].join();
+    found_count += found_counts[t];
   }
-};
+  return found_count;
+}
 
+// Counts the keys MayContain() finds. None of them were added, so all are false
+// positives.
 template <typename Table>
-Statistics FilterBenchmark(
-    size_t add_count, const vector<uint64_t>& to_add, const vector<uint64_t>& to_lookup) {
-  if (add_count > to_add.size()) {
-    throw out_of_range("to_add must contain at least add_count values");
-  }
+size_t CountFalsePositives(const vector<uint64_t>& absent, Table* filter) {
+  size_t found_count = 0;
+  for (const auto v : absent) found_count += FilterAPI<Table>::MayContain(v, filter);
+  return found_count;
+}
 
+// The number of keys to add to filter for options.load. A filter sized for
+// to_add.size() / load keys gets them all; one of fixed capacity gets load times its
+// capacity, as far as there are keys.
+template <typename Table>
+size_t KeysToAdd(const Options& options, const vector<uint64_t>& to_add,
+    const Table* filter) {
+  const size_t capacity = FilterAPI<Table>::FixedCapacity(filter);
+  if (capacity == 0) return to_add.size();
+  return min<double>(to_add.size(), options.load * capacity);
+}
+
+// Without --perf, counters is null.
+template <typename Table>
+Statistics FilterBenchmark(const Options& options, const vector<uint64_t>& to_add,
+    const vector<uint64_t>& to_lookup, PerfCounters* counters) {
   if (SAMPLE_SIZE > to_lookup.size()) {
     throw out_of_range("to_lookup must contain at least SAMPLE_SIZE values");
   }
 
-  Table filter = FilterAPI<Table>::ConstructFromAddCount(add_count);
+  auto filter = FilterAPI<Table>::Construct(to_add.size() / options.load);
+  const size_t to_fill = KeysToAdd(options, to_add, filter.get());
   Statistics result;
 
   // Add values until failure or until we run out of values to add:
+  size_t added = 0;
+  if (counters) counters->Start();
   auto start_time = NowNanos();
-  for (size_t added = 0; added < add_count; ++added) {
-    FilterAPI<Table>::Add(to_add[added], &filter);
+  while (added < to_fill && FilterAPI<Table>::Add(to_add[added], filter.get())) {
+    ++added;
   }
-  result.adds_per_nano = add_count / static_cast<double>(NowNanos() - start_time);
-  result.bits_per_item = static_cast<double>(CHAR_BIT * filter.SizeInBytes()) / add_count;
+  result.items = added;
+  result.adds_per_nano = added / static_cast<double>(NowNanos() - start_time);
+  if (counters) {
+    result.perf.push_back({"add", added, result.adds_per_nano, counters->Stop()});
+  }
+  result.bits_per_item = static_cast<double>(CHAR_BIT * filter->SizeInBytes()) / added;
+  result.find_threads = FilterAPI<Table>::kConcurrentContain ? options.threads : 1;
 
-  size_t found_count = 0;
-  for (const double found_probability : {0.0, 0.25, 0.50, 0.75, 1.00}) {
+  for (const int percent : options.find_percents) {
     const auto to_lookup_mixed = MixIn(&to_lookup[0], &to_lookup[SAMPLE_SIZE], &to_add[0],
-        &to_add[add_count], found_probability);
-    const auto start_time = NowNanos();
-    for (const auto v : to_lookup_mixed) {
-      found_count += FilterAPI<Table>::Contain(v, &filter);
+        &to_add[added], percent / 100.0);
+    if (0 == percent) {
+      result.false_positive_probabilty =
+          CountFalsePositives(to_lookup_mixed, filter.get()) /
+          static_cast<double>(to_lookup_mixed.size());
     }
+    if (counters) counters->Start();
+    const auto start_time = NowNanos();
+    const size_t found_count = CountFound(to_lookup_mixed, options.threads, filter.get());
     const auto lookup_time = NowNanos() - start_time;
-    result.finds_per_nano[100 * found_probability] =
-        SAMPLE_SIZE / static_cast<double>(lookup_time);
-    if (0.0 == found_probability) {
-      result.false_positive_probabilty =
-          found_count / static_cast<double>(to_lookup_mixed.size());
+    result.finds_per_nano[percent] = SAMPLE_SIZE / static_cast<double>(lookup_time);
+    if (counters) {
+      result.perf.push_back({"find " + to_string(percent) + "%", SAMPLE_SIZE,
+          result.finds_per_nano[percent], counters->Stop()});
+    }
+    if (0 == percent) {
+      result.false_positive_replay =
+          CountFalsePositives(to_lookup_mixed, filter.get()) /
+          static_cast<double>(to_lookup_mixed.size());
+    }
+    UseCount(found_count);
+  }
+
+  result.removes_per_nano = 0;
+  if (FilterAPI<Table>::kCanRemove) {
+    const size_t remove_count = added / 2;
+    if (counters) counters->Start();
+    start_time = NowNanos();
+    for (size_t i = 0; i < remove_count; ++i) {
+      if (!FilterAPI<Table>::Remove(to_add[i], filter.get())) {
+        throw logic_error("An added key could not be removed");
+      }
+    }
+    result.removes_per_nano = remove_count / static_cast<double>(NowNanos() - start_time);
+    if (counters) {
+      result.perf.push_back(
+          {"remove", remove_count, result.removes_per_nano, counters->Stop()});
     }
   }
   return result;
 }
 
-int main(int argc, char * argv[]) {
-  if (argc != 2) {
-    cerr << "Usage: " << argv[0] << " $NUMBER" << endl;
-    return 1;
+// The latency of each kind of operation, in ticks, by the percent of the items added
+// when they were measured. "insert" at a point covers the inserts since the previous
+// point; "adapt" holds the lookups during which the filter adapted to a false positive,
+// and "find" all the others.
+using LatencyStatistics = map<string, map<int, LatencyHistogram>>;
+
+const char* const LATENCY_OPERATIONS[] = {"insert", "find", "adapt", "erase"};
+
+// The least number of ticks between two back-to-back readings of NowTicks(), which is
+// taken off every measurement.
+uint64_t TimerOverhead() {
+  uint64_t overhead = UINT64_MAX;
+  for (int i = 0; i < 10000; ++i) {
+    const auto start = NowTicks();
+    overhead = min(overhead, NowTicks() - start);
   }
-  stringstream input_string(argv[1]);
-  size_t add_count;
-  input_string >> add_count;
-  if (input_string.fail()) {
-    cerr << "Invalid number: " << argv[1];
-    return 2;
-  }
-
-  const vector<uint64_t> to_add = GenerateRandom64(add_count);
-  const vector<uint64_t> to_lookup = GenerateRandom64(SAMPLE_SIZE);
-
-  constexpr int NAME_WIDTH = 13;
-
-  cout << StatisticsTableHeader(NAME_WIDTH, 5) << endl;
+  return overhead;
+}
 
-  auto cf = FilterBenchmark<
-      CuckooFilter<uint64_t, 12 /* bits per item */, SingleTable /* not semi-sorted*/>>(
-      add_count, to_add, to_lookup);
+// Fills a filter up to each of the load points in turn, timing every Add(), and at each
+// point times lookups of an even mix of added and fresh keys, then the removal of the
+// most recently added keys, which are put back untimed. Stops early if the filter fills.
+template <typename Table>
+LatencyStatistics LatencyBenchmark(const Options& options, const vector<uint64_t>& to_add,
+    const vector<uint64_t>& to_lookup, uint64_t overhead) {
+  auto filter = FilterAPI<Table>::Construct(to_add.size() / options.load);
+  const size_t to_fill = KeysToAdd(options, to_add, filter.get());
+  LatencyStatistics result;
+  const auto elapsed = [overhead](uint64_t start) {
+    const auto ticks = NowTicks() - start;
+    return ticks > overhead ? ticks - overhead : 0;
+  };
+
+  size_t added = 0, fresh = 0, found_count = 0;
+  for (const int point : options.load_points) {
+    const size_t target = to_fill * point / 100;
+    LatencyHistogram& inserts = result["insert"][point];
+    bool full = false;
+    while (!full && added < target) {
+      const auto start = NowTicks();
+      full = !FilterAPI<Table>::Add(to_add[added], filter.get());
+      inserts.Record(elapsed(start));
+      added += !full;
+    }
+    if (added == 0) break;
+
+    LatencyHistogram& finds = result["find"][point];
+    LatencyHistogram& adapts = result["adapt"][point];
+    for (size_t i = 0; i < LATENCY_SAMPLE_SIZE; ++i) {
+      const uint64_t key = (i & 1) ? to_add[(i * 0x9e3779b97f4a7c15ull >> 1) % added]
+                                   : to_lookup[fresh++ % to_lookup.size()];
+      const size_t adaptations = FilterAPI<Table>::Adaptations(filter.get());
+      const auto start = NowTicks();
+      found_count += FilterAPI<Table>::Contain(key, filter.get());
+      const auto ticks = elapsed(start);
+      if (FilterAPI<Table>::Adaptations(filter.get()) != adaptations) {
+        adapts.Record(ticks);
+      } else {
+        finds.Record(ticks);
+      }
+    }
 
-  cout << setw(NAME_WIDTH) << "Cuckoo12" << cf << endl;
+    if (FilterAPI<Table>::kCanRemove) {
+      LatencyHistogram& erases = result["erase"][point];
+      const size_t remove_count = min(LATENCY_REMOVE_SIZE, added / 2);
+      for (size_t i = added - remove_count; i < added; ++i) {
+        const auto start = NowTicks();
+        const bool removed = FilterAPI<Table>::Remove(to_add[i], filter.get());
+        erases.Record(elapsed(start));
+        if (!removed) throw logic_error("An added key could not be removed");
+      }
+      for (size_t i = added - remove_count; i < added; ++i) {
+        if (!FilterAPI<Table>::Add(to_add[i], filter.get())) {
+          throw logic_error("A removed key could not be added back");
+        }
+      }
+    }
+    if (full) break;
+  }
+  UseCount(found_count);
+  return result;
+}
 
-  cf = FilterBenchmark<
-      CuckooFilter<uint64_t, 13 /* bits per item */, PackedTable /* semi-sorted*/>>(
-      add_count, to_add, to_lookup);
+// The percentiles reported by the latency mode, with 100 for the maximum:
+const double LATENCY_PERCENTILES[] = {50, 90, 99, 99.9, 100};
+const char* const LATENCY_PERCENTILE_NAMES[] = {"p50", "p90", "p99", "p99.9", "max"};
 
-  cout << setw(NAME_WIDTH) << "SemiSort13" << cf << endl;
+// The tick rate and timer overhead of NowTicks(), for the latency mode:
+struct TickClock {
+  uint64_t overhead;
+  double ticks_per_nano;
+};
 
-  cf = FilterBenchmark<
-      CuckooFilter<uint64_t, 8 /* bits per item */, SingleTable /* not semi-sorted*/>>(
-      add_count, to_add, to_lookup);
+string LatencyTableHeader(int type_width) {
+  ostringstream os;
+  os << string(type_width, ' ') << setw(8) << right << "op" << setw(7) << "load"
+     << setw(10) << "count";
+  for (const char* name : LATENCY_PERCENTILE_NAMES) os << setw(10) << name;
+  os << "  (ns)";
+  return os.str();
+}
 
-  cout << setw(NAME_WIDTH) << "Cuckoo8" << cf << endl;
+// Prints a row per operation and load point, converting ticks to nanoseconds.
+void PrintLatency(const string& name, int type_width, const LatencyStatistics& stats,
+    double ticks_per_nano) {
+  for (const char* op : LATENCY_OPERATIONS) {
+    if (!stats.count(op)) continue;
+    for (const auto& point : stats.at(op)) {
+      const LatencyHistogram& histogram = point.second;
+      if (histogram.Count() == 0) continue;
+      cout << setw(type_width) << right << name << setw(8) << op << setw(6) << point.first
+           << '%' << setw(10) << histogram.Count() << fixed << setprecision(1);
+      for (const double percentile : LATENCY_PERCENTILES) {
+        cout << setw(10) << histogram.Percentile(percentile) / ticks_per_nano;
+      }
+      cout << endl;
+    }
+  }
+}
 
-  cf = FilterBenchmark<
-      CuckooFilter<uint64_t, 9 /* bits per item */, PackedTable /* semi-sorted*/>>(
-      add_count, to_add, to_lookup);
+// Writes the latency results as a JSON object, in nanoseconds.
+void WriteLatencyJson(ostream& os, const Options& options,
+    const vector<pair<string, LatencyStatistics>>& results, double ticks_per_nano) {
+  os << setprecision(10) << "{\n  \"items\": " << options.items
+     << ",\n  \"load\": " << options.load << ",\n  \"ticks_per_nano\": "
+     << ticks_per_nano << ",\n  \"latency_ns\": [";
+  bool first = true;
+  for (const auto& result : results) {
+    for (const char* op : LATENCY_OPERATIONS) {
+      if (!result.second.count(op)) continue;
+      for (const auto& point : result.second.at(op)) {
+        const LatencyHistogram& histogram = point.second;
+        if (histogram.Count() == 0) continue;
+        os << (first ? "" : ",") << "\n    {\"name\": \"" << result.first
+           << "\", \"op\": \"" << op << "\", \"load_percent\": " << point.first
+           << ", \"count\": " << histogram.Count();
+        for (size_t i = 0; i < sizeof(LATENCY_PERCENTILES) / sizeof(double); ++i) {
+          os << ", \"" << LATENCY_PERCENTILE_NAMES[i] << "\": "
+             << histogram.Percentile(LATENCY_PERCENTILES[i]) / ticks_per_nano;
+        }
+        os << "}";
+        first = false;
+      }
+    }
+  }
+  os << "\n  ]\n}\n";
+}
 
-  cout << setw(NAME_WIDTH) << "SemiSort9" << cf << endl;
+string PerfTableHeader(int type_width) {
+  ostringstream os;
+  os << string(type_width, ' ') << setw(10) << right << "phase" << setw(9) << "Mops/s"
+     << setw(9) << "cycles" << setw(9) << "instrs" << setw(6) << "IPC" << setw(10)
+     << "LLC miss" << setw(11) << "dTLB miss" << setw(9) << "br miss" << "  (per op)";
+  return os.str();
+}
 
-  cf = FilterBenchmark<
-      CuckooFilter<uint64_t, 16 /* bits per item */, SingleTable /* not semi-sorted*/>>(
-      add_count, to_add, to_lookup);
+// Prints a row per phase, with the counts per operation.
+void PrintPerf(const string& name, int type_width, const vector<PhaseCounts>& phases) {
+  constexpr double NANOS_PER_MILLION = 1000;
+  const int widths[kNumPerfEvents] = {9, 9, 10, 11, 9};
+  for (const PhaseCounts& phase : phases) {
+    const PerfCounts& counts = phase.counts;
+    cout << setw(type_width) << right << name << setw(10) << phase.phase << fixed
+         << setprecision(2) << setw(9) << phase.ops_per_nano * NANOS_PER_MILLION;
+    for (int event = 0; event < kNumPerfEvents; ++event) {
+      if (event == kLlcMisses) {
+        // Instructions per cycle, between the counts it comes from and the misses:
+        if (counts.Valid(kCycles) && counts.Valid(kInstructions) &&
+            counts.count[kCycles] > 0) {
+          cout << setw(6) << counts.count[kInstructions] / counts.count[kCycles];
+        } else {
+          cout << setw(6) << "-";
+        }
+      }
+      if (counts.Valid(event)) {
+        cout << setprecision(event < kLlcMisses ? 1 : 3) << setw(widths[event])
+             << counts.count[event] / phase.operations;
+      } else {
+        cout << setw(widths[event]) << "-";
+      }
+    }
+    cout << endl;
+  }
+}
 
-  cout << setw(NAME_WIDTH) << "Cuckoo16" << cf << endl;
+constexpr int NAME_WIDTH = 15;
 
-  cf = FilterBenchmark<
-      CuckooFilter<uint64_t, 17 /* bits per item */, PackedTable /* semi-sorted*/>>(
-      add_count, to_add, to_lookup);
+// Benchmarks Table under 'name' unless the command line left it out, in bulk or, with
+// --latency, one operation at a time. counters is null without --perf.
+template <typename Table>
+void Run(const string& name, const Options& options, const vector<uint64_t>& to_add,
+    const vector<uint64_t>& to_lookup, const TickClock& clock, PerfCounters* counters,
+    vector<pair<string, Statistics>>* results,
+    vector<pair<string, LatencyStatistics>>* latency_results) {
+  if (!options.filters.empty() && !options.filters.count(name)) return;
+  if (options.latency) {
+    const auto stats = LatencyBenchmark<Table>(options, to_add, to_lookup, clock.overhead);
+    PrintLatency(name, NAME_WIDTH, stats, clock.ticks_per_nano);
+    latency_results->emplace_back(name, stats);
+    return;
+  }
+  const auto stats = FilterBenchmark<Table>(options, to_add, to_lookup, counters);
+  cout << setw(NAME_WIDTH) << name << stats << endl;
+  results->emplace_back(name, stats);
+}
 
-  cout << setw(NAME_WIDTH) << "SemiSort17" << cf << endl;
+int main(int argc, char * argv[]) {
+  Options options;
+  options.items = 0;
+  options.load = 1.0;
+  options.find_percents = {0, 25, 50, 75, 100};
+  options.threads = 1;
+  options.latency = false;
+  options.load_points = {50, 75, 90, 95, 100};
+  options.perf = false;
+  const bool parsed = ParseFlags(argc, argv, &options,
+      [&options](const string& flag, const string& value) {
+        if (flag.compare(0, 2, "--") != 0) {
+          options.items = ParseNumber<size_t>("items", flag);
+        } else if (flag == "--items") {
+          options.items = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--load") {
+          options.load = ParseNumber<double>(flag, value);
+        } else if (flag == "--threads") {
+          options.threads = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--latency" && value.empty()) {
+          options.latency = true;
+        } else if (flag == "--perf" && value.empty()) {
+          options.perf = true;
+        } else if (flag == "--mix") {
+          options.find_percents = ParseNumberList<int>(flag, value);
+        } else if (flag == "--points") {
+          options.load_points = ParseNumberList<int>(flag, value);
+        } else if (flag == "--filters") {
+          for (const string& filter : SplitList(value)) options.filters.insert(filter);
+        } else {
+          return false;
+        }
+        return true;
+      });
+  if (!parsed) return 1;
+  sort(options.load_points.begin(), options.load_points.end());
+  if (options.items == 0 || !(options.load > 0) || options.threads == 0 ||
+      options.find_percents.empty() || options.load_points.empty() ||
+      options.load_points.front() <= 0 || options.load_points.back() > 100 ||
+      (options.perf && options.latency)) {
+    cerr << "Usage: " << argv[0] << " [--items=N] [--load=L] [--mix=P,P,...] "
+         << "[--threads=T] [--latency [--points=P,P,...] | --perf] "
+         << "[--filters=NAME,...] [--json=FILE] [N]" << endl;
+    return 1;
+  }
+  // The results are kept per percent in a map, so keep the columns in the same order:
+  sort(options.find_percents.begin(), options.find_percents.end());
+  options.find_percents.erase(
+      unique(options.find_percents.begin(), options.find_percents.end()),
+      options.find_percents.end());
+  if (options.find_percents.front() != 0) {
+    // ε is measured on the 0% mix:
+    options.find_percents.insert(options.find_percents.begin(), 0);
+  }
 
-  cf = FilterBenchmark<SimdBlockFilter<>>(add_count, to_add, to_lookup);
+  const vector<uint64_t> to_add = GenerateRandom64(options.items);
+  const vector<uint64_t> to_lookup = GenerateRandom64(SAMPLE_SIZE);
+  vector<pair<string, Statistics>> results;
+  vector<pair<string, LatencyStatistics>> latency_results;
+  TickClock clock = {0, 1};
+  unique_ptr<PerfCounters> counters;
+  if (options.perf) counters.reset(new PerfCounters);
+  if (options.latency) {
+    clock.overhead = TimerOverhead();
+    clock.ticks_per_nano = TicksPerNano();
+    cout << LatencyTableHeader(NAME_WIDTH) << endl;
+  } else {
+    cout << StatisticsTableHeader(NAME_WIDTH, options.find_percents) << endl;
+  }
 
-  cout << setw(NAME_WIDTH) << "SimdBlock8" << cf << endl;
+  Run<CuckooFilter<uint64_t, 12 /* bits per item */, SingleTable>>(
+      "Cuckoo12", options, to_add, to_lookup, clock, counters.get(), &results,
+      &latency_results);
+  Run<CuckooFilter<uint64_t, 8 /* bits per item */, SingleTable>>(
+      "Cuckoo8", options, to_add, to_lookup, clock, counters.get(), &results,
+      &latency_results);
+  Run<CuckooFilter<uint64_t, 16 /* bits per item */, SingleTable>>(
+      "Cuckoo16", options, to_add, to_lookup, clock, counters.get(), &results,
+      &latency_results);
+  Run<PackedCuckooFilter<13 /* bits per item */>>(
+      "Packed13", options, to_add, to_lookup, clock, counters.get(), &results,
+      &latency_results);
+  Run<SimdBlockFilter<>>(
+      "SimdBlock8", options, to_add, to_lookup, clock, counters.get(), &results,
+      &latency_results);
+  Run<SimdBlockFilter512<>>(
+      "SimdBlock512", options, to_add, to_lookup, clock, counters.get(), &results,
+      &latency_results);
+  Run<CountingSimdBlockFilter<>>(
+      "CountingBlock32", options, to_add, to_lookup, clock, counters.get(), &results,
+      &latency_results);
+
+  if (counters) {
+    cout << endl << PerfTableHeader(NAME_WIDTH) << endl;
+    for (const auto& result : results) {
+      PrintPerf(result.first, NAME_WIDTH, result.second.perf);
+    }
+  }
 
+  if (!WriteJsonFile(options, [&](ostream& json) {
+        if (options.latency) {
+          WriteLatencyJson(json, options, latency_results, clock.ticks_per_nano);
+        } else {
+          WriteJson(json, options, results);
+        }
+      })) {
+    return 3;
+  }
 }
@@ -4,17 +4,17 @@
 //
 // Results:
 //
-// metrics                                    CF     ss-CF
-// # of items (million)                   127.82    127.90
-// bits per item                           12.60     12.59
-// false positive rate                     0.18%     0.09%
-// constr. speed (million keys/sec)         5.86      4.10
+// metrics                                    CF
+// # of items (million)                   127.82
+// bits per item                           12.60
+// false positive rate                     0.18%
+// constr. speed (million keys/sec)         5.86
 
 #include <climits>
 #include <iomanip>
 #include <vector>
 
-#include "cuckoofilter.h"
+#include "filterapi.h"
 #include "random.h"
 #include "timing.h"
 
@@ -34,12 +34,14 @@ struct Metrics {
 
 template<typename Table>
 Metrics CuckooBenchmark(size_t add_count, const vector<uint64_t>& input) {
-  Table cuckoo(add_count);
+  auto cuckoo = FilterAPI<Table>::Construct(add_count);
   auto start_time = NowNanos();
 
   // Insert until failure:
   size_t inserted = 0;
-  while (inserted < input.size() && 0 == cuckoo.Add(input[inserted])) ++inserted;
+  while (inserted < input.size() && FilterAPI<Table>::Add(input[inserted], cuckoo.get())) {
+    ++inserted;
+  }
 
   auto constr_time = NowNanos() - start_time;
 
@@ -47,14 +49,15 @@ Metrics CuckooBenchmark(size_t add_count, const vector<uint64_t>& input) {
   size_t false_positive_count = 0;
   size_t absent = 0;
   for (; inserted + absent < input.size() && absent < FPR_SAMPLE_SIZE; ++absent) {
-    false_positive_count += (0 == cuckoo.Contain(input[inserted + absent]));
+    false_positive_count +=
+        FilterAPI<Table>::MayContain(input[inserted + absent], cuckoo.get());
   }
 
   // Calculate metrics:
   const auto time = constr_time / static_cast<double>(1000 * 1000 * 1000);
   Metrics result;
   result.add_count = static_cast<double>(inserted) / (1000 * 1000);
-  result.space = static_cast<double>(CHAR_BIT * cuckoo.SizeInBytes()) / inserted;
+  result.space = static_cast<double>(CHAR_BIT * cuckoo->SizeInBytes()) / inserted;
   result.fpr = (100.0 * false_positive_count) / absent;
   result.speed = (inserted / time) / (1000 * 1000);
   return result;
@@ -74,18 +77,13 @@ int main() {
   const auto cf = CuckooBenchmark<
       CuckooFilter<uint64_t, 12 /* bits per item */, SingleTable /* not semi-sorted*/>>(
       add_count, input);
-  const auto sscf = CuckooBenchmark<
-      CuckooFilter<uint64_t, 13 /* bits per item */, PackedTable /* semi-sorted*/>>(
-      add_count, input);
 
-  cout << setw(35) << left << "metrics " << setw(10) << right << "CF" << setw(10)
-       << "ss-CF" << endl
+  cout << setw(35) << left << "metrics " << setw(10) << right << "CF" << endl
        << fixed << setprecision(2) << setw(35) << left << "# of items (million) "
-       << setw(10) << right << cf.add_count << setw(10) << sscf.add_count << endl
-       << setw(35) << left << "bits per item " << setw(10) << right << cf.space
-       << setw(10) << sscf.space << endl
+       << setw(10) << right << cf.add_count << endl
+       << setw(35) << left << "bits per item " << setw(10) << right << cf.space << endl
        << setw(35) << left << "false positive rate " << setw(9) << right << cf.fpr << "%"
-       << setw(9) << sscf.fpr << "%" << endl
+       << endl
        << setw(35) << left << "constr. speed (million keys/sec) " << setw(10) << right
-       << cf.speed << setw(10) << sscf.speed << endl;
+       << cf.speed << endl;
 }
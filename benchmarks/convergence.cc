@@ -0,0 +1,199 @@
+// This benchmark shows how fast the adaptive CuckooFilter converges on a fixed set of
+// negative queries, and what adapting costs, for choosing the bits per tag. It is
+// invoked as:
+//
+//     ./convergence.exe [--negatives=M] [--rounds=K] [--bits=B,B,...] [--loads=L,L,...]
+//                       [--json=FILE]
+//
+// For each tag width B (4,8,12,16 by default) and load L (50,75,90,95 percent of the
+// slots by default) a fresh filter is filled to that load, and then the same M keys
+// never added (1000000 by default) are looked up with contains() K times over (10 by
+// default). For each round the table shows ε, the rate at which the filter passed those
+// keys on to the remote store, the adaptations made, the remote slots written by them
+// and millions of lookups per second. The last row of each configuration, round "end",
+// gives the ε that a further round would start from, measured with findinfilter().
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cuckoofilter.h"
+#include "driver.h"
+#include "random.h"
+#include "timing.h"
+
+using namespace std;
+
+using namespace cuckoofilter;
+
+// The added keys are MixKey(i) and the negative keys MixKey(NEGATIVE_BASE + i), so that
+// the two never overlap:
+const uint64_t NEGATIVE_BASE = 1ull << 62;
+
+// The flags of this benchmark, on top of CommonOptions:
+struct Options : CommonOptions {
+  size_t negatives;
+  unsigned rounds;
+  vector<unsigned> bits;
+  vector<unsigned> loads;  // Percent of the slots
+};
+
+// The statistics of one round of lookups of the negative keys:
+struct Statistics {
+  unsigned bits;
+  double load;    // The load actually reached
+  unsigned round;  // rounds + 1 for the findinfilter() pass after the last round
+  double epsilon;
+  size_t adaptations;
+  size_t remote_writes;
+  double mops;  // Zero for the findinfilter() pass
+};
+
+string StatisticsTableHeader() {
+  ostringstream os;
+  os << setw(5) << right << "bits" << setw(7) << "load" << setw(7) << "round"
+     << setw(10) << "ε" << setw(10) << "adapts" << setw(12) << "rm writes"
+     << setw(9) << "Mops/s";
+  return os.str();
+}
+
+template <class CharT, class Traits>
+basic_ostream<CharT, Traits>& operator<<(
+    basic_ostream<CharT, Traits>& os, const Statistics& stats) {
+  os << setw(5) << right << stats.bits << fixed << setprecision(1) << setw(6)
+     << 100 * stats.load << '%';
+  if (stats.mops > 0) {
+    os << setw(7) << stats.round;
+  } else {
+    os << setw(7) << "end";
+  }
+  os << setprecision(4) << setw(8) << 100 * stats.epsilon << '%' << setw(10)
+     << stats.adaptations << setw(12) << stats.remote_writes;
+  if (stats.mops > 0) {
+    os << setprecision(2) << setw(9) << stats.mops;
+  } else {
+    os << setw(9) << "-";
+  }
+  return os;
+}
+
+void WriteJson(ostream& os, const Options& options, const vector<Statistics>& results) {
+  os << setprecision(10) << "{\n  \"negatives\": " << options.negatives
+     << ",\n  \"rounds\": " << options.rounds << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Statistics& stats = results[i];
+    os << (i ? "," : "") << "\n    {\"bits\": " << stats.bits << ", \"load\": "
+       << stats.load << ", \"round\": ";
+    if (stats.mops > 0) {
+      os << stats.round;
+    } else {
+      os << "\"end\"";
+    }
+    os << ", \"epsilon\": " << stats.epsilon << ", \"adaptations\": "
+       << stats.adaptations << ", \"remote_writes\": " << stats.remote_writes
+       << ", \"mops\": ";
+    if (stats.mops > 0) {
+      os << stats.mops;
+    } else {
+      os << "null";
+    }
+    os << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+// Runs the rounds at every load for tags of bits_per_item bits.
+template <size_t bits_per_item>
+void Run(const Options& options, const vector<uint64_t>& negatives,
+    vector<Statistics>* results) {
+  for (const unsigned load : options.loads) {
+    CuckooFilter<uint64_t, bits_per_item> filter(0);
+    FillToLoad(load / 100.0, &filter);
+    Statistics stats;
+    stats.bits = bits_per_item;
+    stats.load = filter.LoadFactor();
+    for (unsigned round = 1; round <= options.rounds; ++round) {
+      const size_t adaptations_before = filter.adaptations();
+      const size_t writes_before = filter.remote_writes();
+      size_t false_positives = 0, found_count = 0;
+      const auto start_time = NowNanos();
+      for (const auto key : negatives) {
+        const size_t reads = filter.remote_reads();
+        found_count += filter.contains(key);
+        false_positives += filter.remote_reads() != reads;
+      }
+      const auto nanos = NowNanos() - start_time;
+      UseCount(found_count);
+      stats.round = round;
+      stats.epsilon = false_positives / static_cast<double>(negatives.size());
+      stats.adaptations = filter.adaptations() - adaptations_before;
+      stats.remote_writes = filter.remote_writes() - writes_before;
+      stats.mops = 1000.0 * negatives.size() / nanos;
+      cout << stats << endl;
+      results->push_back(stats);
+    }
+    size_t false_positives = 0;
+    for (const auto key : negatives) false_positives += filter.findinfilter(key);
+    stats.round = options.rounds + 1;
+    stats.epsilon = false_positives / static_cast<double>(negatives.size());
+    stats.adaptations = stats.remote_writes = 0;
+    stats.mops = 0;
+    cout << stats << endl;
+    results->push_back(stats);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.negatives = 1000 * 1000;
+  options.rounds = 10;
+  const bool parsed = ParseFlags(argc, argv, &options,
+      [&options](const string& flag, const string& value) {
+        if (flag == "--negatives") {
+          options.negatives = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--rounds") {
+          options.rounds = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--bits" || flag == "--loads") {
+          vector<unsigned>& list = flag == "--bits" ? options.bits : options.loads;
+          for (const unsigned item : ParseNumberList<unsigned>(flag, value)) {
+            list.push_back(item);
+          }
+        } else {
+          return false;
+        }
+        return true;
+      });
+  if (!parsed) return 1;
+  if (options.bits.empty()) options.bits = {4, 8, 12, 16};
+  if (options.loads.empty()) options.loads = {50, 75, 90, 95};
+  bool valid = options.negatives > 0 && options.rounds > 0;
+  for (const unsigned bits : options.bits) {
+    valid = valid && (bits == 4 || bits == 8 || bits == 12 || bits == 16);
+  }
+  for (const unsigned load : options.loads) valid = valid && load > 0 && load <= 100;
+  if (!valid) {
+    cerr << "Usage: " << argv[0] << " [--negatives=M] [--rounds=K] "
+         << "[--bits=4|8|12|16,...] [--loads=L,L,...] [--json=FILE]" << endl;
+    return 1;
+  }
+
+  vector<uint64_t> negatives(options.negatives);
+  for (size_t i = 0; i < negatives.size(); ++i) negatives[i] = MixKey(NEGATIVE_BASE + i);
+  vector<Statistics> results;
+
+  cout << StatisticsTableHeader() << endl;
+  for (const unsigned bits : options.bits) {
+    if (bits == 4) Run<4>(options, negatives, &results);
+    if (bits == 8) Run<8>(options, negatives, &results);
+    if (bits == 12) Run<12>(options, negatives, &results);
+    if (bits == 16) Run<16>(options, negatives, &results);
+  }
+
+  if (!WriteJsonFile(
+          options, [&](ostream& json) { WriteJson(json, options, results); })) {
+    return 3;
+  }
+}
@@ -0,0 +1,120 @@
+// Deployments: the ways threads share filters. Each is built for a capacity and a number
+// of threads, after which Build(t) is called once from each worker thread t, and Add(),
+// Contain() and Remove() from any of them.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "filterapi.h"
+
+// The shard of a key among n, from the high bits of a multiplicative hash so that it
+// stays independent of the bucket index the filter derives, as in filter-server.
+inline size_t ShardOf(uint64_t key, size_t n) {
+  return ((key * 0x9e3779b97f4a7c15ULL) >> 32) * n >> 32;
+}
+
+// All threads share one filter behind one mutex.
+template <typename Table>
+class Locked {
+  ::std::mutex lock_;
+  ::std::unique_ptr<Table> filter_;
+
+ public:
+  static constexpr bool kPartitioned = false;
+  static constexpr bool kCanRemove = FilterAPI<Table>::kCanRemove;
+  Locked(size_t capacity, unsigned) : filter_(FilterAPI<Table>::Construct(capacity)) {}
+  void Build(unsigned) {}
+  bool Add(uint64_t key, unsigned) {
+    ::std::lock_guard<::std::mutex> guard(lock_);
+    return FilterAPI<Table>::Add(key, filter_.get());
+  }
+  bool Contain(uint64_t key, unsigned) {
+    ::std::lock_guard<::std::mutex> guard(lock_);
+    return FilterAPI<Table>::Contain(key, filter_.get());
+  }
+  bool Remove(uint64_t key, unsigned) {
+    ::std::lock_guard<::std::mutex> guard(lock_);
+    return FilterAPI<Table>::Remove(key, filter_.get());
+  }
+};
+
+// One filter per thread, each behind its own mutex; any thread may reach any shard.
+template <typename Table>
+class Sharded {
+  struct Shard {
+    ::std::mutex lock;
+    ::std::unique_ptr<Table> filter;
+  };
+  ::std::vector<::std::unique_ptr<Shard>> shards_;
+
+ public:
+  static constexpr bool kPartitioned = false;
+  static constexpr bool kCanRemove = FilterAPI<Table>::kCanRemove;
+  Sharded(size_t capacity, unsigned threads) {
+    for (unsigned i = 0; i < threads; ++i) {
+      shards_.push_back(::std::unique_ptr<Shard>(new Shard));
+      shards_.back()->filter = FilterAPI<Table>::Construct(capacity / threads + 1);
+    }
+  }
+  void Build(unsigned) {}
+  bool Add(uint64_t key, unsigned) {
+    Shard& shard = *shards_[ShardOf(key, shards_.size())];
+    ::std::lock_guard<::std::mutex> guard(shard.lock);
+    return FilterAPI<Table>::Add(key, shard.filter.get());
+  }
+  bool Contain(uint64_t key, unsigned) {
+    Shard& shard = *shards_[ShardOf(key, shards_.size())];
+    ::std::lock_guard<::std::mutex> guard(shard.lock);
+    return FilterAPI<Table>::Contain(key, shard.filter.get());
+  }
+  bool Remove(uint64_t key, unsigned) {
+    Shard& shard = *shards_[ShardOf(key, shards_.size())];
+    ::std::lock_guard<::std::mutex> guard(shard.lock);
+    return FilterAPI<Table>::Remove(key, shard.filter.get());
+  }
+};
+
+// One filter per thread, built by its thread and used by it alone, with no locks.
+template <typename Table>
+class Partitioned {
+  const size_t capacity_;
+  ::std::vector<::std::unique_ptr<Table>> shards_;
+
+ public:
+  static constexpr bool kPartitioned = true;
+  static constexpr bool kCanRemove = FilterAPI<Table>::kCanRemove;
+  Partitioned(size_t capacity, unsigned threads)
+    : capacity_(capacity / threads + 1), shards_(threads) {}
+  void Build(unsigned t) { shards_[t] = FilterAPI<Table>::Construct(capacity_); }
+  bool Add(uint64_t key, unsigned t) {
+    return FilterAPI<Table>::Add(key, shards_[t].get());
+  }
+  bool Contain(uint64_t key, unsigned t) {
+    return FilterAPI<Table>::Contain(key, shards_[t].get());
+  }
+  bool Remove(uint64_t key, unsigned t) {
+    return FilterAPI<Table>::Remove(key, shards_[t].get());
+  }
+};
+
+// One SimdBlockFilter shared without locks: Find() runs alongside AddConcurrent().
+class AtomicBlock {
+  ::std::unique_ptr<SimdBlockFilter<>> filter_;
+
+ public:
+  static constexpr bool kPartitioned = false;
+  static constexpr bool kCanRemove = false;
+  AtomicBlock(size_t capacity, unsigned)
+    : filter_(FilterAPI<SimdBlockFilter<>>::Construct(capacity)) {}
+  void Build(unsigned) {}
+  bool Add(uint64_t key, unsigned) {
+    filter_->AddConcurrent(key);
+    return true;
+  }
+  bool Contain(uint64_t key, unsigned) { return filter_->Find(key); }
+  bool Remove(uint64_t, unsigned) { return false; }
+};
@@ -0,0 +1,106 @@
+// What the benchmark drivers share: parsing their --flag=value command lines, writing
+// --json output, keeping lookups from being optimized out, and filling a filter to a
+// load.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "random.h"
+
+// The parameters of a run that every driver takes, as given on the command line. Each
+// driver's Options derives from this and adds its own flags.
+struct CommonOptions {
+  ::std::string json;  // Empty for no JSON output
+};
+
+// Parses one number, exiting with a message on failure.
+template <typename T>
+T ParseNumber(const ::std::string& flag, const ::std::string& text) {
+  ::std::stringstream input_string(text);
+  T result;
+  input_string >> result;
+  if (input_string.fail() || !input_string.eof()) {
+    ::std::cerr << "Invalid number for " << flag << ": " << text << ::std::endl;
+    ::std::exit(2);
+  }
+  return result;
+}
+
+// The items of a comma-separated list.
+inline ::std::vector<::std::string> SplitList(const ::std::string& value) {
+  ::std::vector<::std::string> items;
+  ::std::stringstream list(value);
+  ::std::string item;
+  while (::std::getline(list, item, ',')) items.push_back(item);
+  return items;
+}
+
+// The numbers of a comma-separated list, exiting with a message on failure.
+template <typename T>
+::std::vector<T> ParseNumberList(const ::std::string& flag, const ::std::string& value) {
+  ::std::vector<T> numbers;
+  for (const auto& item : SplitList(value)) numbers.push_back(ParseNumber<T>(flag, item));
+  return numbers;
+}
+
+// Parses argv[1..argc) as --flag=value arguments, in order. --json is taken into
+// options; every other argument is passed to parse as its flag, the part before any
+// '=', and its value, the part after it. An argument that does not start with "--" is
+// passed whole as the flag. Returns false, after a message, at the first argument parse
+// does not know.
+inline bool ParseFlags(int argc, char* argv[], CommonOptions* options,
+    const ::std::function<bool(const ::std::string& flag, const ::std::string& value)>&
+        parse) {
+  for (int i = 1; i < argc; ++i) {
+    const ::std::string arg = argv[i];
+    const bool is_flag = arg.compare(0, 2, "--") == 0;
+    const size_t equals = is_flag ? arg.find('=') : ::std::string::npos;
+    const ::std::string flag = arg.substr(0, equals);
+    const ::std::string value =
+        equals == ::std::string::npos ? "" : arg.substr(equals + 1);
+    if (flag == "--json") {
+      options->json = value;
+    } else if (!parse(flag, value)) {
+      ::std::cerr << "Unknown flag: " << arg << ::std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the --json output, if asked for, with write. Returns false, after a message,
+// if the file could not be written.
+inline bool WriteJsonFile(
+    const CommonOptions& options, const ::std::function<void(::std::ostream&)>& write) {
+  if (options.json.empty()) return true;
+  ::std::ofstream json(options.json);
+  write(json);
+  if (!json) {
+    ::std::cerr << "Could not write " << options.json << ::std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Use the count of a timed loop, to keep the compiler from optimizing out the lookups
+// it counts.
+inline void UseCount(size_t found_count) {
+  if (found_count == SIZE_MAX) ::std::exit(1);
+}
+
+// Inserts MixKey(0), MixKey(1), ... with their index as value until filter holds at
+// least one key and load of its slots, or an insert fails.
+template <typename Filter>
+void FillToLoad(double load, Filter* filter) {
+  for (::std::uint64_t i = 0; filter->Size() == 0 || filter->LoadFactor() < load; ++i) {
+    if (!filter->insert(MixKey(i), i)) break;
+  }
+}
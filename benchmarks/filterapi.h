@@ -0,0 +1,139 @@
+// Adapters that give every filter and table configuration the same interface, so that a
+// benchmark can run all of them over the same workloads.
+//
+// FilterAPI<Table> provides:
+//
+//     static unique_ptr<Table> Construct(size_t capacity);
+//       A filter sized for capacity keys. Some filters are built on the heap and cannot
+//       be moved, so it is returned by pointer.
+//     static bool Add(uint64_t key, Table* table);
+//       False once the filter is full.
+//     static bool Contain(uint64_t key, Table* table);
+//       An exact answer for filters that store keys. Not const: the adaptive
+//       CuckooFilter changes on false positives.
+//     static bool MayContain(uint64_t key, Table* table);
+//       The answer of the filter alone, false positives included.
+//     static bool Remove(uint64_t key, Table* table);
+//       Only meaningful when kCanRemove.
+//     static size_t Adaptations(const Table* table);
+//       How many times the filter has adapted to a false positive so far.
+//     static size_t FixedCapacity(const Table* table);
+//       The capacity of a filter whose size ignores the one passed to Construct(), or 0.
+//
+// and two traits: kCanRemove, and kConcurrentContain, whether Contain() may be called
+// from several threads at once while nothing is added or removed.
+
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <memory>
+
+#include "cuckoofilter.h"
+#include "packedcuckoofilter.h"
+#include "simd-block.h"
+#include "simd-block-512.h"
+#include "simd-block-counting.h"
+
+template<typename Table>
+struct FilterAPI {};
+
+// The adaptive filter. Contain() is contains(), which checks the remote key of every
+// matching tag and adapts the tags of false positives; MayContain() is findinfilter().
+// Every key is stored with itself as the value. The capacity is fixed by the CuckooFilter
+// constructor itself. Only SingleTable provides the per-slot tags CuckooFilter needs;
+// PackedTable is measured through PackedCuckooFilter.
+template <typename ItemType, size_t bits_per_item, template <size_t> class TableType>
+struct FilterAPI<::cuckoofilter::CuckooFilter<ItemType, bits_per_item, TableType>> {
+  using Table = ::cuckoofilter::CuckooFilter<ItemType, bits_per_item, TableType>;
+  static constexpr bool kCanRemove = true;
+  static constexpr bool kConcurrentContain = false;
+  static ::std::unique_ptr<Table> Construct(size_t capacity) {
+    return ::std::unique_ptr<Table>(new Table(capacity));
+  }
+  static bool Add(uint64_t key, Table* table) { return table->insert(key, key); }
+  static bool Contain(uint64_t key, Table* table) { return table->contains(key); }
+  static bool MayContain(uint64_t key, Table* table) { return table->findinfilter(key); }
+  static bool Remove(uint64_t key, Table* table) { return table->erase(key); }
+  static size_t Adaptations(const Table* table) { return table->adaptations(); }
+  static size_t FixedCapacity(const Table* table) { return table->Capacity(); }
+};
+
+// The plain cuckoo filter over PackedTable of packedcuckoofilter.h, which stores no keys,
+// so Contain() is MayContain().
+template <size_t bits_per_item>
+struct FilterAPI<::cuckoofilter::PackedCuckooFilter<bits_per_item>> {
+  using Table = ::cuckoofilter::PackedCuckooFilter<bits_per_item>;
+  static constexpr bool kCanRemove = true;
+  static constexpr bool kConcurrentContain = true;
+  static ::std::unique_ptr<Table> Construct(size_t capacity) {
+    return ::std::unique_ptr<Table>(new Table(capacity));
+  }
+  static bool Add(uint64_t key, Table* table) { return table->Add(key); }
+  static bool Contain(uint64_t key, Table* table) { return table->Contain(key); }
+  static bool MayContain(uint64_t key, Table* table) { return table->Contain(key); }
+  static bool Remove(uint64_t key, Table* table) { return table->Remove(key); }
+  static size_t Adaptations(const Table*) { return 0; }
+  static size_t FixedCapacity(const Table*) { return 0; }
+};
+
+// The block filters cannot fill up or remove keys. They get 8 bits per key of capacity:
+template <>
+struct FilterAPI<SimdBlockFilter<>> {
+  using Table = SimdBlockFilter<>;
+  static constexpr bool kCanRemove = false;
+  static constexpr bool kConcurrentContain = true;
+  static ::std::unique_ptr<Table> Construct(size_t capacity) {
+    return ::std::unique_ptr<Table>(new Table(Table::WithBytes(capacity * 8 / CHAR_BIT)));
+  }
+  static bool Add(uint64_t key, Table* table) {
+    table->Add(key);
+    return true;
+  }
+  static bool Contain(uint64_t key, Table* table) { return table->Find(key); }
+  static bool MayContain(uint64_t key, Table* table) { return table->Find(key); }
+  static bool Remove(uint64_t, Table*) { return false; }
+  static size_t Adaptations(const Table*) { return 0; }
+  static size_t FixedCapacity(const Table*) { return 0; }
+};
+
+template <>
+struct FilterAPI<SimdBlockFilter512<>> {
+  using Table = SimdBlockFilter512<>;
+  static constexpr bool kCanRemove = false;
+  static constexpr bool kConcurrentContain = true;
+  static ::std::unique_ptr<Table> Construct(size_t capacity) {
+    return ::std::unique_ptr<Table>(new Table(Table::WithBytes(capacity * 8 / CHAR_BIT)));
+  }
+  static bool Add(uint64_t key, Table* table) {
+    table->Add(key);
+    return true;
+  }
+  static bool Contain(uint64_t key, Table* table) { return table->Find(key); }
+  static bool MayContain(uint64_t key, Table* table) { return table->Find(key); }
+  static bool Remove(uint64_t, Table*) { return false; }
+  static size_t Adaptations(const Table*) { return 0; }
+  static size_t FixedCapacity(const Table*) { return 0; }
+};
+
+// Four-bit counters need four times the space for a similar ε, so 32 bits per key:
+template <>
+struct FilterAPI<CountingSimdBlockFilter<>> {
+  using Table = CountingSimdBlockFilter<>;
+  static constexpr bool kCanRemove = true;
+  static constexpr bool kConcurrentContain = true;
+  static ::std::unique_ptr<Table> Construct(size_t capacity) {
+    return ::std::unique_ptr<Table>(
+        new Table(Table::WithBytes(capacity * 32 / CHAR_BIT)));
+  }
+  static bool Add(uint64_t key, Table* table) {
+    table->Add(key);
+    return true;
+  }
+  static bool Contain(uint64_t key, Table* table) { return table->Find(key); }
+  static bool MayContain(uint64_t key, Table* table) { return table->Find(key); }
+  static bool Remove(uint64_t key, Table* table) { return table->Remove(key); }
+  static size_t Adaptations(const Table*) { return 0; }
+  static size_t FixedCapacity(const Table*) { return 0; }
+};
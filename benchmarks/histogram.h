@@ -0,0 +1,75 @@
+// A histogram of latencies in the manner of HdrHistogram, for reporting percentiles of
+// millions of single operations without storing them.
+//
+// Values below 2^(kSubBucketBits + 1) are counted exactly. Above that, each power of two
+// is split into 2^kSubBucketBits equal buckets, so a percentile is never off by more than
+// 1 / 2^kSubBucketBits of its value (3% here), from 0 up to 2^64 - 1, in 15 KiB.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 5;
+
+  LatencyHistogram()
+    : counts_((65 - kSubBucketBits) << kSubBucketBits, 0),
+      count_(0),
+      max_(0) {}
+
+  void Record(uint64_t value) {
+    ++counts_[BucketOf(value)];
+    ++count_;
+    max_ = ::std::max(max_, value);
+  }
+
+  void Merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    max_ = ::std::max(max_, other.max_);
+  }
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+
+  // The smallest value that at least 'percent' percent of the values recorded do not
+  // exceed, up to the bucket width, or 0 if nothing was recorded.
+  uint64_t Percentile(double percent) const {
+    const uint64_t rank = ::std::max<uint64_t>(1, ::std::ceil(percent / 100 * count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return ::std::min(HighestInBucket(i), max_);
+    }
+    return max_;
+  }
+
+ private:
+  // Buckets come in groups of 2^kSubBucketBits. Groups 0 and 1 hold the values below
+  // 2^(kSubBucketBits + 1), one per bucket; group g > 1 covers the values from
+  // 2^(g + kSubBucketBits - 1) up to 2^(g + kSubBucketBits) in buckets 2^(g - 1) wide.
+  static size_t BucketOf(uint64_t value) {
+    if (value < (uint64_t{2} << kSubBucketBits)) return value;
+    const int msb = 63 - __builtin_clzll(value);
+    const int shift = msb - kSubBucketBits;
+    return (static_cast<size_t>(shift + 1) << kSubBucketBits) +
+           (value >> shift) - (uint64_t{1} << kSubBucketBits);
+  }
+
+  static uint64_t HighestInBucket(size_t bucket) {
+    const size_t group = bucket >> kSubBucketBits;
+    if (group <= 1) return bucket;
+    const int shift = group - 1;
+    const uint64_t sub = bucket & ((size_t{1} << kSubBucketBits) - 1);
+    const uint64_t lowest = ((uint64_t{1} << kSubBucketBits) + sub) << shift;
+    return lowest + ((uint64_t{1} << shift) - 1);
+  }
+
+  ::std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t max_;
+};
@@ -0,0 +1,621 @@
+// This benchmark measures response times at a given offered load, as a serving tier sees
+// them, to find the load beyond which they blow up. It is invoked as:
+//
+//     ./open-loop.exe [--mode=MODE | --server=PATH] [--threads=T] [--items=N]
+//                     [--writes=P] [--rates=R,R,...] [--start=R] [--step=F]
+//                     [--seconds=S] [--slo=US] [--json=FILE]
+//
+// Operations arrive as a Poisson process at the offered rate, R per second split evenly
+// over T clients (1 by default), whatever became of the earlier ones, and each is timed
+// from its scheduled arrival rather than from when it was issued. A closed loop, where
+// each operation waits for the last, slows down along with the system under test and so
+// leaves out the very queueing delays that make up the tail ("coordinated omission").
+//
+// The operations are lookups, half of them of the N keys added beforehand (100000 by
+// default), and P% writes (10 by default), each replacing one of the client's keys by a
+// new one. They go either to an in-process deployment of the filters as in scaling.exe,
+// MODE being one of cuckoo-locked, cuckoo-sharded (the default), block-locked and
+// block-atomic, or to a filter-server listening on the Unix domain socket PATH.
+//
+// In process, each client is a thread making the calls itself, so an operation arriving
+// while the last one still runs waits its turn. Against a server, each client sends
+// every operation as it falls due, over its own connection, while a second thread takes
+// in the responses, so that the queues build up in the server instead. Either way an
+// operation not yet issued S seconds after the end of its run is dropped. If the server
+// goes away or answers wrongly, the clients stop and the sweep ends with exit status 4.
+//
+// Each offered rate runs for S seconds (1 by default), the first 10% of which are not
+// measured. Without --rates, the rate starts at --start (100000 per second by default)
+// and grows by a factor of F (1.5 by default) until the system stops keeping up, that is
+// completes under 95% of the operations offered or takes over --slo microseconds (1000
+// by default) at the 99th percentile. The knee is the highest rate that kept up.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "deployments.h"
+#include "driver.h"
+#include "filterapi.h"
+#include "histogram.h"
+#include "random.h"
+#include "server-protocol.h"
+#include "timing.h"
+
+using namespace std;
+
+using namespace cuckoofilter;
+
+// The share of each run left out of the measurements, while the queues settle:
+const double WARMUP_FRACTION = 0.1;
+
+// The least share of the operations offered that a run must complete to keep up:
+const double KEEP_UP_FRACTION = 0.95;
+
+// The number of rates tried at most when sweeping:
+const int MAX_SWEEP_STEPS = 40;
+
+// The flags of this benchmark, on top of CommonOptions:
+struct Options : CommonOptions {
+  string mode;
+  string server;  // Empty to run in process
+  unsigned threads;
+  size_t items;
+  unsigned writes;       // Percent of the operations
+  vector<double> rates;  // Empty to sweep
+  double start_rate;
+  double step;
+  double seconds;
+  double slo_micros;
+};
+
+// The keys of one client and the generator of its operations and their arrival times.
+class Client {
+  vector<uint64_t> owned_;
+  uint64_t seed_;
+  size_t next_write_;
+
+ public:
+  Client(vector<uint64_t> owned, uint64_t seed)
+    : owned_(move(owned)), seed_(seed), next_write_(0) {}
+
+  const vector<uint64_t>& owned() const { return owned_; }
+
+  // Returns true for a write, replacing *old_key, the oldest of the client's keys, by
+  // *key, or false for a lookup of *key.
+  bool Next(unsigned writes, uint64_t* key, uint64_t* old_key) {
+    const uint64_t r = SplitMix64(&seed_);
+    if (r % 100 < writes) {
+      uint64_t& slot = owned_[next_write_++ % owned_.size()];
+      *old_key = slot;
+      *key = slot = SplitMix64(&seed_);
+      return true;
+    }
+    *key = ((r >> 32) & 1) ? owned_[(r >> 33) % owned_.size()] : SplitMix64(&seed_);
+    return false;
+  }
+
+  // The time to the next arrival, in nanoseconds, of a Poisson process with the given
+  // mean time between arrivals.
+  double NextGap(double mean_nanos) {
+    const double uniform = ((SplitMix64(&seed_) >> 11) + 1) * (1.0 / (1ull << 53));
+    return -log(uniform) * mean_nanos;
+  }
+};
+
+// Splits the keys added beforehand between the clients.
+vector<Client> MakeClients(const Options& options, const vector<uint64_t>& items) {
+  vector<Client> clients;
+  for (unsigned t = 0; t < options.threads; ++t) {
+    clients.emplace_back(
+        vector<uint64_t>(items.begin() + items.size() * t / options.threads,
+            items.begin() + items.size() * (t + 1) / options.threads),
+        0x5eed + t);
+  }
+  return clients;
+}
+
+// Sleeps, then yields, until NowNanos() reaches 'at'. Yielding rather than spinning
+// leaves the CPU to the system under test when it shares the machine.
+void WaitUntil(uint64_t at) {
+  for (uint64_t now = NowNanos(); now < at; now = NowNanos()) {
+    if (at - now > 200 * 1000) {
+      this_thread::sleep_for(chrono::nanoseconds(at - now - 100 * 1000));
+    } else {
+      this_thread::yield();
+    }
+  }
+}
+
+// The times of one run, in NowNanos(), and what one client measured of it:
+struct RunWindow {
+  uint64_t start;
+  uint64_t measure_from;  // Operations scheduled before are not measured
+  uint64_t end;           // No operation is scheduled from then on
+  uint64_t give_up;       // Operations not issued by then are dropped
+};
+
+struct ClientResult {
+  LatencyHistogram latency;  // In nanoseconds
+  uint64_t completed = 0;
+  uint64_t last_completion = 0;
+
+  void Record(uint64_t scheduled, const RunWindow& window) {
+    if (scheduled < window.measure_from) return;
+    const uint64_t now = NowNanos();
+    latency.Record(now - scheduled);
+    ++completed;
+    last_completion = now;
+  }
+};
+
+RunWindow MakeWindow(const Options& options) {
+  RunWindow window;
+  const uint64_t length = options.seconds * 1e9;
+  window.start = NowNanos() + 1000 * 1000;
+  window.measure_from = window.start + WARMUP_FRACTION * length;
+  window.end = window.start + length;
+  window.give_up = window.end + length;
+  return window;
+}
+
+// The statistics of one offered rate:
+struct Statistics {
+  double offered;   // Operations per second
+  double achieved;  // Operations per second completed
+  LatencyHistogram latency;
+  bool kept_up;
+};
+
+string StatisticsTableHeader() {
+  ostringstream os;
+  os << setw(10) << right << "offered" << setw(10) << "achieved" << setw(10) << "p50"
+     << setw(10) << "p90" << setw(10) << "p99" << setw(10) << "p99.9" << setw(10)
+     << "max" << setw(9) << "kept up" << endl;
+  os << setw(10) << "Mops/s" << setw(10) << "Mops/s" << setw(10) << "us" << setw(10)
+     << "us" << setw(10) << "us" << setw(10) << "us" << setw(10) << "us";
+  return os.str();
+}
+
+template <class CharT, class Traits>
+basic_ostream<CharT, Traits>& operator<<(
+    basic_ostream<CharT, Traits>& os, const Statistics& stats) {
+  constexpr double NANOS_PER_MICRO = 1000;
+  os << fixed << setprecision(3) << setw(10) << right << stats.offered / 1e6 << setw(10)
+     << stats.achieved / 1e6 << setprecision(2);
+  for (const double percentile : {50.0, 90.0, 99.0, 99.9, 100.0}) {
+    os << setw(10) << stats.latency.Percentile(percentile) / NANOS_PER_MICRO;
+  }
+  os << setw(9) << (stats.kept_up ? "yes" : "no");
+  return os;
+}
+
+// Combines what the clients measured of a run at one offered rate.
+Statistics Summarize(const Options& options, double rate, const RunWindow& window,
+    const vector<ClientResult>& clients) {
+  Statistics stats;
+  stats.offered = rate;
+  uint64_t completed = 0, last_completion = window.measure_from;
+  for (const auto& client : clients) {
+    stats.latency.Merge(client.latency);
+    completed += client.completed;
+    last_completion = max(last_completion, client.last_completion);
+  }
+  const double measured_seconds = (1 - WARMUP_FRACTION) * options.seconds;
+  stats.achieved =
+      completed / max(measured_seconds, (last_completion - window.measure_from) / 1e9);
+  stats.kept_up = stats.achieved >= KEEP_UP_FRACTION * rate &&
+                  stats.latency.Percentile(99) <= options.slo_micros * 1000;
+  return stats;
+}
+
+// Runs each rate of --rates or of the sweep, printing its statistics as it ends.
+vector<Statistics> Sweep(
+    const Options& options, const function<Statistics(double)>& run_at) {
+  vector<Statistics> results;
+  if (!options.rates.empty()) {
+    for (const double rate : options.rates) {
+      results.push_back(run_at(rate));
+      cout << results.back() << endl;
+    }
+    return results;
+  }
+  double rate = options.start_rate;
+  for (int i = 0; i < MAX_SWEEP_STEPS; ++i, rate *= options.step) {
+    results.push_back(run_at(rate));
+    cout << results.back() << endl;
+    if (!results.back().kept_up) break;
+  }
+  return results;
+}
+
+// Runs the sweep against an in-process Deployment, filled with the items beforehand.
+template <typename Deployment>
+vector<Statistics> RunInProcess(const Options& options, const vector<uint64_t>& items) {
+  Deployment deployment(options.items, options.threads);
+  vector<Client> clients = MakeClients(options, items);
+  for (unsigned t = 0; t < options.threads; ++t) {
+    deployment.Build(t);
+    for (const auto key : clients[t].owned()) deployment.Add(key, t);
+  }
+  return Sweep(options, [&](double rate) {
+    const RunWindow window = MakeWindow(options);
+    const double mean_gap = 1e9 * options.threads / rate;
+    vector<ClientResult> results(options.threads);
+    vector<thread> workers;
+    for (unsigned t = 0; t < options.threads; ++t) {
+      workers.emplace_back([&, t]() {
+        Client& client = clients[t];
+        size_t found_count = 0;
+        double next = window.start;
+        for (;;) {
+          next += client.NextGap(mean_gap);
+          const uint64_t at = next;
+          if (at >= window.end) break;
+          WaitUntil(at);
+          if (NowNanos() >= window.give_up) break;
+          uint64_t key, old_key;
+          if (client.Next(options.writes, &key, &old_key)) {
+            if (Deployment::kCanRemove) deployment.Remove(old_key, t);
+            found_count += deployment.Add(key, t);
+          } else {
+            found_count += deployment.Contain(key, t);
+          }
+          results[t].Record(at, window);
+        }
+        UseCount(found_count);
+      });
+    }
+    for (auto& worker : workers) worker.join();
+    return Summarize(options, rate, window, results);
+  });
+}
+
+// A connection to filter-server, sending whole requests and reading whole responses.
+class ServerConnection {
+  int fd_;
+  vector<char> in_;
+  size_t in_begin_, in_end_;
+
+ public:
+  explicit ServerConnection(const string& path)
+    : fd_(socket(AF_UNIX, SOCK_STREAM, 0)), in_(1 << 16), in_begin_(0), in_end_(0) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      throw runtime_error("Socket path too long: " + path);
+    }
+    strcpy(addr.sun_path, path.c_str());
+    if (fd_ < 0 ||
+        connect(fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+      const string error = strerror(errno);
+      if (fd_ >= 0) close(fd_);
+      throw runtime_error("Could not connect to " + path + ": " + error);
+    }
+  }
+
+  ~ServerConnection() { close(fd_); }
+
+  ServerConnection(const ServerConnection&) = delete;
+  ServerConnection& operator=(const ServerConnection&) = delete;
+
+  // Throws runtime_error if the server is gone, rather than raising SIGPIPE.
+  void Send(const string& bytes) {
+    for (size_t sent = 0; sent < bytes.size();) {
+      const ssize_t w =
+          send(fd_, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) throw runtime_error("Lost the connection to the server");
+      sent += w;
+    }
+  }
+
+  // Reads the next response, skipping the results it carries.
+  ResponseHeader Receive() {
+    ResponseHeader header;
+    Read(&header, sizeof(header));
+    if (header.magic != kResponseMagic || header.status != kServerOk) {
+      throw runtime_error("Bad response from the server");
+    }
+    for (uint64_t left = ResponsePayloadBytes(header.op, header.count); left > 0;) {
+      const size_t chunk = min<uint64_t>(left, in_.size());
+      Read(nullptr, chunk);
+      left -= chunk;
+    }
+    return header;
+  }
+
+  // Makes Send() and Receive() fail from now on, waking a thread blocked in either.
+  void Shutdown() { shutdown(fd_, SHUT_RDWR); }
+
+ private:
+  void Read(void* out, size_t n) {
+    for (size_t done = 0; done < n;) {
+      if (in_begin_ == in_end_) {
+        const ssize_t r = read(fd_, in_.data(), in_.size());
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) throw runtime_error("Lost the connection to the server");
+        in_begin_ = 0;
+        in_end_ = r;
+      }
+      const size_t chunk = min(n - done, in_end_ - in_begin_);
+      if (out) memcpy(static_cast<char*>(out) + done, &in_[in_begin_], chunk);
+      in_begin_ += chunk;
+      done += chunk;
+    }
+  }
+};
+
+// Appends a request for count keys to out. Inserts store each key as its own value.
+void AppendRequest(
+    uint16_t op, uint32_t seq, const uint64_t* keys, uint32_t count, string* out) {
+  RequestHeader header;
+  header.magic = kRequestMagic;
+  header.op = op;
+  header.flags = 0;
+  header.count = count;
+  header.seq = seq;
+  out->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (uint32_t i = 0; i < count; ++i) {
+    out->append(reinterpret_cast<const char*>(&keys[i]), sizeof(keys[i]));
+    if (op == kOpInsert) {
+      out->append(reinterpret_cast<const char*>(&keys[i]), sizeof(keys[i]));
+    }
+  }
+}
+
+// The number of requests a client may have in flight, bounded by the scheduled times it
+// keeps to match the responses with:
+const uint32_t IN_FLIGHT = 1 << 20;
+
+// Runs the sweep against filter-server, over one connection per client, after adding
+// the items in batches.
+vector<Statistics> RunAgainstServer(
+    const Options& options, const vector<uint64_t>& items) {
+  vector<Client> clients = MakeClients(options, items);
+  vector<unique_ptr<ServerConnection>> connections;
+  for (unsigned t = 0; t < options.threads; ++t) {
+    connections.emplace_back(new ServerConnection(options.server));
+    const vector<uint64_t>& owned = clients[t].owned();
+    for (size_t i = 0; i < owned.size(); i += kServerMaxBatch) {
+      string request;
+      AppendRequest(kOpInsert, 0, &owned[i],
+          min<size_t>(kServerMaxBatch, owned.size() - i), &request);
+      connections[t]->Send(request);
+      connections[t]->Receive();
+    }
+  }
+  vector<atomic<uint64_t>> scheduled(IN_FLIGHT);  // By seq, 0 where not timed
+  return Sweep(options, [&](double rate) {
+    const RunWindow window = MakeWindow(options);
+    const double mean_gap = 1e9 * options.threads / rate;
+    vector<ClientResult> results(options.threads);
+    // What went wrong with each client's connection, empty if nothing did:
+    vector<string> errors(options.threads);
+    vector<thread> workers;
+    for (unsigned t = 0; t < options.threads; ++t) {
+      workers.emplace_back([&, t]() {
+        Client& client = clients[t];
+        ServerConnection& connection = *connections[t];
+        atomic<uint64_t>* times = &scheduled[IN_FLIGHT / options.threads * t];
+        const uint32_t ring = IN_FLIGHT / options.threads;
+        atomic<uint32_t> received(0);
+        atomic<uint32_t> last_seq(UINT32_MAX);
+        atomic<bool> receive_failed(false);
+        string receive_error;
+        thread receiver([&]() {
+          try {
+            for (;;) {
+              const uint32_t seq = connection.Receive().seq;
+              const uint64_t at = times[seq % ring].load(memory_order_acquire);
+              if (at != 0) results[t].Record(at, window);
+              received.store(seq + 1, memory_order_release);
+              if (seq == last_seq.load(memory_order_acquire)) break;
+            }
+          } catch (const runtime_error& e) {
+            receive_error = e.what();
+            receive_failed.store(true, memory_order_release);
+          }
+        });
+        // Queues the request for one operation on at most one key, scheduled at 'at',
+        // once there is room among those in flight:
+        uint32_t seq = 0;
+        string out;
+        auto append = [&](uint16_t op, const uint64_t* key, uint64_t at) {
+          while (seq - received.load(memory_order_acquire) >= ring) {
+            if (receive_failed.load(memory_order_acquire)) {
+              throw runtime_error("No more responses from the server");
+            }
+            connection.Send(out);
+            out.clear();
+            this_thread::yield();
+          }
+          times[seq % ring].store(at, memory_order_release);
+          AppendRequest(op, seq++, key, key ? 1 : 0, &out);
+        };
+        try {
+          double next = window.start + client.NextGap(mean_gap);
+          while (next < window.end && !receive_failed.load(memory_order_acquire)) {
+            WaitUntil(next);
+            if (NowNanos() >= window.give_up) break;
+            // Everything due by now goes out in one write:
+            do {
+              const uint64_t at = next;
+              uint64_t key, old_key;
+              if (client.Next(options.writes, &key, &old_key)) {
+                append(kOpErase, &old_key, 0);
+                append(kOpInsert, &key, at);
+              } else {
+                append(kOpContains, &key, at);
+              }
+              next += client.NextGap(mean_gap);
+            } while (next < window.end && next <= NowNanos());
+            connection.Send(out);
+            out.clear();
+          }
+          // An empty request marks the end, so that the receiver knows when to stop:
+          last_seq.store(seq, memory_order_release);
+          append(kOpContains, nullptr, 0);
+          connection.Send(out);
+        } catch (const runtime_error& e) {
+          errors[t] = e.what();
+          // The receiver may be waiting for responses that will never come:
+          connection.Shutdown();
+        }
+        receiver.join();
+        if (!receive_error.empty()) errors[t] = receive_error;
+      });
+    }
+    for (auto& worker : workers) worker.join();
+    for (unsigned t = 0; t < options.threads; ++t) {
+      if (!errors[t].empty()) {
+        throw runtime_error("Client " + to_string(t) + ": " + errors[t]);
+      }
+    }
+    return Summarize(options, rate, window, results);
+  });
+}
+
+void WriteJson(ostream& os, const Options& options, const vector<Statistics>& results,
+    const Statistics* knee) {
+  os << setprecision(10) << "{\n  \"target\": \""
+     << (options.server.empty() ? options.mode : "server:" + options.server)
+     << "\",\n  \"threads\": " << options.threads << ",\n  \"items\": " << options.items
+     << ",\n  \"writes\": " << options.writes << ",\n  \"seconds\": " << options.seconds
+     << ",\n  \"slo_us\": " << options.slo_micros << ",\n  \"knee_ops_per_sec\": ";
+  if (knee) {
+    os << knee->offered;
+  } else {
+    os << "null";
+  }
+  os << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Statistics& stats = results[i];
+    os << (i ? "," : "") << "\n    {\"offered_ops_per_sec\": " << stats.offered
+       << ", \"achieved_ops_per_sec\": " << stats.achieved
+       << ", \"count\": " << stats.latency.Count();
+    const char* const names[] = {"p50_us", "p90_us", "p99_us", "p99.9_us", "max_us"};
+    const double percentiles[] = {50, 90, 99, 99.9, 100};
+    for (int p = 0; p < 5; ++p) {
+      os << ", \"" << names[p]
+         << "\": " << stats.latency.Percentile(percentiles[p]) / 1e3;
+    }
+    os << ", \"kept_up\": " << (stats.kept_up ? "true" : "false") << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.mode = "cuckoo-sharded";
+  options.threads = 1;
+  options.items = 100 * 1000;
+  options.writes = 10;
+  options.start_rate = 100 * 1000;
+  options.step = 1.5;
+  options.seconds = 1;
+  options.slo_micros = 1000;
+  const bool parsed = ParseFlags(argc, argv, &options,
+      [&options](const string& flag, const string& value) {
+        if (flag == "--mode") {
+          options.mode = value;
+        } else if (flag == "--server") {
+          options.server = value;
+        } else if (flag == "--threads") {
+          options.threads = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--items") {
+          options.items = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--writes") {
+          options.writes = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--start") {
+          options.start_rate = ParseNumber<double>(flag, value);
+        } else if (flag == "--step") {
+          options.step = ParseNumber<double>(flag, value);
+        } else if (flag == "--seconds") {
+          options.seconds = ParseNumber<double>(flag, value);
+        } else if (flag == "--slo") {
+          options.slo_micros = ParseNumber<double>(flag, value);
+        } else if (flag == "--rates") {
+          for (const double rate : ParseNumberList<double>(flag, value)) {
+            options.rates.push_back(rate);
+          }
+        } else {
+          return false;
+        }
+        return true;
+      });
+  if (!parsed) return 1;
+  const set<string> modes = {"cuckoo-locked", "cuckoo-sharded", "block-locked",
+      "block-atomic"};
+  if (!modes.count(options.mode) || options.threads == 0 ||
+      options.items < options.threads || options.writes > 100 ||
+      !(options.start_rate > 0) || !(options.step > 1) || !(options.seconds > 0) ||
+      !(options.slo_micros > 0) ||
+      count_if(options.rates.begin(), options.rates.end(),
+          [](double rate) { return !(rate > 0); })) {
+    cerr << "Usage: " << argv[0] << " [--mode=MODE | --server=PATH] [--threads=T] "
+         << "[--items=N] [--writes=P] [--rates=R,R,...] [--start=R] [--step=F] "
+         << "[--seconds=S] [--slo=US] [--json=FILE]" << endl;
+    return 1;
+  }
+
+  const vector<uint64_t> items = GenerateRandom64(options.items);
+  cout << (options.server.empty() ? options.mode : "server " + options.server) << ", "
+       << options.threads << " client(s), " << options.items << " keys, "
+       << options.writes << "% writes" << endl;
+  cout << StatisticsTableHeader() << endl;
+
+  vector<Statistics> results;
+  try {
+    using Cuckoo = CuckooFilter<uint64_t, 12>;
+    if (!options.server.empty()) {
+      results = RunAgainstServer(options, items);
+    } else if (options.mode == "cuckoo-locked") {
+      results = RunInProcess<Locked<Cuckoo>>(options, items);
+    } else if (options.mode == "cuckoo-sharded") {
+      results = RunInProcess<Sharded<Cuckoo>>(options, items);
+    } else if (options.mode == "block-locked") {
+      results = RunInProcess<Locked<SimdBlockFilter<>>>(options, items);
+    } else {
+      results = RunInProcess<AtomicBlock>(options, items);
+    }
+  } catch (const runtime_error& e) {
+    cerr << e.what() << endl;
+    return 4;
+  }
+
+  const Statistics* knee = nullptr;
+  for (const auto& stats : results) {
+    if (stats.kept_up && (!knee || stats.offered > knee->offered)) knee = &stats;
+  }
+  if (knee) {
+    cout << "knee: " << setprecision(3) << knee->offered / 1e6 << " Mops/s offered, p99 "
+         << setprecision(2) << knee->latency.Percentile(99) / 1e3 << " us" << endl;
+  } else {
+    cout << "knee: no rate kept up" << endl;
+  }
+
+  if (!WriteJsonFile(options, [&](ostream& json) {
+        WriteJson(json, options, results, knee);
+      })) {
+    return 3;
+  }
+}
@@ -0,0 +1,159 @@
+// Hardware performance counters around benchmark phases, read with perf_event_open(2):
+//
+//     PerfCounters counters;  // Opens what it can, warning once on stderr about the rest
+//     counters.Start();
+//     ... the phase ...
+//     const PerfCounts counts = counters.Stop();
+//     if (counts.Valid(kLlcMisses)) cout << counts.count[kLlcMisses] / operations;
+//
+// Only user space is counted, as unprivileged processes may not count the kernel, but
+// in every thread of the process, including those started during the phase. Counts are
+// scaled up when the kernel had to multiplex the counters. Counters that the hardware,
+// the kernel or a container does not provide, as under most virtual machines, are
+// reported as not valid instead of failing the benchmark; outside Linux none are.
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfEvent {
+  kCycles,
+  kInstructions,
+  kLlcMisses,    // Last level cache read misses
+  kDtlbMisses,   // Data TLB read misses
+  kBranchMisses,
+  kNumPerfEvents
+};
+
+inline const char* PerfEventName(int event) {
+  static const char* const names[kNumPerfEvents] = {
+      "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"};
+  return names[event];
+}
+
+// The counts of one phase; negative for a counter that is not available.
+struct PerfCounts {
+  double count[kNumPerfEvents];
+  bool Valid(int event) const { return count[event] >= 0; }
+};
+
+class PerfCounters {
+  int fds_[kNumPerfEvents];
+
+ public:
+  PerfCounters() {
+    ::std::string missing;
+    int error = ENOSYS;
+    for (int event = 0; event < kNumPerfEvents; ++event) {
+      fds_[event] = Open(event);
+      if (fds_[event] < 0) {
+        error = errno;
+        missing += (missing.empty() ? "" : ", ") + ::std::string(PerfEventName(event));
+      }
+    }
+    if (!missing.empty()) {
+      ::std::cerr << "Hardware counters not available, reported as \"-\": " << missing
+                  << " (" << ::std::strerror(error) << ")" << ::std::endl;
+    }
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (const int fd : fds_) {
+      if (fd >= 0) close(fd);
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  // Zeroes the counters and starts counting.
+  void Start() {
+#ifdef __linux__
+    for (const int fd : fds_) {
+      if (fd < 0) continue;
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  // Stops counting and returns the counts since Start().
+  PerfCounts Stop() {
+    PerfCounts result;
+    for (int event = 0; event < kNumPerfEvents; ++event) result.count[event] = -1;
+#ifdef __linux__
+    for (const int fd : fds_) {
+      if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int event = 0; event < kNumPerfEvents; ++event) {
+      // The value, then the time enabled and the time actually counting:
+      ::std::uint64_t values[3];
+      if (fds_[event] < 0) continue;
+      if (read(fds_[event], values, sizeof(values)) != sizeof(values)) continue;
+      if (values[2] == 0) continue;
+      result.count[event] = static_cast<double>(values[0]) * values[1] / values[2];
+    }
+#endif
+    return result;
+  }
+
+ private:
+  // Returns a disabled counter for event, or -1 with errno set.
+  static int Open(int event) {
+#ifdef __linux__
+    perf_event_attr attr;
+    ::std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    const auto cache_miss = [](::std::uint64_t cache) {
+      return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    switch (event) {
+      case kCycles:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case kInstructions:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case kLlcMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache_miss(PERF_COUNT_HW_CACHE_LL);
+        break;
+      case kDtlbMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cache_miss(PERF_COUNT_HW_CACHE_DTLB);
+        break;
+      default:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0 /* this process */, -1 /* any cpu */,
+        -1 /* no group */, 0);
+#else
+    (void)event;
+    errno = ENOSYS;
+    return -1;
+#endif
+  }
+};
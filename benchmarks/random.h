@@ -3,10 +3,12 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <functional>
 #include <random>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 
@@ -43,3 +45,142 @@ template <typename T>
   ::std::shuffle(result.begin(), result.end(), random);
   return result;
 }
+
+// A fast generator for the keys of the workloads; GenerateRandom64() is far too slow to
+// make hundreds of millions of them.
+inline ::std::uint64_t SplitMix64(::std::uint64_t* state) {
+  ::std::uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Scrambles x into a key, one to one, so that consecutive x give unrelated keys; the
+// finalizer of SplitMix64.
+inline ::std::uint64_t MixKey(::std::uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// A uniform double in (0, 1].
+inline double UniformUnit(::std::uint64_t* state) {
+  return ((SplitMix64(state) >> 11) + 1) * (1.0 / (1ull << 53));
+}
+
+// Generators of the keys of skewed and adversarial query streams. Each call returns the
+// next key to look up. Except for AdversarialKeys, keys are drawn from a universe of n,
+// the key of rank r being MixKey(base + r), and it is the ranks that are distributed as
+// the name says; rank 0 is the most popular where some are.
+
+// Every key of the universe equally likely.
+class UniformKeys {
+  ::std::uint64_t n_, base_, state_;
+
+ public:
+  UniformKeys(::std::uint64_t n, ::std::uint64_t base, ::std::uint64_t seed)
+    : n_(n), base_(base), state_(seed) {}
+  ::std::uint64_t operator()() { return MixKey(base_ + SplitMix64(&state_) % n_); }
+};
+
+// Rank r with probability proportional to 1 / (r + 1)^theta, for 0 < theta < 1, by the
+// method of Gray et al., "Quickly Generating Billion-Record Synthetic Databases" (SIGMOD
+// 1994), as in YCSB: O(n) to set up, then O(1) per key.
+class ZipfKeys {
+  ::std::uint64_t n_, base_, state_;
+  double theta_, alpha_, zeta_n_, eta_;
+
+ public:
+  ZipfKeys(::std::uint64_t n, double theta, ::std::uint64_t base, ::std::uint64_t seed)
+    : n_(n), base_(base), state_(seed), theta_(theta), alpha_(1 / (1 - theta)),
+      zeta_n_(0) {
+    if (!(theta > 0 && theta < 1)) throw ::std::domain_error("theta must be in (0, 1)");
+    for (::std::uint64_t i = 1; i <= n; ++i) zeta_n_ += ::std::pow(i, -theta);
+    const double zeta_2 = 1 + ::std::pow(2, -theta);
+    eta_ = (1 - ::std::pow(2.0 / n, 1 - theta)) / (1 - zeta_2 / zeta_n_);
+  }
+
+  ::std::uint64_t operator()() {
+    const double u = UniformUnit(&state_);
+    const double uz = u * zeta_n_;
+    ::std::uint64_t rank;
+    if (uz < 1) {
+      rank = 0;
+    } else if (uz < 1 + ::std::pow(0.5, theta_)) {
+      rank = 1;
+    } else {
+      rank = n_ * ::std::pow(eta_ * u - eta_ + 1, alpha_);
+    }
+    return MixKey(base_ + ::std::min(rank, n_ - 1));
+  }
+};
+
+// hot_percent% of the keys uniformly from the first hot ranks, the rest uniformly from
+// the whole universe.
+class HotSetKeys {
+  ::std::uint64_t n_, hot_, base_, state_;
+  unsigned hot_percent_;
+
+ public:
+  HotSetKeys(::std::uint64_t n, ::std::uint64_t hot, unsigned hot_percent,
+      ::std::uint64_t base, ::std::uint64_t seed)
+    : n_(n), hot_(::std::max<::std::uint64_t>(1, ::std::min(hot, n))), base_(base),
+      state_(seed), hot_percent_(hot_percent) {}
+
+  ::std::uint64_t operator()() {
+    const ::std::uint64_t r = SplitMix64(&state_);
+    const bool hot = (r >> 32) % 100 < hot_percent_;
+    return MixKey(base_ + SplitMix64(&state_) % (hot ? hot_ : n_));
+  }
+};
+
+// Every rank in turn, over and over, as a periodic scan of the universe would.
+class ScanKeys {
+  ::std::uint64_t n_, base_, next_;
+
+ public:
+  ScanKeys(::std::uint64_t n, ::std::uint64_t base) : n_(n), base_(base), next_(0) {}
+  ::std::uint64_t operator()() {
+    const ::std::uint64_t key = MixKey(base_ + next_);
+    next_ = next_ + 1 == n_ ? 0 : next_ + 1;
+    return key;
+  }
+};
+
+// An adversary hunting for false positives: it queries fresh keys, learns which were
+// false positives through Observed(), for instance by timing the responses, and makes
+// replay_percent% of its queries replays of those found, until they stop being false
+// positives.
+class AdversarialKeys {
+  ::std::uint64_t base_, state_, fresh_;
+  unsigned replay_percent_;
+  ::std::vector<::std::uint64_t> found_;
+  ::std::unordered_map<::std::uint64_t, ::std::size_t> found_at_;
+
+ public:
+  AdversarialKeys(unsigned replay_percent, ::std::uint64_t base, ::std::uint64_t seed)
+    : base_(base), state_(seed), fresh_(0), replay_percent_(replay_percent) {}
+
+  ::std::uint64_t operator()() {
+    const ::std::uint64_t r = SplitMix64(&state_);
+    if (!found_.empty() && (r >> 32) % 100 < replay_percent_) {
+      return found_[(r & 0xffffffff) % found_.size()];
+    }
+    return MixKey(base_ + fresh_++);
+  }
+
+  void Observed(::std::uint64_t key, bool false_positive) {
+    const auto at = found_at_.find(key);
+    if (false_positive && at == found_at_.end()) {
+      found_at_[key] = found_.size();
+      found_.push_back(key);
+    } else if (!false_positive && at != found_at_.end()) {
+      found_at_[found_.back()] = at->second;
+      found_[at->second] = found_.back();
+      found_.pop_back();
+      found_at_.erase(at);
+    }
+  }
+
+  ::std::size_t found() const { return found_.size(); }
+};
@@ -0,0 +1,479 @@
+// This benchmark reports how throughput scales with the number of threads for each way
+// the filters can be shared between threads. It is invoked as:
+//
+//     ./scaling.exe [--items=N] [--ops=M] [--threads=T,T,...] [--writes=P] [--repeat=R]
+//                   [--pin=none|compact|spread] [--numa=first-touch|interleave]
+//                   [--modes=MODE,...] [--json=FILE]
+//
+// Every mode runs three workloads at each thread count T (by default 1, 2, 4, ... up to
+// the number of CPUs): "insert" adds N keys (200000 by default) to empty filters, split
+// between the threads; "lookup" makes M lookups per thread (1000000 by default), half of
+// them of added keys; "mixed" is the same with P% writes (10 by default). A write
+// replaces one of the thread's keys by a new one, or only adds the new one where keys
+// cannot be removed. Each workload is run R times on freshly built and filled filters.
+//
+// The modes are:
+//
+//     cuckoo-locked        one CuckooFilter behind one mutex
+//     cuckoo-sharded       T CuckooFilters behind their own mutexes, picked by key hash
+//     cuckoo-partitioned   T CuckooFilters, thread t only ever touches shard t, no locks
+//     block-locked         one SimdBlockFilter behind one mutex
+//     block-atomic         one SimdBlockFilter, Find() and AddConcurrent(), no locks
+//     block-partitioned    T SimdBlockFilters, as cuckoo-partitioned
+//
+// Partitioned modes model a serving tier that routes each key to the core owning its
+// shard, so the keys handed to thread t are chosen to fall in shard t. A CuckooFilter
+// holds about 250000 keys whatever it is constructed for, so a single one fills up and
+// rejects further inserts beyond that.
+//
+// --pin binds thread i to the i-th allowed CPU, in order of NUMA node ("compact") or
+// taking nodes in turn ("spread"). Threads build and fill their partitions themselves
+// after pinning, so with the default first-touch policy those land on the thread's own
+// node; --numa=interleave instead spreads all filter memory over the nodes with
+// set_mempolicy(2). Either is skipped with a warning where the system refuses it.
+//
+// For each run the table shows the total rate, the speedup over the same mode and
+// workload at the first thread count of the sweep (one thread by default), and the mean
+// and coefficient of variation of the rates of the individual threads, which exposes
+// unfairness between them.
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "deployments.h"
+#include "driver.h"
+#include "filterapi.h"
+#include "random.h"
+#include "timing.h"
+
+using namespace std;
+
+using namespace cuckoofilter;
+
+// The flags of this benchmark, on top of CommonOptions:
+struct Options : CommonOptions {
+  size_t items;
+  size_t ops;
+  vector<unsigned> threads;
+  unsigned writes;  // Percent of the operations of the mixed workload
+  unsigned repeat;
+  string pin;
+  string numa;
+  set<string> modes;  // Empty for all of them
+};
+
+// The operations of one thread in one run, generated before the clock starts:
+struct ThreadWork {
+  vector<uint64_t> owned;    // Keys this thread adds before a lookup or mixed run
+  vector<uint64_t> queries;  // Keys to look up, or to add for the insert workload
+  vector<uint8_t> writes;    // Whether each query is a write instead, when mixed
+  vector<uint64_t> fresh;    // The new key of each write
+};
+
+// The rates of one run:
+struct RunResult {
+  double ops_per_nano;
+  vector<double> thread_ops_per_nano;
+};
+
+// CPUs to pin threads to, in the order of --pin, and the NUMA nodes of the machine.
+struct Topology {
+  vector<int> cpus;
+  vector<int> nodes;
+};
+
+// Parses a sysfs CPU list such as "0-3,8-11".
+vector<int> ParseCpuList(const string& text) {
+  vector<int> result;
+  stringstream list(text);
+  string range;
+  while (getline(list, range, ',')) {
+    int first, last;
+    const char* dash = strchr(range.c_str(), '-');
+    first = atoi(range.c_str());
+    last = dash ? atoi(dash + 1) : first;
+    for (int cpu = first; cpu <= last; ++cpu) result.push_back(cpu);
+  }
+  return result;
+}
+
+Topology ReadTopology(const string& pin) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (0 != sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) CPU_SET(cpu, &allowed);
+  }
+  // The allowed CPUs of each node. Without sysfs everything is node 0:
+  vector<vector<int>> by_node;
+  Topology topology;
+  for (int node = 0;; ++node) {
+    ifstream cpulist("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+    string text;
+    if (!getline(cpulist, text)) break;
+    topology.nodes.push_back(node);
+    by_node.emplace_back();
+    for (const int cpu : ParseCpuList(text)) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) by_node.back().push_back(cpu);
+    }
+  }
+  if (by_node.empty()) {
+    topology.nodes.push_back(0);
+    by_node.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) by_node.back().push_back(cpu);
+    }
+  }
+  if (pin == "spread") {
+    for (size_t i = 0;; ++i) {
+      bool any = false;
+      for (const auto& cpus : by_node) {
+        if (i < cpus.size()) topology.cpus.push_back(cpus[i]);
+        any = any || i < cpus.size();
+      }
+      if (!any) break;
+    }
+  } else {
+    for (const auto& cpus : by_node) {
+      topology.cpus.insert(topology.cpus.end(), cpus.begin(), cpus.end());
+    }
+  }
+  return topology;
+}
+
+// Binds the calling thread to one CPU.
+bool PinThread(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return 0 == pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+// Whether a thread may be bound to each of the CPUs, tried from a thread of its own so
+// that the affinity of the caller is left alone.
+bool CanPin(const Topology& topology) {
+  bool ok = true;
+  thread probe([&]() {
+    for (const int cpu : topology.cpus) ok = ok && PinThread(cpu);
+  });
+  probe.join();
+  return ok;
+}
+
+// The values of the mode argument of set_mempolicy(2), from <numaif.h>, which is not
+// always installed. The system call itself is made directly so as not to need libnuma.
+const int MPOL_DEFAULT_MODE = 0;
+const int MPOL_INTERLEAVE_MODE = 3;
+
+// Sets the memory policy of the calling thread, which threads it starts inherit.
+bool SetMemoryPolicy(int mode, const vector<int>& nodes) {
+  unsigned long mask[16] = {0};
+  for (const int node : nodes) {
+    if (node < 16 * 64) mask[node / 64] |= 1UL << (node % 64);
+  }
+  if (mode == MPOL_DEFAULT_MODE) return 0 == syscall(SYS_set_mempolicy, mode, nullptr, 0);
+  return 0 == syscall(SYS_set_mempolicy, mode, mask, 16 * 64);
+}
+
+// Splits the work of a run with the given number of threads. For partitioned modes
+// thread t gets only keys of shard t.
+vector<ThreadWork> MakeWork(const Options& options, const string& workload,
+    const vector<uint64_t>& items, unsigned threads, bool partitioned, uint64_t seed) {
+  vector<ThreadWork> work(threads);
+  for (size_t i = 0; i < items.size(); ++i) {
+    const size_t t =
+        partitioned ? ShardOf(items[i], threads) : i * threads / items.size();
+    work[t].owned.push_back(items[i]);
+  }
+  // A new key that falls in the thread's shard if it has to:
+  auto fresh_key = [&](unsigned t) {
+    for (;;) {
+      const uint64_t key = SplitMix64(&seed);
+      if (!partitioned || ShardOf(key, threads) == t) return key;
+    }
+  };
+  for (unsigned t = 0; t < threads; ++t) {
+    ThreadWork& w = work[t];
+    if (workload == "insert") {
+      w.queries.swap(w.owned);
+      continue;
+    }
+    if (w.owned.empty()) w.owned.push_back(fresh_key(t));
+    w.queries.resize(options.ops);
+    for (auto& key : w.queries) {
+      const uint64_t r = SplitMix64(&seed);
+      key = (r & 1) ? w.owned[(r >> 1) % w.owned.size()] : fresh_key(t);
+    }
+    if (workload == "mixed") {
+      w.writes.resize(options.ops);
+      for (size_t i = 0; i < options.ops; ++i) {
+        w.writes[i] = SplitMix64(&seed) % 100 < options.writes;
+        if (w.writes[i]) w.fresh.push_back(fresh_key(t));
+      }
+    }
+  }
+  return work;
+}
+
+// Runs one workload on a freshly built Deployment with work.size() threads.
+template <typename Deployment>
+RunResult RunOnce(const Options& options, const Topology& topology,
+    const string& workload, vector<ThreadWork>* work) {
+  const unsigned threads = work->size();
+  Deployment deployment(options.items, threads);
+  atomic<unsigned> ready(0);
+  atomic<bool> go(false);
+  vector<uint64_t> thread_nanos(threads);
+  vector<size_t> thread_ops(threads);
+  vector<thread> workers;
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      // main() checked that pinning works, but the allowed CPUs may change since:
+      static atomic<bool> warned(false);
+      if (options.pin != "none" &&
+          !PinThread(topology.cpus[t % topology.cpus.size()]) && !warned.exchange(true)) {
+        cerr << "warning: pthread_setaffinity_np failed, some threads run unpinned"
+             << endl;
+      }
+      deployment.Build(t);
+      ThreadWork& w = (*work)[t];
+      if (workload != "insert") {
+        for (const auto key : w.owned) deployment.Add(key, t);
+      }
+      ++ready;
+      while (!go.load(memory_order_acquire)) {
+      }
+      const auto start_time = NowNanos();
+      size_t found_count = 0;
+      if (workload == "insert") {
+        for (const auto key : w.queries) found_count += deployment.Add(key, t);
+      } else if (workload == "lookup") {
+        for (const auto key : w.queries) found_count += deployment.Contain(key, t);
+      } else {
+        size_t next_write = 0;
+        for (size_t i = 0; i < w.queries.size(); ++i) {
+          if (!w.writes[i]) {
+            found_count += deployment.Contain(w.queries[i], t);
+            continue;
+          }
+          // Replace an owned key, oldest first, by a new one:
+          const uint64_t key = w.fresh[next_write];
+          uint64_t& old_key = w.owned[next_write++ % w.owned.size()];
+          if (Deployment::kCanRemove) deployment.Remove(old_key, t);
+          found_count += deployment.Add(key, t);
+          old_key = key;
+        }
+      }
+      thread_nanos[t] = NowNanos() - start_time;
+      thread_ops[t] = w.queries.size();
+      UseCount(found_count);
+    });
+  }
+  while (ready.load() < threads) this_thread::yield();
+  const auto start_time = NowNanos();
+  go.store(true, memory_order_release);
+  for (auto& worker : workers) worker.join();
+  const auto wall_nanos = NowNanos() - start_time;
+
+  RunResult result;
+  size_t total_ops = 0;
+  for (unsigned t = 0; t < threads; ++t) {
+    total_ops += thread_ops[t];
+    result.thread_ops_per_nano.push_back(
+        thread_ops[t] / static_cast<double>(max<uint64_t>(1, thread_nanos[t])));
+  }
+  result.ops_per_nano = total_ops / static_cast<double>(wall_nanos);
+  return result;
+}
+
+// The statistics of one mode, workload and thread count over all repeats:
+struct Statistics {
+  string mode;
+  string workload;
+  unsigned threads;
+  double mops;         // Mean total rate, in millions per second
+  double speedup;      // Over the first thread count of the sweep
+  double thread_mops;  // Mean rate of one thread
+  double thread_cv;    // Coefficient of variation of the rates of the threads
+};
+
+string StatisticsTableHeader() {
+  ostringstream os;
+  os << setw(20) << left << "mode" << setw(8) << "work" << right << setw(8) << "threads"
+     << setw(10) << "Mops/s" << setw(9) << "speedup" << setw(12) << "Mops/s/thr"
+     << setw(8) << "cv";
+  return os.str();
+}
+
+template <class CharT, class Traits>
+basic_ostream<CharT, Traits>& operator<<(
+    basic_ostream<CharT, Traits>& os, const Statistics& stats) {
+  os << setw(20) << left << stats.mode << setw(8) << stats.workload << right << setw(8)
+     << stats.threads << fixed << setprecision(2) << setw(10) << stats.mops << setw(9)
+     << stats.speedup << setw(12) << stats.thread_mops << setw(7) << setprecision(1)
+     << 100 * stats.thread_cv << '%';
+  return os;
+}
+
+void WriteJson(ostream& os, const Options& options, const Topology& topology,
+    const vector<Statistics>& results) {
+  os << setprecision(10) << "{\n  \"items\": " << options.items
+     << ",\n  \"ops\": " << options.ops << ",\n  \"writes\": " << options.writes
+     << ",\n  \"repeat\": " << options.repeat << ",\n  \"pin\": \"" << options.pin
+     << "\",\n  \"numa\": \"" << options.numa
+     << "\",\n  \"nodes\": " << topology.nodes.size()
+     << ",\n  \"cpus\": " << topology.cpus.size() << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Statistics& stats = results[i];
+    os << (i ? "," : "") << "\n    {\"mode\": \"" << stats.mode << "\", \"workload\": \""
+       << stats.workload << "\", \"threads\": " << stats.threads
+       << ", \"mops\": " << stats.mops << ", \"speedup\": " << stats.speedup
+       << ", \"thread_mops\": " << stats.thread_mops
+       << ", \"thread_cv\": " << stats.thread_cv << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+// Runs every workload at every thread count for one mode.
+template <typename Deployment>
+void Run(const string& mode, const Options& options, const Topology& topology,
+    const vector<uint64_t>& items, vector<Statistics>* results) {
+  if (!options.modes.empty() && !options.modes.count(mode)) return;
+  for (const string workload : {"insert", "lookup", "mixed"}) {
+    double first_mops = 0;
+    for (const unsigned threads : options.threads) {
+      Statistics stats;
+      stats.mode = mode;
+      stats.workload = workload;
+      stats.threads = threads;
+      vector<double> thread_rates;
+      double total = 0;
+      for (unsigned r = 0; r < options.repeat; ++r) {
+        auto work = MakeWork(options, workload, items, threads,
+            Deployment::kPartitioned, 0x5eed + 1000 * r + threads);
+        const RunResult run = RunOnce<Deployment>(options, topology, workload, &work);
+        total += run.ops_per_nano;
+        thread_rates.insert(thread_rates.end(), run.thread_ops_per_nano.begin(),
+            run.thread_ops_per_nano.end());
+      }
+      constexpr double NANOS_PER_MILLION = 1000;
+      stats.mops = NANOS_PER_MILLION * total / options.repeat;
+      double mean = 0, variance = 0;
+      for (const double rate : thread_rates) mean += rate / thread_rates.size();
+      for (const double rate : thread_rates) {
+        variance += (rate - mean) * (rate - mean) / thread_rates.size();
+      }
+      stats.thread_mops = NANOS_PER_MILLION * mean;
+      stats.thread_cv = sqrt(variance) / mean;
+      if (first_mops == 0) first_mops = stats.mops;
+      stats.speedup = stats.mops / first_mops;
+      cout << stats << endl;
+      results->push_back(stats);
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.items = 200 * 1000;
+  options.ops = 1000 * 1000;
+  options.writes = 10;
+  options.repeat = 1;
+  options.pin = "none";
+  options.numa = "first-touch";
+  const bool parsed = ParseFlags(argc, argv, &options,
+      [&options](const string& flag, const string& value) {
+        if (flag == "--items") {
+          options.items = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--ops") {
+          options.ops = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--writes") {
+          options.writes = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--repeat") {
+          options.repeat = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--pin") {
+          options.pin = value;
+        } else if (flag == "--numa") {
+          options.numa = value;
+        } else if (flag == "--threads") {
+          for (const unsigned threads : ParseNumberList<unsigned>(flag, value)) {
+            options.threads.push_back(threads);
+          }
+        } else if (flag == "--modes") {
+          for (const string& mode : SplitList(value)) options.modes.insert(mode);
+        } else {
+          return false;
+        }
+        return true;
+      });
+  if (!parsed) return 1;
+  if (options.items == 0 || options.ops == 0 || options.repeat == 0 ||
+      options.writes > 100 ||
+      (options.pin != "none" && options.pin != "compact" && options.pin != "spread") ||
+      (options.numa != "first-touch" && options.numa != "interleave") ||
+      count(options.threads.begin(), options.threads.end(), 0u)) {
+    cerr << "Usage: " << argv[0] << " [--items=N] [--ops=M] [--threads=T,T,...] "
+         << "[--writes=P] [--repeat=R] [--pin=none|compact|spread] "
+         << "[--numa=first-touch|interleave] [--modes=MODE,...] [--json=FILE]" << endl;
+    return 1;
+  }
+
+  const Topology topology = ReadTopology(options.pin);
+  if (options.threads.empty()) {
+    const unsigned cpus = max<size_t>(1, topology.cpus.size());
+    for (unsigned threads = 1; threads < cpus; threads *= 2) {
+      options.threads.push_back(threads);
+    }
+    options.threads.push_back(cpus);
+  }
+  if (options.pin != "none" && !CanPin(topology)) {
+    cerr << "warning: pthread_setaffinity_np failed, threads are not pinned" << endl;
+    options.pin = "none";
+  }
+  if (options.numa == "interleave" &&
+      !SetMemoryPolicy(MPOL_INTERLEAVE_MODE, topology.nodes)) {
+    cerr << "warning: set_mempolicy failed, memory is placed by first touch" << endl;
+    options.numa = "first-touch";
+  }
+  cout << topology.cpus.size() << " CPUs on " << topology.nodes.size()
+       << " NUMA node(s), pin " << options.pin << ", numa " << options.numa << endl;
+
+  const vector<uint64_t> items = GenerateRandom64(options.items);
+  vector<Statistics> results;
+
+  cout << StatisticsTableHeader() << endl;
+
+  using Cuckoo = CuckooFilter<uint64_t, 12>;
+  Run<Locked<Cuckoo>>("cuckoo-locked", options, topology, items, &results);
+  Run<Sharded<Cuckoo>>("cuckoo-sharded", options, topology, items, &results);
+  Run<Partitioned<Cuckoo>>("cuckoo-partitioned", options, topology, items, &results);
+  Run<Locked<SimdBlockFilter<>>>("block-locked", options, topology, items, &results);
+  Run<AtomicBlock>("block-atomic", options, topology, items, &results);
+  Run<Partitioned<SimdBlockFilter<>>>(
+      "block-partitioned", options, topology, items, &results);
+
+  if (!WriteJsonFile(options, [&](ostream& json) {
+        WriteJson(json, options, topology, results);
+      })) {
+    return 3;
+  }
+}
@@ -0,0 +1,309 @@
+// This benchmark shows when adapting to false positives pays off: it runs skewed and
+// adversarial query streams against the adaptive CuckooFilter and against the same
+// filter with adaptation turned off, a plain cuckoo filter. It is invoked as:
+//
+//     ./skew.exe [--items=N] [--universe=U] [--queries=Q] [--windows=W] [--hits=P]
+//                [--zipf=THETA] [--hot-keys=H] [--hot-share=P] [--replay=P]
+//                [--workloads=NAME,...] [--filters=NAME,...] [--json=FILE]
+//
+// Each filter is filled with N keys (200000 by default) and then takes Q lookups
+// (2000000 by default) with contains(), P% of them (10 by default) of added keys and
+// the rest of keys never added, drawn by one of the workloads:
+//
+//     uniform      uniformly from a universe of U keys (1000000 by default)
+//     zipf         from the same universe, Zipf-distributed with exponent THETA (0.99)
+//     hotset       H keys (10000) take P% (90) of the lookups, the universe the rest
+//     scan         the universe in order, over and over
+//     adversarial  fresh keys, except that P% (50) replay the false positives found
+//                  so far that are still false positives
+//
+// The filters are adaptive8, plain8, adaptive12 and plain12, the number being the bits
+// per tag. Every filter and workload starts from a freshly filled filter.
+//
+// The lookups are run in W windows (5 by default). For each window the table shows ε,
+// the rate at which the filter passed keys never added on to the remote store, and
+// the run as a whole the remote reads per lookup, millions of lookups per second, and
+// the adaptations made. --json also gives the reads and rates of each window.
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cuckoofilter.h"
+#include "driver.h"
+#include "random.h"
+#include "timing.h"
+
+using namespace std;
+
+using namespace cuckoofilter;
+
+// The added keys are MixKey(i) and the universe of queried keys starts at this base, so
+// that the two never overlap:
+const uint64_t UNIVERSE_BASE = 1ull << 62;
+
+// The flags of this benchmark, on top of CommonOptions:
+struct Options : CommonOptions {
+  size_t items;
+  size_t universe;
+  size_t queries;
+  unsigned windows;
+  unsigned hits;  // Percent of the lookups
+  double zipf_theta;
+  size_t hot_keys;
+  unsigned hot_share;  // Percent of the lookups
+  unsigned replay;     // Percent of the adversary's lookups
+  vector<string> workloads;
+  set<string> filters;  // Empty for all of them
+};
+
+// The statistics of one filter on one workload:
+struct Statistics {
+  string workload;
+  string filter;
+  vector<double> epsilon;  // By window
+  vector<double> reads_per_lookup;
+  vector<double> mops;
+  double total_reads_per_lookup;
+  double total_mops;
+  size_t adaptations;
+  size_t remote_writes;
+};
+
+string StatisticsTableHeader(unsigned windows) {
+  ostringstream os;
+  os << setw(12) << left << "workload" << setw(12) << "filter" << right;
+  // setw() counts the two bytes of "ε" in UTF-8:
+  for (unsigned w = 0; w < windows; ++w) os << setw(8) << "ε" << w + 1 << '%';
+  os << setw(10) << "reads/q" << setw(9) << "Mops/s" << setw(10) << "adapts";
+  return os.str();
+}
+
+template <class CharT, class Traits>
+basic_ostream<CharT, Traits>& operator<<(
+    basic_ostream<CharT, Traits>& os, const Statistics& stats) {
+  os << setw(12) << left << stats.workload << setw(12) << stats.filter << right << fixed
+     << setprecision(3);
+  for (const double epsilon : stats.epsilon) os << setw(9) << 100 * epsilon;
+  os << setw(10) << stats.total_reads_per_lookup << setprecision(2) << setw(9)
+     << stats.total_mops << setw(10) << stats.adaptations;
+  return os;
+}
+
+// Writes a list of numbers as a JSON array.
+void WriteJsonArray(ostream& os, const vector<double>& values) {
+  os << '[';
+  for (size_t i = 0; i < values.size(); ++i) os << (i ? ", " : "") << values[i];
+  os << ']';
+}
+
+void WriteJson(ostream& os, const Options& options, const vector<Statistics>& results) {
+  os << setprecision(10) << "{\n  \"items\": " << options.items
+     << ",\n  \"universe\": " << options.universe << ",\n  \"queries\": "
+     << options.queries << ",\n  \"hits\": " << options.hits
+     << ",\n  \"zipf_theta\": " << options.zipf_theta << ",\n  \"hot_keys\": "
+     << options.hot_keys << ",\n  \"hot_share\": " << options.hot_share
+     << ",\n  \"replay\": " << options.replay << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Statistics& stats = results[i];
+    os << (i ? "," : "") << "\n    {\"workload\": \"" << stats.workload
+       << "\", \"filter\": \"" << stats.filter << "\", \"epsilon\": ";
+    WriteJsonArray(os, stats.epsilon);
+    os << ", \"reads_per_lookup\": ";
+    WriteJsonArray(os, stats.reads_per_lookup);
+    os << ", \"mops\": ";
+    WriteJsonArray(os, stats.mops);
+    os << ", \"total_reads_per_lookup\": " << stats.total_reads_per_lookup
+       << ", \"total_mops\": " << stats.total_mops
+       << ", \"adaptations\": " << stats.adaptations
+       << ", \"remote_writes\": " << stats.remote_writes << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+// The keys of one workload, and what its lookups revealed of the filter.
+struct Workload {
+  function<uint64_t()> next;
+  function<void(uint64_t key, bool false_positive)> observed;
+};
+
+Workload MakeWorkload(const Options& options, const string& name) {
+  Workload workload;
+  workload.observed = [](uint64_t, bool) {};
+  const uint64_t seed = 0x5eed;
+  if (name == "uniform") {
+    workload.next = UniformKeys(options.universe, UNIVERSE_BASE, seed);
+  } else if (name == "zipf") {
+    workload.next = ZipfKeys(options.universe, options.zipf_theta, UNIVERSE_BASE, seed);
+  } else if (name == "hotset") {
+    workload.next = HotSetKeys(
+        options.universe, options.hot_keys, options.hot_share, UNIVERSE_BASE, seed);
+  } else if (name == "scan") {
+    workload.next = ScanKeys(options.universe, UNIVERSE_BASE);
+  } else {
+    auto adversary = make_shared<AdversarialKeys>(options.replay, UNIVERSE_BASE, seed);
+    workload.next = [adversary]() { return (*adversary)(); };
+    workload.observed = [adversary](uint64_t key, bool false_positive) {
+      adversary->Observed(key, false_positive);
+    };
+  }
+  return workload;
+}
+
+// Runs one workload on a filter holding the keys 'added'. The keys of each window are
+// drawn before it is timed, so the adversary learns from one window for the next.
+template <typename Filter>
+Statistics RunWorkload(const Options& options, const string& name,
+    const vector<uint64_t>& added, Filter* filter) {
+  Workload workload = MakeWorkload(options, name);
+  Statistics result;
+  result.workload = name;
+  const size_t per_window = options.queries / options.windows;
+  vector<uint64_t> keys(per_window);
+  vector<uint8_t> hit(per_window), false_positive(per_window);
+  uint64_t state = 0xc0ffee;
+  const size_t adaptations_before = filter->adaptations();
+  const size_t writes_before = filter->remote_writes();
+  size_t total_reads = 0, found_count = 0;
+  uint64_t total_nanos = 0;
+  for (unsigned w = 0; w < options.windows; ++w) {
+    for (size_t i = 0; i < per_window; ++i) {
+      const uint64_t r = SplitMix64(&state);
+      hit[i] = r % 100 < options.hits;
+      keys[i] = hit[i] ? added[(r >> 32) % added.size()] : workload.next();
+    }
+    const size_t reads_before = filter->remote_reads();
+    const auto start_time = NowNanos();
+    for (size_t i = 0; i < per_window; ++i) {
+      const size_t reads = filter->remote_reads();
+      found_count += filter->contains(keys[i]);
+      false_positive[i] = !hit[i] && filter->remote_reads() != reads;
+    }
+    const auto nanos = NowNanos() - start_time;
+    const size_t reads = filter->remote_reads() - reads_before;
+
+    size_t negatives = 0, false_positives = 0;
+    for (size_t i = 0; i < per_window; ++i) {
+      if (hit[i]) continue;
+      ++negatives;
+      false_positives += false_positive[i];
+      workload.observed(keys[i], false_positive[i]);
+    }
+    result.epsilon.push_back(
+        false_positives / static_cast<double>(max<size_t>(1, negatives)));
+    result.reads_per_lookup.push_back(reads / static_cast<double>(per_window));
+    result.mops.push_back(1000.0 * per_window / nanos);
+    total_reads += reads;
+    total_nanos += nanos;
+  }
+  const size_t lookups = per_window * options.windows;
+  result.total_reads_per_lookup = total_reads / static_cast<double>(lookups);
+  result.total_mops = 1000.0 * lookups / total_nanos;
+  result.adaptations = filter->adaptations() - adaptations_before;
+  result.remote_writes = filter->remote_writes() - writes_before;
+  UseCount(found_count);
+  return result;
+}
+
+// Runs every workload on the adaptive and plain filters with bits_per_item bits per tag.
+template <size_t bits_per_item>
+void Run(const Options& options, const string& workload, vector<Statistics>* results) {
+  for (const bool adaptive : {true, false}) {
+    const string name = (adaptive ? "adaptive" : "plain") + to_string(bits_per_item);
+    if (!options.filters.empty() && !options.filters.count(name)) continue;
+    CuckooFilter<uint64_t, bits_per_item> filter(options.items);
+    vector<uint64_t> added;
+    for (size_t i = 0; i < options.items; ++i) {
+      if (!filter.insert(MixKey(i), i)) break;
+      added.push_back(MixKey(i));
+    }
+    filter.set_adaptive(adaptive);
+    Statistics stats = RunWorkload(options, workload, added, &filter);
+    stats.filter = name;
+    cout << stats << endl;
+    results->push_back(stats);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.items = 200 * 1000;
+  options.universe = 1000 * 1000;
+  options.queries = 2000 * 1000;
+  options.windows = 5;
+  options.hits = 10;
+  options.zipf_theta = 0.99;
+  options.hot_keys = 10 * 1000;
+  options.hot_share = 90;
+  options.replay = 50;
+  const vector<string> all_workloads = {"uniform", "zipf", "hotset", "scan",
+      "adversarial"};
+  const bool parsed = ParseFlags(argc, argv, &options,
+      [&options](const string& flag, const string& value) {
+        if (flag == "--items") {
+          options.items = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--universe") {
+          options.universe = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--queries") {
+          options.queries = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--windows") {
+          options.windows = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--hits") {
+          options.hits = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--zipf") {
+          options.zipf_theta = ParseNumber<double>(flag, value);
+        } else if (flag == "--hot-keys") {
+          options.hot_keys = ParseNumber<size_t>(flag, value);
+        } else if (flag == "--hot-share") {
+          options.hot_share = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--replay") {
+          options.replay = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--workloads") {
+          for (const string& workload : SplitList(value)) {
+            options.workloads.push_back(workload);
+          }
+        } else if (flag == "--filters") {
+          for (const string& filter : SplitList(value)) options.filters.insert(filter);
+        } else {
+          return false;
+        }
+        return true;
+      });
+  if (!parsed) return 1;
+  if (options.workloads.empty()) options.workloads = all_workloads;
+  bool known_workloads = true;
+  for (const auto& workload : options.workloads) {
+    known_workloads = known_workloads && count(all_workloads.begin(),
+        all_workloads.end(), workload);
+  }
+  if (options.items == 0 || options.universe == 0 || options.windows == 0 ||
+      options.queries < options.windows || options.hits > 100 ||
+      !(options.zipf_theta > 0 && options.zipf_theta < 1) ||
+      options.hot_share > 100 || options.replay > 100 || !known_workloads) {
+    cerr << "Usage: " << argv[0] << " [--items=N] [--universe=U] [--queries=Q] "
+         << "[--windows=W] [--hits=P] [--zipf=THETA] [--hot-keys=H] [--hot-share=P] "
+         << "[--replay=P] [--workloads=NAME,...] [--filters=NAME,...] [--json=FILE]"
+         << endl;
+    return 1;
+  }
+
+  vector<Statistics> results;
+  cout << StatisticsTableHeader(options.windows) << endl;
+  for (const auto& workload : options.workloads) {
+    Run<8>(options, workload, &results);
+    Run<12>(options, workload, &results);
+  }
+
+  if (!WriteJsonFile(
+          options, [&](ostream& json) { WriteJson(json, options, results); })) {
+    return 3;
+  }
+}
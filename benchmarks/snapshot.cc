@@ -0,0 +1,184 @@
+// This benchmark compares the sparse snapshot format of CuckooFilter with a dense one, in
+// size and in load time, for choosing a codec and the number of decoding threads. It is
+// invoked as:
+//
+//     ./snapshot.exe [--loads=L,L,...] [--threads=T] [--repeats=R] [--json=FILE]
+//
+// For each load L (25,50,75,95 percent of the slots by default) a 12-bit filter is filled
+// to that load and saved with each codec. The dense format is a raw dump of the tag table
+// and of every remote slot, occupied or not, as copying the filter bytewise would write
+// it. Its load time is that of apply_delta() with a full delta, which, like a loader of
+// such a dump, sets every slot of every bucket. The table gives the size of each format,
+// also relative to the dense one, and the best of R (3 by default) load times, in
+// milliseconds, on one thread and on T (4 by default).
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cuckoofilter.h"
+#include "driver.h"
+#include "random.h"
+#include "timing.h"
+
+using namespace std;
+
+using namespace cuckoofilter;
+
+typedef CuckooFilter<uint64_t, 12> Filter;
+
+// The flags of this benchmark, on top of CommonOptions:
+struct Options : CommonOptions {
+  vector<unsigned> loads;  // Percent of the slots
+  unsigned threads;
+  unsigned repeats;
+};
+
+// The size and load times of one format at one load:
+struct Statistics {
+  double load;  // The load actually reached
+  string format;
+  size_t bytes;
+  double dense_fraction;
+  double millis;          // On one thread
+  double threads_millis;  // On Options::threads threads; zero for the dense format
+};
+
+string StatisticsTableHeader(unsigned threads) {
+  ostringstream os;
+  os << setw(7) << right << "load" << setw(16) << "format" << setw(12) << "bytes"
+     << setw(10) << "of dense" << setw(11) << "1 thread" << setw(8) << threads
+     << " threads  (load ms)";
+  return os.str();
+}
+
+template <class CharT, class Traits>
+basic_ostream<CharT, Traits>& operator<<(
+    basic_ostream<CharT, Traits>& os, const Statistics& stats) {
+  os << fixed << setprecision(1) << setw(6) << right << 100 * stats.load << '%'
+     << setw(16) << stats.format << setw(12) << stats.bytes << setw(9)
+     << 100 * stats.dense_fraction << '%' << setprecision(2) << setw(11) << stats.millis;
+  if (stats.threads_millis > 0) {
+    os << setw(16) << stats.threads_millis;
+  } else {
+    os << setw(16) << "-";
+  }
+  return os;
+}
+
+void WriteJson(ostream& os, const Options& options, const vector<Statistics>& results) {
+  os << setprecision(10) << "{\n  \"threads\": " << options.threads
+     << ",\n  \"repeats\": " << options.repeats << ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Statistics& stats = results[i];
+    os << (i ? "," : "") << "\n    {\"load\": " << stats.load << ", \"format\": \""
+       << stats.format << "\", \"bytes\": " << stats.bytes
+       << ", \"dense_fraction\": " << stats.dense_fraction
+       << ", \"load_ms\": " << stats.millis << ", \"threads_load_ms\": ";
+    if (stats.threads_millis > 0) {
+      os << stats.threads_millis;
+    } else {
+      os << "null";
+    }
+    os << "}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+// The best of 'repeats' times, in milliseconds, of load(target) into a fresh filter
+// with the hasher of source. Exits unless it then holds as many items as source.
+template <typename Load>
+double BestLoadMillis(unsigned repeats, const Filter& source, Load load) {
+  double best = 0;
+  for (unsigned r = 0; r < repeats; ++r) {
+    Filter target(0, source.hasher());
+    const auto start_time = NowNanos();
+    const bool loaded = load(&target);
+    const double millis = (NowNanos() - start_time) / 1e6;
+    if (!loaded || target.Size() != source.Size()) {
+      cerr << "A snapshot did not load back" << endl;
+      exit(4);
+    }
+    best = (r == 0) ? millis : min(best, millis);
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.threads = 4;
+  options.repeats = 3;
+  const bool parsed = ParseFlags(argc, argv, &options,
+      [&options](const string& flag, const string& value) {
+        if (flag == "--threads") {
+          options.threads = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--repeats") {
+          options.repeats = ParseNumber<unsigned>(flag, value);
+        } else if (flag == "--loads") {
+          for (const unsigned load : ParseNumberList<unsigned>(flag, value)) {
+            options.loads.push_back(load);
+          }
+        } else {
+          return false;
+        }
+        return true;
+      });
+  if (!parsed) return 1;
+  if (options.loads.empty()) options.loads = {25, 50, 75, 95};
+  bool valid = options.threads > 0 && options.repeats > 0;
+  for (const unsigned load : options.loads) valid = valid && load > 0 && load <= 100;
+  if (!valid) {
+    cerr << "Usage: " << argv[0] << " [--loads=L,L,...] [--threads=T] [--repeats=R] "
+         << "[--json=FILE]" << endl;
+    return 1;
+  }
+
+  const ShuffleRleCodec shuffle_rle;
+  vector<Statistics> results;
+  cout << StatisticsTableHeader(options.threads) << endl;
+  for (const unsigned load : options.loads) {
+    Filter filter(0);
+    FillToLoad(load / 100.0, &filter);
+    Statistics stats;
+    stats.load = filter.LoadFactor();
+
+    const size_t dense_bytes =
+        filter.SizeInBytes() + filter.Capacity() * (sizeof(uint64_t) + sizeof(uint64_t));
+    const Filter::Delta full = filter.export_delta(filter.epoch() + 1);
+    stats.format = "dense";
+    stats.bytes = dense_bytes;
+    stats.dense_fraction = 1;
+    stats.millis = BestLoadMillis(options.repeats, filter,
+        [&full](Filter* target) { return target->apply_delta(full); });
+    stats.threads_millis = 0;
+    cout << stats << endl;
+    results.push_back(stats);
+
+    const SnapshotCodec* codecs[] = {NULL, &shuffle_rle};
+    const char* const names[] = {"sparse", "sparse+shuffle"};
+    for (int c = 0; c < 2; ++c) {
+      const string snapshot = filter.save_snapshot(codecs[c]);
+      stats.format = names[c];
+      stats.bytes = snapshot.size();
+      stats.dense_fraction = snapshot.size() / static_cast<double>(dense_bytes);
+      stats.millis = BestLoadMillis(options.repeats, filter,
+          [&snapshot](Filter* target) { return target->load_snapshot(snapshot, 1); });
+      const unsigned threads = options.threads;
+      stats.threads_millis = BestLoadMillis(options.repeats, filter,
+          [&snapshot, threads](Filter* target) {
+            return target->load_snapshot(snapshot, threads);
+          });
+      cout << stats << endl;
+      results.push_back(stats);
+    }
+  }
+
+  if (!WriteJsonFile(
+          options, [&](ostream& json) { WriteJson(json, options, results); })) {
+    return 3;
+  }
+}
@@ -5,8 +5,35 @@
 #include <cstdint>
 #include <chrono>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 ::std::uint64_t NowNanos() {
   return ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
              ::std::chrono::steady_clock::now().time_since_epoch())
       .count();
 }
+
+// A cheaper timer for single operations: the time stamp counter, fenced so that the
+// operation being timed neither starts before the first reading nor finishes after the
+// second. Elsewhere it falls back to NowNanos(). Convert with TicksPerNano().
+inline ::std::uint64_t NowTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_lfence();
+  const ::std::uint64_t ticks = __rdtsc();
+  _mm_lfence();
+  return ticks;
+#else
+  return NowNanos();
+#endif
+}
+
+// The rate of NowTicks(), measured against NowNanos() over a few milliseconds.
+double TicksPerNano() {
+  const auto start_nanos = NowNanos();
+  const auto start_ticks = NowTicks();
+  while (NowNanos() - start_nanos < 20 * 1000 * 1000) {
+  }
+  return (NowTicks() - start_ticks) / static_cast<double>(NowNanos() - start_nanos);
+}
@@ -0,0 +1,400 @@
+// Streaming de-duplication on top of the cuckoo filter: copies the first
+// occurrence of every key from the input to stdout and drops the repeats.
+// It is invoked as:
+//
+//     ./dedup [-w WIDTH] [-t THREADS] [-n SHARDS] [-o SNAPSHOT] [FILE]
+//
+// Keys are newline-terminated lines, or fixed-width binary records of WIDTH
+// bytes with -w. FILE is mmap'd; without it keys are read from stdin in large
+// chunks. Each key is reduced to a 64-bit Bob Jenkins hash, which is what the
+// filters store, so two distinct keys are only merged if their 64-bit hashes
+// collide.
+//
+// The hashes are split over SHARDS (THREADS by default). A shard starts with
+// one filter and chains a fresh one whenever its newest filter fills up, so
+// any number of distinct keys fits. A pool of THREADS threads, the main one
+// included, handles each chunk in two steps: every thread hashes a slice of
+// the keys and sorts them by the thread owning their shard, then every thread
+// probes and inserts the keys of its own shards in input order, so the same
+// key always meets the same filters and the first occurrence wins. All
+// filters share one hasher, so a key is hashed once for its whole chain and
+// its buckets are prefetched kProbeBatch keys ahead of the probe.
+// Throughput is reported on stderr; with -o, filter f of shard s is saved as
+// SNAPSHOT.<s>.<f> at exit. With -w, a trailing partial record is reported
+// and the exit status is 5.
+
+#include "cuckoofilter.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace cuckoofilter;
+
+typedef CuckooFilter<uint64_t, 12> Filter;
+
+// keys hashed and probed per chunk
+const size_t kChunkKeys = 1 << 20;
+
+// bytes read from stdin at a time
+const size_t kReadBytes = 16 << 20;
+
+struct Options {
+  size_t width;  // 0 for newline-terminated keys
+  unsigned threads;
+  unsigned shards;
+  std::string snapshot;
+  std::string path;
+};
+
+class Deduplicator {
+  typedef void (Deduplicator::*Step)(unsigned);
+
+  Options opts_;
+  // shared by every filter, so one HashedKey probes a whole chain
+  const TwoIndependentMultiplyShift hasher_;
+  // the filters of each shard, oldest first; only the newest takes inserts
+  std::vector<std::vector<std::unique_ptr<Filter> > > filters_;
+  std::vector<const char *> keys_;
+  std::vector<size_t> lengths_;
+  std::vector<uint64_t> hashes_;
+  std::vector<char> first_;
+  // by_thread_[t][u]: keys of the slice hashed by thread t, in input order,
+  // whose shards thread u owns
+  std::vector<std::vector<std::vector<uint32_t> > > by_thread_;
+  // owned_[t]: the keys ProbeShards(t) takes, in input order
+  std::vector<std::vector<uint32_t> > owned_;
+  std::string out_;
+  bool write_failed_;
+
+  // the pool: threads 1..threads-1 run each step the main thread posts
+  std::vector<std::thread> pool_;
+  std::mutex lock_;
+  std::condition_variable posted_;
+  std::condition_variable finished_;
+  Step step_;
+  uint64_t num_steps_;
+  unsigned running_;
+  bool stopping_;
+
+ public:
+  size_t num_keys;
+  size_t num_unique;
+  size_t num_bytes;
+
+  explicit Deduplicator(const Options &opts)
+      : opts_(opts), hasher_(), filters_(opts.shards), write_failed_(false),
+        step_(NULL), num_steps_(0), running_(0), stopping_(false),
+        num_keys(0), num_unique(0), num_bytes(0) {
+    for (unsigned s = 0; s < opts_.shards; s++) {
+      filters_[s].push_back(std::unique_ptr<Filter>(new Filter(0, hasher_)));
+    }
+    by_thread_.resize(opts_.threads,
+                      std::vector<std::vector<uint32_t> >(opts_.threads));
+    owned_.resize(opts_.threads);
+    for (unsigned t = 1; t < opts_.threads; t++) {
+      pool_.push_back(std::thread(&Deduplicator::Serve, this, t));
+    }
+  }
+
+  ~Deduplicator() {
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      stopping_ = true;
+    }
+    posted_.notify_all();
+    for (auto &thread : pool_) {
+      thread.join();
+    }
+  }
+
+  // Consumes the complete keys at the front of [p, p + n) and returns the
+  // number of bytes used. At eof a trailing key without newline is taken too.
+  size_t Consume(const char *p, size_t n, bool eof) {
+    size_t used = 0;
+    while (used < n) {
+      keys_.clear();
+      lengths_.clear();
+      while (used < n && keys_.size() < kChunkKeys) {
+        size_t len, next;
+        if (opts_.width > 0) {
+          if (n - used < opts_.width) break;
+          len = next = opts_.width;
+        } else {
+          const char *nl = static_cast<const char *>(memchr(p + used, '\n', n - used));
+          if (nl == NULL && !eof) break;
+          len = (nl == NULL) ? n - used : nl - (p + used);
+          next = (nl == NULL) ? len : len + 1;
+        }
+        keys_.push_back(p + used);
+        lengths_.push_back(len);
+        used += next;
+      }
+      if (keys_.empty()) break;
+      ProcessChunk();
+      if (!Emit()) {
+        write_failed_ = true;
+        break;
+      }
+    }
+    return used;
+  }
+
+  bool WriteFailed() const { return write_failed_; }
+
+  bool SaveSnapshots() {
+    ShuffleRleCodec codec;
+    for (unsigned s = 0; s < opts_.shards; s++) {
+      for (size_t f = 0; f < filters_[s].size(); f++) {
+        std::stringstream name;
+        name << opts_.snapshot << "." << s << "." << f;
+        std::ofstream out(name.str().c_str(), std::ios::binary);
+        out << filters_[s][f]->save_snapshot(&codec);
+        if (!out) return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  void ProcessChunk() {
+    const size_t n = keys_.size();
+    hashes_.resize(n);
+    first_.assign(n, 0);
+    // every thread needs all keys of its shards before probing
+    RunStep(&Deduplicator::HashKeys);
+    RunStep(&Deduplicator::ProbeShards);
+  }
+
+  // Runs step on every thread of the pool and on this one, as thread 0.
+  void RunStep(Step step) {
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      step_ = step;
+      num_steps_++;
+      running_ = opts_.threads - 1;
+    }
+    posted_.notify_all();
+    (this->*step)(0);
+    std::unique_lock<std::mutex> guard(lock_);
+    finished_.wait(guard, [this] { return running_ == 0; });
+  }
+
+  void Serve(unsigned t) {
+    uint64_t done = 0;
+    std::unique_lock<std::mutex> guard(lock_);
+    for (;;) {
+      posted_.wait(guard, [this, done] {
+        return stopping_ || num_steps_ != done;
+      });
+      if (stopping_) return;
+      done = num_steps_;
+      const Step step = step_;
+      guard.unlock();
+      (this->*step)(t);
+      guard.lock();
+      if (--running_ == 0) finished_.notify_one();
+    }
+  }
+
+  // Hashes slice t of the chunk and sorts it by the thread owning each key.
+  void HashKeys(unsigned t) {
+    for (auto &keys : by_thread_[t]) {
+      keys.clear();
+    }
+    const size_t n = keys_.size();
+    const size_t end = n * (t + 1) / opts_.threads;
+    for (size_t k = n * t / opts_.threads; k < end; k++) {
+      uint32_t h1 = 0, h2 = 1;
+      HashUtil::BobHash(keys_[k], lengths_[k], &h1, &h2);
+      const uint64_t h = (static_cast<uint64_t>(h1) << 32) | h2;
+      hashes_[k] = h;
+      by_thread_[t][ShardOf(h) % opts_.threads].push_back(k);
+    }
+  }
+
+  unsigned ShardOf(uint64_t h) const {
+    return ((h >> 32) * opts_.shards) >> 32;
+  }
+
+  // Probes and inserts the keys that fall into shards t, t + threads, ...
+  // in input order: the slices are in input order and so is each of them.
+  // Key i + kProbeBatch is hashed and prefetched before key i is probed.
+  void ProbeShards(unsigned t) {
+    std::vector<uint32_t> &owned = owned_[t];
+    owned.clear();
+    for (unsigned slice = 0; slice < opts_.threads; slice++) {
+      owned.insert(owned.end(), by_thread_[slice][t].begin(),
+                   by_thread_[slice][t].end());
+    }
+    Filter::HashedKey ahead[kProbeBatch];
+    const auto prefetch = [&](size_t i) {
+      const uint64_t h = hashes_[owned[i]];
+      const std::vector<std::unique_ptr<Filter> > &chain = filters_[ShardOf(h)];
+      Filter::HashedKey &key = ahead[i % kProbeBatch];
+      chain.front()->hash_key(h, &key);
+      for (auto &filter : chain) {
+        filter->prefetch(key);
+      }
+    };
+    const size_t n = owned.size();
+    for (size_t i = 0; i < n && i < kProbeBatch; i++) {
+      prefetch(i);
+    }
+    for (size_t i = 0; i < n; i++) {
+      const uint32_t k = owned[i];
+      const Filter::HashedKey key = ahead[i % kProbeBatch];
+      if (i + kProbeBatch < n) prefetch(i + kProbeBatch);
+      first_[k] = !Seen(ShardOf(hashes_[k]), hashes_[k], key);
+    }
+  }
+
+  // Whether shard s has seen h, hashed as key; if not, records it in the
+  // newest filter and chains a fresh one once that is full.
+  bool Seen(unsigned s, uint64_t h, const Filter::HashedKey &key) {
+    std::vector<std::unique_ptr<Filter> > &chain = filters_[s];
+    for (auto &filter : chain) {
+      if (filter->contains(h, key)) return true;
+    }
+    // never fails: the newest filter is never full
+    chain.back()->insert(h, 0);
+    if (chain.back()->Full()) {
+      chain.push_back(std::unique_ptr<Filter>(new Filter(0, hasher_)));
+    }
+    return false;
+  }
+
+  bool Emit() {
+    const size_t n = keys_.size();
+    out_.clear();
+    for (size_t k = 0; k < n; k++) {
+      num_bytes += lengths_[k] + (opts_.width == 0);
+      if (!first_[k]) continue;
+      out_.append(keys_[k], lengths_[k]);
+      if (opts_.width == 0) out_.push_back('\n');
+      num_unique++;
+    }
+    num_keys += n;
+    return fwrite(out_.data(), 1, out_.size(), stdout) == out_.size();
+  }
+};
+
+static bool ParseNumber(const char *s, size_t *v) {
+  std::stringstream input_string(s);
+  input_string >> *v;
+  return !input_string.fail() && *v > 0;
+}
+
+int main(int argc, char **argv) {
+  Options opts;
+  opts.width = 0;
+  opts.threads = 1;
+  opts.shards = 0;
+  int c;
+  size_t v;
+  while ((c = getopt(argc, argv, "w:t:n:o:")) != -1) {
+    switch (c) {
+      case 'w':
+      case 't':
+      case 'n':
+        if (!ParseNumber(optarg, &v)) {
+          std::cerr << "Invalid number: " << optarg << std::endl;
+          return 2;
+        }
+        if (c == 'w') opts.width = v;
+        if (c == 't') opts.threads = v;
+        if (c == 'n') opts.shards = v;
+        break;
+      case 'o':
+        opts.snapshot = optarg;
+        break;
+      default:
+        std::cerr << "Usage: " << argv[0]
+                  << " [-w WIDTH] [-t THREADS] [-n SHARDS] [-o SNAPSHOT] [FILE]"
+                  << std::endl;
+        return 1;
+    }
+  }
+  if (opts.shards < opts.threads) opts.shards = opts.threads;
+  if (optind < argc) opts.path = argv[optind];
+
+  Deduplicator dedup(opts);
+  const auto start_time = NowNanos();
+  // bytes of a trailing partial record, which -w cannot take
+  size_t left_over = 0;
+
+  if (!opts.path.empty()) {
+    int fd = open(opts.path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      perror(opts.path.c_str());
+      return 3;
+    }
+    if (st.st_size > 0) {
+      void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        perror("mmap");
+        return 3;
+      }
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      const char *data = static_cast<const char *>(p);
+      left_over = st.st_size - dedup.Consume(data, st.st_size, true);
+      munmap(p, st.st_size);
+    }
+    close(fd);
+  } else {
+    std::vector<char> buf(kReadBytes);
+    size_t have = 0;
+    for (;;) {
+      if (have == buf.size()) buf.resize(2 * buf.size());
+      ssize_t r = read(0, &buf[have], buf.size() - have);
+      if (r < 0 && errno == EINTR) continue;
+      if (r < 0) {
+        perror("read");
+        return 3;
+      }
+      have += r;
+      const bool eof = (r == 0);
+      size_t used = dedup.Consume(&buf[0], have, eof);
+      memmove(&buf[0], &buf[used], have - used);
+      have -= used;
+      if (eof || dedup.WriteFailed()) break;
+    }
+    left_over = have;
+  }
+  if (fflush(stdout) != 0 || dedup.WriteFailed()) {
+    perror("write");
+    return 3;
+  }
+
+  const double seconds = (NowNanos() - start_time) / 1e9;
+  std::cerr << "dedup: " << dedup.num_keys << " keys, " << dedup.num_unique
+            << " unique, " << dedup.num_keys / seconds / 1e6 << " Mkeys/s, "
+            << dedup.num_bytes / seconds / (1 << 20) << " MB/s" << std::endl;
+
+  if (!opts.snapshot.empty() && !dedup.SaveSnapshots()) {
+    perror(opts.snapshot.c_str());
+    return 3;
+  }
+  if (left_over > 0) {
+    std::cerr << "dedup: ignored a trailing partial record of " << left_over
+              << " bytes" << std::endl;
+    return 5;
+  }
+  return 0;
+}
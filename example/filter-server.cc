@@ -0,0 +1,509 @@
+// A standalone server that shares cuckoo filters between processes over a
+// Unix domain socket. It is invoked as:
+//
+//     ./filter-server /tmp/cuckoofilter.sock [threads]
+//
+// The key space is split into one shard (a CuckooFilter) per worker thread,
+// and each worker is pinned to a core of its own. A shard is only ever
+// touched by the worker that owns it, so it needs no lock. The filter's
+// table has a fixed Capacity() of 2^18 slots whatever size it is constructed
+// with, so each shard holds about that many keys before inserts come back
+// kResultFull; more threads is the way to more room. Each worker runs its own
+// epoll loop over the connections handed to it by the accept loop and parses
+// every complete request in its read buffer. It splits each batch by shard,
+// queues every part for the worker owning that shard and runs its own part,
+// then serves the parts queued for it by others until its own have come
+// back. A part's keys are hashed and their buckets prefetched kProbeBatch at
+// a time before any is probed, so the cache misses of a group overlap. A
+// batch thus costs one queue push per shard it touches, plus one eventfd
+// write for each owner asleep in epoll_wait; an owner that is busy picks the
+// part up between events without a system call, and one woken already is not
+// signalled again. server-test reports the time per batch. A connection whose unsent responses pass kOutHighWater is not read
+// from until the client catches up, so a client that only sends blocks on
+// its own socket instead of growing the server's buffers. A malformed request
+// is answered with kServerBadRequest, after the responses to the requests
+// before it, and the connection is then closed. The wire format is described
+// in src/server-protocol.h.
+
+#include "cuckoofilter.h"
+#include "server-protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace cuckoofilter;
+
+typedef CuckooFilter<uint64_t, 12> Filter;
+
+// unsent response bytes past which a connection is not read from
+const size_t kOutHighWater = 4 << 20;
+
+static std::atomic<bool> stopping(false);
+
+static void HandleSignal(int) { stopping = true; }
+
+// The shard of a key among n is picked from the high bits of a
+// multiplicative hash so that it stays independent of the bucket index the
+// filter derives.
+static size_t ShardOf(uint64_t key, size_t n) {
+  return ((key * 0x9e3779b97f4a7c15ULL) >> 32) * n >> 32;
+}
+
+// workers still in their epoll loop; the others keep running the parts of
+// batches queued for them until none is
+static std::atomic<unsigned> running_workers(0);
+
+struct Connection {
+  int fd;
+  std::string in;
+  size_t in_pos;
+  std::string out;
+  size_t out_pos;
+  // the epoll events the connection is registered for
+  uint32_t events;
+  // set by a malformed request: nothing more is read, and the connection is
+  // closed once its responses are sent
+  bool closing;
+
+  explicit Connection(int f)
+      : fd(f), in_pos(0), out_pos(0), events(EPOLLIN | EPOLLRDHUP),
+        closing(false) {}
+
+  size_t Unsent() const { return out.size() - out_pos; }
+};
+
+class Worker;
+
+// The keys of one batch that fall in one shard, queued for the worker owning
+// it: their positions in the request, and where their results go. pending
+// is decremented once they have run.
+struct Task {
+  uint16_t op;
+  const char *payload;
+  const std::vector<uint32_t> *positions;
+  char *results;
+  char *values;
+  std::atomic<size_t> *pending;
+};
+
+class Worker {
+  // the index of this worker and of the shard it owns
+  const size_t index_;
+  std::vector<std::unique_ptr<Worker> > *workers_;
+  // the shard; the capacity is fixed by the table, see above
+  Filter filter_;
+  int epfd_;
+  // signalled when a task is queued while the worker sleeps in epoll_wait
+  int event_fd_;
+  // set while the worker is (about to be) in epoll_wait; cleared by the
+  // first Post() that signals event_fd_
+  std::atomic<bool> sleeping_;
+  // per-shard positions of the keys of the batch being executed
+  std::vector<std::vector<uint32_t> > by_shard_;
+  // parts of this worker's batch still running on other workers
+  std::atomic<size_t> pending_;
+  // the parts of other workers' batches for this shard
+  std::mutex tasks_lock_;
+  std::vector<Task> tasks_;
+  std::vector<Task> running_;
+  // the open connections, added to by the accept loop
+  std::mutex connections_lock_;
+  std::set<Connection *> connections_;
+
+ public:
+  Worker(size_t index, std::vector<std::unique_ptr<Worker> > *workers)
+      : index_(index), workers_(workers), filter_(0),
+        epfd_(epoll_create1(0)), event_fd_(eventfd(0, EFD_NONBLOCK)),
+        sleeping_(false), by_shard_(workers->size()), pending_(0) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    // told apart from the connections by its NULL pointer
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, event_fd_, &ev);
+  }
+
+  // Closes the connections still open; the worker must have stopped.
+  ~Worker() {
+    for (Connection *c : connections_) {
+      close(c->fd);
+      delete c;
+    }
+    close(event_fd_);
+    close(epfd_);
+  }
+
+  // Queues t for this worker; called from other workers. Only a worker
+  // that is sleeping, or about to, is signalled: one that is awake runs
+  // its queue before it next waits.
+  void Post(const Task &t) {
+    {
+      std::lock_guard<std::mutex> guard(tasks_lock_);
+      tasks_.push_back(t);
+    }
+    if (sleeping_.exchange(false)) {
+      uint64_t one = 1;
+      ssize_t w = write(event_fd_, &one, sizeof(one));
+      (void)w;
+    }
+  }
+
+  void Add(int fd) {
+    Connection *c = new Connection(fd);
+    {
+      std::lock_guard<std::mutex> guard(connections_lock_);
+      connections_.insert(c);
+    }
+    struct epoll_event ev;
+    ev.events = c->events;
+    ev.data.ptr = c;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  void Run() {
+    const int kMaxEvents = 64;
+    struct epoll_event events[kMaxEvents];
+    while (!stopping) {
+      // Announced before the queue is checked, so that a task posted after
+      // the check sees the worker sleeping and signals it.
+      sleeping_ = true;
+      RunTasks();
+      int n = epoll_wait(epfd_, events, kMaxEvents, 100);
+      sleeping_ = false;
+      for (int e = 0; e < n; e++) {
+        if (events[e].data.ptr == NULL) {
+          uint64_t count;
+          ssize_t r = read(event_fd_, &count, sizeof(count));
+          (void)r;
+          RunTasks();
+          continue;
+        }
+        Connection *c = static_cast<Connection *>(events[e].data.ptr);
+        bool alive = true;
+        if (events[e].events & EPOLLOUT) {
+          alive = Flush(c);
+        }
+        // Read() also takes up the requests left buffered while the
+        // responses were over the high-water mark.
+        if (alive) {
+          alive = Read(c);
+        }
+        if (!alive) {
+          Close(c);
+        }
+      }
+    }
+    // another worker may still be waiting for a part of its batch
+    running_workers--;
+    while (running_workers > 0) {
+      RunTasks();
+      std::this_thread::yield();
+    }
+  }
+
+ private:
+  void Close(Connection *c) {
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    {
+      std::lock_guard<std::mutex> guard(connections_lock_);
+      connections_.erase(c);
+    }
+    delete c;
+  }
+
+  // Executes the buffered requests and reads more until the socket is
+  // drained or the unsent responses pass kOutHighWater. Every request is
+  // executed before answering, so a pipelined burst turns into one write.
+  bool Read(Connection *c) {
+    char buf[1 << 16];
+    while (!c->closing) {
+      ExecuteBuffered(c);
+      if (c->closing || c->Unsent() >= kOutHighWater) break;
+      ssize_t r = read(c->fd, buf, sizeof(buf));
+      if (r > 0) {
+        c->in.append(buf, r);
+        continue;
+      }
+      if (r == 0) return false;
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return false;
+    }
+    return Flush(c);
+  }
+
+  // Executes the complete requests in c->in while the unsent responses stay
+  // under kOutHighWater. A malformed request is answered with
+  // kServerBadRequest and marks the connection as closing.
+  void ExecuteBuffered(Connection *c) {
+    while (c->Unsent() < kOutHighWater) {
+      size_t avail = c->in.size() - c->in_pos;
+      if (avail < sizeof(RequestHeader)) break;
+      RequestHeader req;
+      memcpy(&req, &c->in[c->in_pos], sizeof(req));
+      if (req.magic != kRequestMagic || req.op < kOpFind ||
+          req.op > kOpErase || req.count > kServerMaxBatch) {
+        ResponseHeader resp;
+        resp.magic = kResponseMagic;
+        resp.op = req.op;
+        resp.status = kServerBadRequest;
+        resp.count = 0;
+        resp.seq = req.seq;
+        c->out.append(reinterpret_cast<const char *>(&resp), sizeof(resp));
+        c->closing = true;
+        c->in.clear();
+        c->in_pos = 0;
+        return;
+      }
+      uint64_t payload = RequestPayloadBytes(req.op, req.count);
+      if (avail < sizeof(req) + payload) break;
+      Execute(req, &c->in[c->in_pos + sizeof(req)], &c->out);
+      c->in_pos += sizeof(req) + payload;
+    }
+    c->in.erase(0, c->in_pos);
+    c->in_pos = 0;
+  }
+
+  // Writes what the socket takes, then polls for output while some is left
+  // and for input while it is under kOutHighWater. Returns false once a
+  // closing connection has sent everything.
+  bool Flush(Connection *c) {
+    while (c->out_pos < c->out.size()) {
+      ssize_t w = write(c->fd, &c->out[c->out_pos], c->out.size() - c->out_pos);
+      if (w > 0) {
+        c->out_pos += w;
+        continue;
+      }
+      if (w < 0 && errno == EINTR) continue;
+      if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      return false;
+    }
+    if (c->out_pos == c->out.size() || c->out_pos >= kOutHighWater) {
+      c->out.erase(0, c->out_pos);
+      c->out_pos = 0;
+    }
+    if (c->closing && c->Unsent() == 0) return false;
+    uint32_t events = (c->Unsent() > 0) ? EPOLLOUT : 0;
+    if (c->Unsent() < kOutHighWater && !c->closing) {
+      events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events != c->events) {
+      struct epoll_event ev;
+      ev.events = events;
+      ev.data.ptr = c;
+      epoll_ctl(epfd_, EPOLL_CTL_MOD, c->fd, &ev);
+      c->events = events;
+    }
+    return true;
+  }
+
+  void Execute(const RequestHeader &req, const char *payload, std::string *out) {
+    ResponseHeader resp;
+    resp.magic = kResponseMagic;
+    resp.op = req.op;
+    resp.status = kServerOk;
+    resp.count = req.count;
+    resp.seq = req.seq;
+
+    const size_t at = out->size();
+    out->resize(at + sizeof(resp) + ResponsePayloadBytes(req.op, req.count));
+    memcpy(&(*out)[at], &resp, sizeof(resp));
+    char *results = &(*out)[at + sizeof(resp)];
+    char *values = results + req.count;
+
+    const size_t stride = (req.op == kOpInsert) ? 16 : 8;
+    for (auto &v : by_shard_) v.clear();
+    for (uint32_t k = 0; k < req.count; k++) {
+      uint64_t key;
+      memcpy(&key, payload + k * stride, sizeof(key));
+      by_shard_[ShardOf(key, by_shard_.size())].push_back(k);
+    }
+
+    // the parts are counted before any is queued, as the first may come
+    // back before the last is sent
+    size_t parts = 0;
+    for (size_t s = 0; s < by_shard_.size(); s++) {
+      parts += (s != index_ && !by_shard_[s].empty());
+    }
+    pending_ = parts;
+    for (size_t s = 0; s < by_shard_.size(); s++) {
+      if (s == index_ || by_shard_[s].empty()) continue;
+      Task t = {req.op, payload, &by_shard_[s], results, values, &pending_};
+      (*workers_)[s]->Post(t);
+    }
+    Task own = {req.op, payload, &by_shard_[index_], results, values, NULL};
+    RunOnShard(own);
+    // Serving the parts queued here while waiting keeps two workers waiting
+    // on each other from stalling.
+    while (pending_.load(std::memory_order_acquire) != 0) {
+      RunTasks();
+    }
+  }
+
+  // Runs the parts of batches queued for this worker's shard.
+  void RunTasks() {
+    {
+      std::lock_guard<std::mutex> guard(tasks_lock_);
+      if (tasks_.empty()) return;
+      running_.swap(tasks_);
+    }
+    for (const Task &t : running_) {
+      RunOnShard(t);
+      t.pending->fetch_sub(1, std::memory_order_release);
+    }
+    running_.clear();
+  }
+
+  // Runs the keys of t, kProbeBatch at a time: all of a group are hashed
+  // and their buckets prefetched before the first is probed. Inserts and
+  // erases rehash, but find their buckets in cache.
+  void RunOnShard(const Task &t) {
+    const size_t stride = (t.op == kOpInsert) ? 16 : 8;
+    const std::vector<uint32_t> &positions = *t.positions;
+    const size_t n = positions.size();
+    uint64_t keys[kProbeBatch];
+    Filter::HashedKey h[kProbeBatch];
+    for (size_t begin = 0; begin < n; begin += kProbeBatch) {
+      const size_t end = std::min(n, begin + kProbeBatch);
+      for (size_t i = begin; i < end; i++) {
+        memcpy(&keys[i - begin], t.payload + positions[i] * stride,
+               sizeof(keys[0]));
+        filter_.hash_key(keys[i - begin], &h[i - begin]);
+        filter_.prefetch(h[i - begin]);
+      }
+      for (size_t i = begin; i < end; i++) {
+        const uint32_t k = positions[i];
+        const uint64_t key = keys[i - begin];
+        uint64_t val = 0;
+        bool ok = false;
+        switch (t.op) {
+          case kOpFind:
+            ok = filter_.find(key, h[i - begin], val);
+            if (!ok) val = 0;
+            memcpy(t.values + k * sizeof(val), &val, sizeof(val));
+            break;
+          case kOpContains:
+            ok = filter_.contains(key, h[i - begin]);
+            break;
+          case kOpInsert:
+            memcpy(&val, t.payload + k * stride + 8, sizeof(val));
+            ok = filter_.insert(key, val);
+            break;
+          case kOpErase:
+            ok = filter_.erase(key);
+            break;
+        }
+        if (!ok) {
+          t.results[k] = kResultNo;
+        } else if (t.op == kOpInsert && filter_.Full()) {
+          t.results[k] = kResultFull;
+        } else {
+          t.results[k] = kResultYes;
+        }
+      }
+    }
+  }
+};
+
+static void PinToCore(std::thread *t, unsigned core) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  pthread_setaffinity_np(t->native_handle(), sizeof(set), &set);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " SOCKET_PATH [THREADS]" << std::endl;
+    return 1;
+  }
+  unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (argc == 3) {
+    std::stringstream input_string(argv[2]);
+    input_string >> num_threads;
+    if (input_string.fail() || num_threads == 0) {
+      std::cerr << "Invalid number of threads: " << argv[2] << std::endl;
+      return 2;
+    }
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << argv[1] << std::endl;
+    return 2;
+  }
+  strcpy(addr.sun_path, argv[1]);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  unlink(argv[1]);
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(listen_fd, 128) < 0) {
+    perror("filter-server");
+    return 3;
+  }
+
+  signal(SIGINT, HandleSignal);
+  signal(SIGTERM, HandleSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<std::unique_ptr<Worker> > workers(num_threads);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; t++) {
+    workers[t].reset(new Worker(t, &workers));
+  }
+  running_workers = num_threads;
+  for (unsigned t = 0; t < num_threads; t++) {
+    threads.push_back(std::thread(&Worker::Run, workers[t].get()));
+    PinToCore(&threads.back(), t % std::max(1u, std::thread::hardware_concurrency()));
+  }
+  std::cerr << "filter-server: " << num_threads << " shards on " << argv[1]
+            << std::endl;
+
+  int epfd = epoll_create1(0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+  unsigned next_worker = 0;
+  while (!stopping) {
+    if (epoll_wait(epfd, &ev, 1, 100) <= 0) continue;
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+      workers[next_worker]->Add(fd);
+      next_worker = (next_worker + 1) % num_threads;
+    }
+  }
+
+  for (auto &t : threads) {
+    t.join();
+  }
+  // closes the connections left open
+  workers.clear();
+  close(epfd);
+  close(listen_fd);
+  unlink(argv[1]);
+  return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Round trips through the example tools, run by `make test` from the top of
+# the tree: dedup must keep exactly the first occurrence of every key, as
+# awk does, and keys sent to a fresh filter-server must come back
+# (example/server-test.cc).
+set -e
+
+dir=$(mktemp -d)
+server=
+cleanup() {
+  if [ -n "$server" ]; then kill "$server" 2>/dev/null || true; fi
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+# 500000 keys, 350003 of them distinct: more than one filter holds, so a
+# single shard chains a second one
+awk 'BEGIN { for (i = 0; i < 500000; i++) print "key-" i * 7919 % 350003 }' \
+  > "$dir/keys"
+awk '!seen[$0]++' "$dir/keys" > "$dir/expected"
+for threads in 1 3; do
+  ./dedup -t $threads < "$dir/keys" > "$dir/stdin" 2>/dev/null
+  cmp "$dir/expected" "$dir/stdin"
+  ./dedup -t $threads "$dir/keys" > "$dir/mmap" 2>/dev/null
+  cmp "$dir/expected" "$dir/mmap"
+done
+echo "dedup: round trip ok"
+
+./filter-server "$dir/sock" 2 2>/dev/null &
+server=$!
+tries=0
+while [ ! -S "$dir/sock" ]; do
+  tries=$((tries + 1))
+  if [ $tries -gt 100 ]; then
+    echo "filter-server did not start" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+./server-test "$dir/sock"
@@ -0,0 +1,206 @@
+// Round trip through a running filter-server (example/filter-server.cc): keys
+// inserted over one connection are found with their values, reported by
+// contains and erased again over another, with the requests pipelined, and a
+// malformed request is refused before the connection is closed. The time
+// per batch of each phase is reported on stderr. It is invoked as:
+//
+//     ./server-test /tmp/cuckoofilter.sock
+//
+// and is run against a fresh server by example/round-trip.sh.
+
+#include "server-protocol.h"
+
+#include <assert.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace cuckoofilter;
+
+// keys sent in one request
+const uint32_t kBatch = 1000;
+
+class Client {
+  int fd_;
+  uint32_t seq_;
+
+ public:
+  explicit Client(const char *path) : fd_(-1), seq_(0) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ >= 0 &&
+        connect(fd_, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr)) < 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  ~Client() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool Connected() const { return fd_ >= 0; }
+
+  // the seq of the next request sent
+  uint32_t NextSeq() const { return seq_; }
+
+  // Sends op on keys, with vals as the values of kOpInsert.
+  bool Send(uint16_t op, const std::vector<uint64_t> &keys,
+            const std::vector<uint64_t> &vals) {
+    RequestHeader req;
+    req.magic = kRequestMagic;
+    req.op = op;
+    req.flags = 0;
+    req.count = keys.size();
+    req.seq = seq_++;
+    std::string buf(reinterpret_cast<const char *>(&req), sizeof(req));
+    for (size_t k = 0; k < keys.size(); k++) {
+      buf.append(reinterpret_cast<const char *>(&keys[k]), 8);
+      if (op == kOpInsert) {
+        buf.append(reinterpret_cast<const char *>(&vals[k]), 8);
+      }
+    }
+    return WriteAll(buf.data(), buf.size());
+  }
+
+  // Reads the next response into *resp, its result bytes into *results and,
+  // for kOpFind, its values into *vals.
+  bool Receive(ResponseHeader *resp, std::vector<uint8_t> *results,
+               std::vector<uint64_t> *vals) {
+    if (!ReadAll(resp, sizeof(*resp)) || resp->magic != kResponseMagic) {
+      return false;
+    }
+    results->resize(resp->count);
+    vals->resize(resp->op == kOpFind ? resp->count : 0);
+    return ReadAll(results->data(), results->size()) &&
+           ReadAll(vals->data(), vals->size() * 8);
+  }
+
+  // Whether the server has closed the connection.
+  bool AtEof() {
+    char c;
+    return read(fd_, &c, 1) == 0;
+  }
+
+ private:
+  bool WriteAll(const char *p, size_t n) {
+    while (n > 0) {
+      ssize_t w = write(fd_, p, n);
+      if (w <= 0) return false;
+      p += w;
+      n -= w;
+    }
+    return true;
+  }
+
+  bool ReadAll(void *buf, size_t n) {
+    char *p = static_cast<char *>(buf);
+    while (n > 0) {
+      ssize_t r = read(fd_, p, n);
+      if (r <= 0) return false;
+      p += r;
+      n -= r;
+    }
+    return true;
+  }
+};
+
+// The keys of batch b, spread over the 64-bit range and never zero.
+std::vector<uint64_t> Keys(uint32_t b) {
+  std::vector<uint64_t> keys;
+  for (uint64_t k = b * kBatch; k < (b + 1) * kBatch; k++) {
+    keys.push_back((k + 1) * 0x9e3779b97f4a7c15ULL);
+  }
+  return keys;
+}
+
+// Sends op on every batch before reading any response, then checks that the
+// responses come back in order and that every key got the result expected.
+// Reports the wall time per batch and the key rate on stderr.
+void RoundTrip(Client *client, uint16_t op, uint32_t num_batches,
+               uint8_t expected) {
+  static const char *const kOpNames[] = {"", "find", "contains", "insert",
+                                         "erase"};
+  const auto start = std::chrono::steady_clock::now();
+  const uint32_t first = client->NextSeq();
+  std::vector<uint64_t> vals;
+  for (uint32_t b = 0; b < num_batches; b++) {
+    const std::vector<uint64_t> keys = Keys(b);
+    vals.assign(keys.begin(), keys.end());
+    for (uint64_t &v : vals) v = ~v;
+    const bool sent = client->Send(op, keys, vals);
+    assert(sent);
+  }
+  ResponseHeader resp;
+  std::vector<uint8_t> results;
+  for (uint32_t b = 0; b < num_batches; b++) {
+    const bool received = client->Receive(&resp, &results, &vals);
+    assert(received);
+    assert(resp.op == op && resp.status == kServerOk);
+    assert(resp.seq == first + b && resp.count == kBatch);
+    const std::vector<uint64_t> keys = Keys(b);
+    for (uint32_t k = 0; k < kBatch; k++) {
+      assert(results[k] == expected);
+      if (op == kOpFind) {
+        assert(vals[k] == (expected == kResultYes ? ~keys[k] : 0));
+      }
+    }
+  }
+  const double micros = std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+  std::cerr << kOpNames[op] << ": " << micros / num_batches << " us/batch, "
+            << num_batches * kBatch / micros << " Mkeys/s"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::cerr << "Usage: " << argv[0] << " SOCKET_PATH" << std::endl;
+    return 1;
+  }
+  const uint32_t num_batches = 64;
+  {
+    Client writer(argv[1]);
+    assert(writer.Connected());
+    RoundTrip(&writer, kOpInsert, num_batches, kResultYes);
+  }
+  Client reader(argv[1]);
+  assert(reader.Connected());
+  RoundTrip(&reader, kOpFind, num_batches, kResultYes);
+  RoundTrip(&reader, kOpContains, num_batches, kResultYes);
+  RoundTrip(&reader, kOpErase, num_batches, kResultYes);
+  RoundTrip(&reader, kOpContains, num_batches, kResultNo);
+  RoundTrip(&reader, kOpFind, num_batches, kResultNo);
+
+  // a request sent ahead of a malformed one is still answered
+  Client bad(argv[1]);
+  const std::vector<uint64_t> keys = Keys(0);
+  const bool sent = bad.Send(kOpContains, keys, keys) &&
+                    bad.Send(kOpErase + 1, keys, keys);
+  assert(sent);
+  ResponseHeader resp;
+  std::vector<uint8_t> results;
+  std::vector<uint64_t> vals;
+  bool received = bad.Receive(&resp, &results, &vals);
+  assert(received && resp.status == kServerOk && resp.count == kBatch);
+  received = bad.Receive(&resp, &results, &vals);
+  assert(received);
+  assert(resp.status == kServerBadRequest && resp.op == kOpErase + 1);
+  assert(resp.seq == 1 && resp.count == 0);
+  const bool closed = bad.AtEof();
+  assert(closed);
+
+  std::cout << "Test Successful" << std::endl;
+  return 0;
+}
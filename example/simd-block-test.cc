@@ -0,0 +1,434 @@
+// Behavioural tests of the SIMD block filters: no key that was added is ever
+// missed, and every kernel sets the same bits, so filters built on different
+// CPUs answer alike.
+
+#include "simd-block-512.h"
+#include "simd-block-counting.h"
+#include "simd-block.h"
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A hash with fixed seeds, so that filters built separately from the same
+// keys set the same bits.
+struct FixedHash {
+  uint64_t operator()(uint64_t key) const {
+    // the splitmix64 finalizer
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+  }
+};
+
+// The instruction sets this CPU has kernels for, slowest first.
+std::vector<SimdBlockIsa> SupportedIsas() {
+  std::vector<SimdBlockIsa> isas;
+  for (SimdBlockIsa isa : {SimdBlockIsa::kScalar, SimdBlockIsa::kSse42,
+                           SimdBlockIsa::kAvx2, SimdBlockIsa::kAvx512}) {
+    if (SimdBlockIsaSupported(isa)) isas.push_back(isa);
+  }
+  return isas;
+}
+
+// n distinct keys starting from first, spread over the 64-bit range.
+std::vector<uint64_t> Keys(uint64_t first, size_t n) {
+  std::vector<uint64_t> keys(n);
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = (first + i) * 0x9e3779b97f4a7c15ULL;
+  }
+  return keys;
+}
+
+// Builds a filter of bytes bytes from the same num_keys keys with every
+// kernel. None misses an added key, and all give the same answers for absent
+// keys, with a false positive rate below 1%.
+template <typename Filter>
+void CheckKernels(const char *name, uint64_t bytes, size_t num_keys) {
+  const std::vector<uint64_t> added = Keys(0, num_keys);
+  const std::vector<uint64_t> absent = Keys(1 << 30, 100000);
+  std::vector<bool> first_answers;
+  for (SimdBlockIsa isa : SupportedIsas()) {
+    Filter filter = Filter::WithBytes(bytes, isa);
+    for (uint64_t key : added) filter.Add(key);
+    size_t missed = 0;
+    for (uint64_t key : added) missed += !filter.Find(key);
+    assert(missed == 0);
+    std::vector<bool> answers;
+    size_t false_positives = 0;
+    for (uint64_t key : absent) {
+      answers.push_back(filter.Find(key));
+      false_positives += answers.back();
+    }
+    if (first_answers.empty()) first_answers = answers;
+    assert(answers == first_answers);
+    assert(false_positives < absent.size() / 100);
+  }
+  std::cout << name << " kernels done: " << SupportedIsas().size()
+            << " instruction sets" << std::endl;
+}
+
+// The 512-bit variant finds every key it was given and its AVX-512, AVX2 and
+// scalar kernels agree.
+void TestSimdBlock512() {
+  CheckKernels<SimdBlockFilter512<FixedHash> >("SimdBlockFilter512", 1 << 16,
+                                               1 << 14);
+}
+
+// Every filter runs the fastest kernel it has within the instruction set it
+// is given, the best one the CPU supports by default, and the kernels of the
+// 256-bit and the counting filters agree.
+void TestDispatch() {
+  for (SimdBlockIsa isa : SupportedIsas()) {
+    const SimdBlockFilter<> block(16, isa);
+    const SimdBlockFilter512<> wide(16, isa);
+    const CountingSimdBlockFilter<> counting(16, isa);
+    assert(block.Isa() == std::min(isa, SimdBlockIsa::kAvx2));
+    assert(wide.Isa() == isa);
+    assert(counting.Isa() == std::min(isa, SimdBlockIsa::kAvx2));
+  }
+  const SimdBlockFilter<> best(16);
+  assert(best.Isa() == std::min(BestSimdBlockIsa(), SimdBlockIsa::kAvx2));
+
+  CheckKernels<SimdBlockFilter<FixedHash> >("SimdBlockFilter", 1 << 16,
+                                            1 << 14);
+  // four bits per position leave the counting filter fewer positions
+  CheckKernels<CountingSimdBlockFilter<FixedHash> >("CountingSimdBlockFilter",
+                                                    1 << 16, 1 << 12);
+}
+
+// Adding keys in batches, grouped by stripe or not, sets the same bits as
+// adding them one by one, and looking them up in batches gives the answers
+// of Find(), whatever the batch length and kernel. The filter spans several
+// stripes.
+void TestBatches() {
+  typedef SimdBlockFilter<FixedHash> Filter;
+  const uint64_t bytes = 4 << Filter::LOG_STRIPE_BYTE_SIZE;
+  const std::vector<uint64_t> added = Keys(0, 200003);
+  std::vector<uint64_t> queries = Keys(1 << 30, 100000);
+  queries.insert(queries.end(), added.begin(), added.end());
+
+  Filter single = Filter::WithBytes(bytes);
+  for (uint64_t key : added) single.Add(key);
+  std::vector<uint8_t> expected(queries.size());
+  for (size_t i = 0; i < queries.size(); i++) {
+    expected[i] = single.Find(queries[i]);
+  }
+
+  for (SimdBlockIsa isa : SupportedIsas()) {
+    for (bool sort_by_block : {false, true}) {
+      Filter batched = Filter::WithBytes(bytes, isa);
+      batched.AddBatch(added.data(), added.size(), sort_by_block);
+      for (size_t n : {size_t(0), size_t(1), Filter::kBatchAhead - 1,
+                       Filter::kBatchAhead + 1, queries.size()}) {
+        std::vector<uint8_t> found(n, 2);
+        batched.FindBatch(queries.data(), n, found.data(), sort_by_block);
+        assert(std::equal(found.begin(), found.end(), expected.begin()));
+      }
+    }
+  }
+  std::cout << "Batches done: " << std::endl;
+}
+
+// Threads adding keys at once into a filter small enough for them to share
+// buckets lose none of their bits: the result answers as a filter built on
+// one thread does, half the threads using AddConcurrent() and half
+// AddBatchConcurrent().
+void TestConcurrentAdds() {
+  typedef SimdBlockFilter<FixedHash> Filter;
+  const unsigned num_threads = 8;
+  const std::vector<uint64_t> added = Keys(0, 40000);
+  const std::vector<uint64_t> queries = Keys(1 << 30, 100000);
+  for (int round = 0; round < 5; round++) {
+    Filter serial = Filter::WithBytes(1 << 12);
+    for (uint64_t key : added) serial.Add(key);
+    Filter shared = Filter::WithBytes(1 << 12);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < num_threads; t++) {
+      threads.push_back(std::thread([&shared, &added, t] {
+        const size_t first = added.size() * t / num_threads;
+        const size_t last = added.size() * (t + 1) / num_threads;
+        if (t % 2 == 0) {
+          for (size_t i = first; i < last; i++) shared.AddConcurrent(added[i]);
+        } else {
+          shared.AddBatchConcurrent(&added[first], last - first);
+        }
+      }));
+    }
+    for (auto &thread : threads) thread.join();
+    size_t missed = 0, differ = 0;
+    for (uint64_t key : added) missed += !shared.Find(key);
+    for (uint64_t key : queries) differ += shared.Find(key) != serial.Find(key);
+    assert(missed == 0 && differ == 0);
+  }
+  std::cout << "Concurrent adds done: " << std::endl;
+}
+
+// The fraction of keys that filter finds.
+template <typename Filter>
+double FoundFraction(const Filter &filter, const std::vector<uint64_t> &keys) {
+  size_t found = 0;
+  for (uint64_t key : keys) found += filter.Find(key);
+  return static_cast<double>(found) / keys.size();
+}
+
+// Filters may have any number of buckets, not only a power of two: they get
+// exactly the whole buckets asked for and miss no key. The keys spread over
+// all buckets, so the false positive rate is the one expected of the size,
+// and a filter sized for a rate meets it.
+void TestAnySize() {
+  typedef SimdBlockFilter<FixedHash> Filter;
+  const std::vector<uint64_t> absent = Keys(1 << 30, 200000);
+  for (uint64_t num_buckets : {1, 3, 1000, 12345}) {
+    Filter filter = Filter::WithBytes(32 * num_buckets + 31);
+    assert(filter.SizeInBytes() == 32 * num_buckets);
+    // about 10.7 bits per key
+    const std::vector<uint64_t> added = Keys(0, 24 * num_buckets);
+    for (uint64_t key : added) filter.Add(key);
+    assert(FoundFraction(filter, added) == 1);
+    const double expected =
+        BlockFilterFalsePositiveRate(added.size(), num_buckets, 8);
+    const double measured = FoundFraction(filter, absent);
+    assert(num_buckets < 1000 || fabs(measured - expected) < 0.2 * expected);
+  }
+
+  const std::vector<uint64_t> added = Keys(0, 100000);
+  Filter sized = Filter::WithFalsePositiveRate(added.size(), 0.01);
+  for (uint64_t key : added) sized.Add(key);
+  assert(FoundFraction(sized, added) == 1);
+  assert(FoundFraction(sized, absent) < 0.012);
+
+  SimdBlockFilter512<FixedHash> wide =
+      SimdBlockFilter512<FixedHash>::WithBytes(64 * 3);
+  CountingSimdBlockFilter<FixedHash> counting =
+      CountingSimdBlockFilter<FixedHash>::WithBytes(64 * 3);
+  assert(wide.SizeInBytes() == 64 * 3 && counting.SizeInBytes() == 64 * 3);
+  const std::vector<uint64_t> few = Keys(0, 30);
+  for (uint64_t key : few) {
+    wide.Add(key);
+    counting.Add(key);
+  }
+  assert(FoundFraction(wide, few) == 1 && FoundFraction(counting, few) == 1);
+  std::cout << "Any size done: " << std::endl;
+}
+
+// Whether Load() of path as a Filter throws runtime_error.
+template <typename Filter>
+bool LoadThrows(const char *path) {
+  try {
+    Filter::Load(path);
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+// Saves a filter with random hash seeds and checks that loading or mapping
+// the file with any kernel gives back a filter answering exactly as the
+// original, that adding to a mapped filter leaves the file alone, and that a
+// file of another filter type or a truncated one is refused.
+template <typename Filter>
+void CheckPersistence(const char *name, uint64_t bytes) {
+  char path[] = "/tmp/simd-block-test.XXXXXX";
+  const int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  const std::vector<uint64_t> added = Keys(0, bytes / 2);
+  std::vector<uint64_t> queries = Keys(1 << 30, 100000);
+  queries.insert(queries.end(), added.begin(), added.end());
+  Filter original = Filter::WithBytes(bytes);
+  for (uint64_t key : added) original.Add(key);
+  const bool saved = original.Save(path);
+  assert(saved);
+
+  const std::vector<uint64_t> more = Keys(1 << 20, bytes / 2);
+  for (SimdBlockIsa isa : SupportedIsas()) {
+    for (bool map : {false, true}) {
+      Filter copy = map ? Filter::Map(path, isa) : Filter::Load(path, isa);
+      assert(copy.SizeInBytes() == original.SizeInBytes());
+      size_t differ = 0;
+      for (uint64_t key : queries) {
+        differ += copy.Find(key) != original.Find(key);
+      }
+      assert(differ == 0);
+      for (uint64_t key : more) copy.Add(key);
+    }
+  }
+  // the keys added to the copies never reached the file
+  const Filter reloaded = Filter::Load(path);
+  size_t differ = 0;
+  for (uint64_t key : more) differ += reloaded.Find(key) != original.Find(key);
+  assert(differ == 0);
+
+  const int truncated = truncate(path, original.SizeInBytes());
+  assert(truncated == 0);
+  const bool refused_truncated = LoadThrows<Filter>(path);
+  assert(refused_truncated);
+  unlink(path);
+  const bool refused_missing = LoadThrows<Filter>(path);
+  assert(refused_missing);
+  std::cout << name << " persistence done: " << std::endl;
+}
+
+// Filters saved to a file come back the same whether read or mapped, and
+// the 256-bit and 512-bit filters refuse each other's files.
+void TestPersistence() {
+  CheckPersistence<SimdBlockFilter<> >("SimdBlockFilter", 32 * 12345);
+  CheckPersistence<SimdBlockFilter512<> >("SimdBlockFilter512", 64 * 1001);
+
+  char path[] = "/tmp/simd-block-test.XXXXXX";
+  const int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  const bool saved = SimdBlockFilter<>::WithBytes(3200).Save(path);
+  assert(saved);
+  const bool refused = LoadThrows<SimdBlockFilter512<> >(path);
+  assert(refused);
+  unlink(path);
+}
+
+// The answers of filter for keys.
+template <typename Filter>
+std::vector<bool> Answers(const Filter &filter,
+                          const std::vector<uint64_t> &keys) {
+  std::vector<bool> answers;
+  for (uint64_t key : keys) answers.push_back(filter.Find(key));
+  return answers;
+}
+
+// The union of two filters answers exactly as a filter built from the keys of
+// both, and their intersection finds every key of both, and at least whatever
+// a filter built from those keys finds. Both work with any kernel and any
+// number of threads, refuse filters with other sizes or seeds, and the
+// cardinality estimates of the results are close to the true ones.
+void TestCombine() {
+  typedef SimdBlockFilter<FixedHash> Filter;
+  const uint64_t bytes = 32 * 12345;
+  // a shares its last 20000 keys with b
+  const std::vector<uint64_t> a_keys = Keys(0, 50000);
+  const std::vector<uint64_t> b_keys = Keys(30000, 50000);
+  const std::vector<uint64_t> both_keys = Keys(30000, 20000);
+  const std::vector<uint64_t> either_keys = Keys(0, 80000);
+  std::vector<uint64_t> queries = Keys(1 << 30, 100000);
+  queries.insert(queries.end(), either_keys.begin(), either_keys.end());
+
+  for (SimdBlockIsa isa : SupportedIsas()) {
+    const Filter seeds = Filter::WithBytes(bytes, isa);
+    Filter either = seeds.EmptyCopy(), both = seeds.EmptyCopy();
+    for (uint64_t key : either_keys) either.Add(key);
+    for (uint64_t key : both_keys) both.Add(key);
+    const std::vector<bool> either_answers = Answers(either, queries);
+    const std::vector<bool> both_answers = Answers(both, queries);
+
+    for (unsigned num_threads : {1, 3, 8}) {
+      Filter a = seeds.EmptyCopy(), b = seeds.EmptyCopy();
+      for (uint64_t key : a_keys) a.Add(key);
+      for (uint64_t key : b_keys) b.Add(key);
+      Filter intersection = a.EmptyCopy();
+      const bool combined = intersection.UnionWith(a, num_threads) &&
+                            intersection.IntersectWith(b, num_threads) &&
+                            a.UnionWith(b, num_threads);
+      assert(combined);
+      assert(Answers(a, queries) == either_answers);
+      const std::vector<bool> answers = Answers(intersection, queries);
+      size_t missed = 0;
+      for (size_t i = 0; i < queries.size(); i++) {
+        missed += both_answers[i] && !answers[i];
+      }
+      assert(missed == 0);
+    }
+
+    Filter a = seeds.EmptyCopy(), b = seeds.EmptyCopy();
+    for (uint64_t key : a_keys) a.Add(key);
+    for (uint64_t key : b_keys) b.Add(key);
+    const double estimate = a.EstimateCardinality() +
+                            b.EstimateCardinality() -
+                            either.EstimateCardinality();
+    assert(fabs(a.EstimateCardinality() - 50000) < 1000);
+    assert(fabs(either.EstimateCardinality() - 80000) < 1600);
+    assert(fabs(estimate - 20000) < 1000);
+
+    // another size is refused, changing nothing
+    const Filter smaller = Filter::WithBytes(bytes - 32, isa);
+    assert(a.CompatibleWith(b) && !a.CompatibleWith(smaller));
+    const std::vector<bool> before = Answers(a, queries);
+    const bool refused = !a.UnionWith(smaller) && !a.IntersectWith(smaller);
+    assert(refused);
+    assert(Answers(a, queries) == before);
+
+    // so are other seeds
+    SimdBlockFilter<> seeded = SimdBlockFilter<>::WithBytes(bytes, isa);
+    const SimdBlockFilter<> reseeded = SimdBlockFilter<>::WithBytes(bytes, isa);
+    assert(seeded.CompatibleWith(seeded.EmptyCopy()) &&
+           !seeded.CompatibleWith(reseeded));
+    const bool refused_seeds = !seeded.UnionWith(reseeded);
+    assert(refused_seeds);
+  }
+  std::cout << "Union and intersection done: " << std::endl;
+}
+
+// Removing keys from a counting filter undoes adding them: what is left
+// answers as a filter only given the keys that stay, with any kernel. A key
+// added twice stays until removed twice, removing a key Find() rejects is
+// refused instead of wrapping counters below zero, and saturated counters
+// never go down again.
+void TestCountingRemove() {
+  typedef CountingSimdBlockFilter<FixedHash> Filter;
+  const std::vector<uint64_t> kept = Keys(0, 4096);
+  const std::vector<uint64_t> removed = Keys(1 << 20, 4096);
+  std::vector<uint64_t> queries = Keys(1 << 30, 100000);
+  queries.insert(queries.end(), removed.begin(), removed.end());
+  for (SimdBlockIsa isa : SupportedIsas()) {
+    // few enough keys that no counter saturates
+    Filter expected = Filter::WithBytes(1 << 16, isa);
+    for (uint64_t key : kept) expected.Add(key);
+    Filter filter = Filter::WithBytes(1 << 16, isa);
+    for (size_t i = 0; i < kept.size(); i++) {
+      filter.Add(removed[i]);
+      filter.Add(kept[i]);
+    }
+    size_t refused = 0;
+    for (uint64_t key : removed) refused += !filter.Remove(key);
+    assert(refused == 0);
+    assert(FoundFraction(filter, kept) == 1);
+    assert(Answers(filter, queries) == Answers(expected, queries));
+
+    Filter empty = Filter::WithBytes(1 << 12, isa);
+    const uint64_t key = kept[0];
+    empty.Add(key);
+    empty.Add(key);
+    const bool removed_once = empty.Remove(key);
+    assert(removed_once && empty.Find(key));
+    const bool removed_twice = empty.Remove(key);
+    assert(removed_twice && !empty.Find(key));
+    // a third removal would take the counters below zero
+    const bool underflowed = empty.Remove(key);
+    assert(!underflowed);
+    assert(FoundFraction(empty, queries) == 0);
+
+    for (int i = 0; i < 20; i++) empty.Add(key);
+    for (int i = 0; i < 20; i++) refused += !empty.Remove(key);
+    assert(refused == 0 && empty.Find(key));
+  }
+  std::cout << "Counting remove done: " << std::endl;
+}
+
+int main() {
+  TestSimdBlock512();
+  TestDispatch();
+  TestBatches();
+  TestConcurrentAdds();
+  TestAnySize();
+  TestPersistence();
+  TestCombine();
+  TestCountingRemove();
+  std::cout << "Test Successful" << std::endl;
+  return 0;
+}
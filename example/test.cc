@@ -1,13 +1,458 @@
 #include "cuckoofilter.h"
+#include "filtercascade.h"
+#include "filterstack.h"
+#include "prefilteredfilter.h"
 
 #include <assert.h>
 #include <math.h>
 
+#include <algorithm>
 #include <iostream>
+#include <string>
 #include <vector>
 
 using cuckoofilter::CuckooFilter;
 
+// Ships the buckets changed since replica last synced and returns how many
+// were shipped, or 0 if the delta was refused.
+template <typename Filter>
+size_t Sync(Filter &primary, Filter &replica) {
+  const typename Filter::Delta delta = primary.export_delta(replica.epoch());
+  return replica.apply_delta(delta) ? delta.buckets.size() : 0;
+}
+
+// Counts the keys [0, n) that replica gets right: erased is absent, and the
+// others map to 3 * key.
+template <typename Filter>
+int CountSynced(Filter &replica, int n, int erased) {
+  int synced = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t val;
+    const bool found = replica.find(i, val);
+    synced += (i == erased) ? !found : found && val == 3 * (uint64_t)i;
+  }
+  return synced;
+}
+
+// Replicas syncing at their own pace get the buckets changed since their
+// last sync, erasures included; one left behind the history gets them all.
+void TestDeltaSync() {
+  typedef CuckooFilter<int, 12> Filter;
+  Filter primary(0);
+  Filter fast(0, primary.hasher());
+  Filter slow(0, primary.hasher());
+  int num_keys = 0;
+  const auto add = [&](int n) {
+    for (int i = num_keys; i < num_keys + n; i++) {
+      primary.insert(i, 3 * i);
+    }
+    num_keys += n;
+  };
+
+  add(50000);
+  size_t shipped = Sync(primary, fast);
+  assert(shipped > 0);
+  shipped = Sync(primary, slow);
+  assert(shipped > 0);
+  assert(CountSynced(slow, num_keys, -1) == num_keys);
+
+  add(100);
+  shipped = Sync(primary, fast);
+  assert(shipped > 0 && shipped < 1000);
+  assert(CountSynced(fast, num_keys, -1) == num_keys);
+
+  // slow is now two epochs behind
+  add(100);
+  const int erased = 7;
+  primary.erase(erased);
+  shipped = Sync(primary, fast);
+  assert(shipped > 0 && shipped < 1000);
+  shipped = Sync(primary, slow);
+  assert(shipped > 0 && shipped < 2000);
+  assert(CountSynced(slow, num_keys, erased) == num_keys);
+
+  for (size_t round = 0; round <= cuckoofilter::kDeltaHistory; round++) {
+    add(10);
+    shipped = Sync(primary, fast);
+    assert(shipped > 0 && shipped < 1000);
+  }
+  Filter fresh(0, primary.hasher());
+  const size_t all = Sync(primary, fresh);
+  shipped = Sync(primary, slow);
+  assert(shipped == all);
+  assert(CountSynced(slow, num_keys, erased) == num_keys);
+  assert(CountSynced(fast, num_keys, erased) == num_keys);
+
+  // a truncated or corrupt delta is refused and leaves the replica as it was
+  add(100);
+  const Filter::Delta delta = primary.export_delta(fast.epoch());
+  std::vector<Filter::Delta> corrupt(4, delta);
+  corrupt[0].buckets.back() = 1u << 30;
+  corrupt[1].tags.pop_back();
+  corrupt[2].slots.pop_back();
+  corrupt[3].tags[0] = 1u << 12;
+  const uint64_t epoch = fast.epoch();
+  for (const Filter::Delta &bad : corrupt) {
+    const bool applied = fast.apply_delta(bad);
+    assert(!applied && fast.epoch() == epoch);
+  }
+  assert(CountSynced(fast, num_keys - 100, erased) == num_keys - 100);
+  const bool applied = fast.apply_delta(delta);
+  assert(applied);
+  assert(CountSynced(fast, num_keys, erased) == num_keys);
+  std::cout << "Replica sync done: " << std::endl;
+}
+
+// Snapshots of an empty, a sparse and a full filter load back into the same
+// items with either codec, on one thread or several; a truncated one, or one
+// whose item count disagrees with its slots, is refused.
+void TestSnapshots() {
+  typedef CuckooFilter<int, 12> Filter;
+  const cuckoofilter::ShuffleRleCodec shuffle_rle;
+  const int sizes[] = {0, 1000, -1};  // -1 fills the filter up
+  for (const int size : sizes) {
+    Filter filter(0);
+    int n = 0;
+    while (n != size && filter.insert(n, 3 * n)) {
+      n++;
+    }
+    const std::string plain = filter.save_snapshot();
+    const std::string shuffled = filter.save_snapshot(&shuffle_rle);
+    assert(n == 0 || shuffled.size() < plain.size());
+    for (const std::string *snapshot : {&plain, &shuffled}) {
+      for (const unsigned threads : {1u, 4u}) {
+        Filter restored(0);
+        const bool loaded = restored.load_snapshot(*snapshot, threads);
+        assert(loaded);
+        assert(restored.Size() == filter.Size());
+        // key n was never stored
+        assert(CountSynced(restored, n + 1, n) == n + 1);
+      }
+      Filter truncated(0);
+      const bool loaded =
+          truncated.load_snapshot(snapshot->substr(0, snapshot->size() - 1));
+      assert(!loaded);
+      // the item count follows magic, version, bits, codec and bucket count
+      std::string miscounted = *snapshot;
+      miscounted[24] ^= 1;
+      Filter restored(0);
+      assert(!restored.load_snapshot(miscounted, 4));
+    }
+  }
+  std::cout << "Snapshots done: " << std::endl;
+}
+
+// Lookups through a stack find the newest run holding a key; compacting
+// runs keeps the newest values, and bad ranges or runs too full to merge
+// are refused with the stack untouched.
+void TestFilterStack() {
+  typedef cuckoofilter::FilterStack<int, 12> Stack;
+  Stack stack(0);
+  // run r, counting from the oldest, holds [500 * r, 500 * r + 1000) -> r
+  for (int r = 0; r < 3; r++) {
+    Stack::Filter &run = stack.PushRun();
+    for (int i = 500 * r; i < 500 * r + 1000; i++) {
+      const bool inserted = run.insert(i, r);
+      assert(inserted);
+    }
+  }
+  // the newest run holding i, counted from the newest, and its value there
+  for (int i = 0; i < 2000; i++) {
+    uint64_t val;
+    const int run = stack.Find(i, val);
+    const int oldest = std::min(i / 500, 2);
+    assert(run == 2 - oldest && val == (uint64_t)oldest);
+  }
+  uint64_t val;
+  const int absent = stack.Find(2000, val);
+  assert(absent == -1);
+  // batched lookups, absent keys included, agree with single ones
+  std::vector<int> keys;
+  for (int i = 0; i < 2100; i++) {
+    keys.push_back(i);
+  }
+  std::vector<int> runs(keys.size());
+  std::vector<uint64_t> vals(keys.size());
+  stack.FindBatch(keys.data(), keys.size(), runs.data(), vals.data());
+  for (size_t k = 0; k < keys.size(); k++) {
+    const int run = stack.Find(keys[k], val);
+    assert(runs[k] == run && (run == -1 || vals[k] == val));
+  }
+  // lookups leave the runs alone, false positives included
+  std::vector<int> absent_keys;
+  for (int i = 0; i < 100000; i++) {
+    absent_keys.push_back(100000 + i);
+  }
+  runs.resize(absent_keys.size());
+  vals.resize(absent_keys.size());
+  stack.FindBatch(absent_keys.data(), absent_keys.size(), runs.data(), vals.data());
+  assert(std::count(runs.begin(), runs.end(), -1) == (long)runs.size());
+  for (int r = 0; r < 3; r++) {
+    assert(stack.Run(r).adaptations() == 0 && stack.Run(r).remote_reads() == 0);
+  }
+
+  const cuckoofilter::Status backwards = stack.Compact(1, 0);
+  const cuckoofilter::Status beyond = stack.Compact(0, 3);
+  assert(backwards == cuckoofilter::NotFound);
+  assert(beyond == cuckoofilter::NotFound);
+  assert(stack.NumRuns() == 3);
+
+  const cuckoofilter::Status compacted = stack.Compact(0, 2);
+  assert(compacted == cuckoofilter::Ok);
+  assert(stack.NumRuns() == 1 && stack.Run(0).Size() == 2000);
+  for (int i = 0; i < 2000; i++) {
+    const int run = stack.Find(i, val);
+    assert(run == 0 && val == (uint64_t)std::min(i / 500, 2));
+  }
+
+  // two runs over half full each cannot be merged into one
+  for (int r = 0; r < 2; r++) {
+    Stack::Filter &run = stack.PushRun();
+    for (int i = 0; run.LoadFactor() < 0.6; i++) {
+      const bool inserted = run.insert(10000 + 1000000 * r + i, r);
+      assert(inserted);
+    }
+  }
+  const size_t sizes[] = {stack.Run(0).Size(), stack.Run(1).Size()};
+  const cuckoofilter::Status too_full = stack.Compact(0, 1);
+  assert(too_full == cuckoofilter::NotEnoughSpace);
+  const int newest = stack.Find(1000000 + 10000, val);
+  assert(stack.NumRuns() == 3 && newest == 0);
+  assert(stack.Run(0).Size() == sizes[0] && stack.Run(1).Size() == sizes[1]);
+  std::cout << "Filter stack done: " << std::endl;
+}
+
+// The prefilter is sized for every slot of the cuckoo table and keeps
+// answering for the items left after erasures; a few erasures from a small
+// filter do not rebuild it, but erasing a good share of a large one does, as
+// does evicting one in cache mode.
+void TestPrefilteredFilter() {
+  typedef cuckoofilter::PrefilteredCuckooFilter<int, 12> Filter;
+  Filter small(100);
+  const size_t prefilter_bytes =
+      small.SizeInBytes() - small.filter().SizeInBytes();
+  assert(prefilter_bytes * 8 >=
+         small.filter().Capacity() * Filter::kPrefilterBitsPerKey);
+  for (int i = 0; i < 100; i++) {
+    const bool inserted = small.insert(i, i);
+    assert(inserted);
+  }
+  for (int i = 0; i < 50; i++) {
+    const bool erased = small.erase(i);
+    assert(erased);
+  }
+  assert(small.rebuilds() == 0);
+
+  Filter large(0);
+  const int n = 100000;
+  for (int i = 0; i < n; i++) {
+    const bool inserted = large.insert(i, i);
+    assert(inserted);
+  }
+  for (int i = 0; i < n / 4; i++) {
+    const bool erased = large.erase(i);
+    assert(erased);
+  }
+  assert(large.rebuilds() > 0);
+  int right = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t val;
+    const bool found = large.find(i, val);
+    right += (i < n / 4) ? !found : found && val == (uint64_t)i;
+  }
+  assert(right == n);
+
+  // rebuilt after kMinRebuildErasures evictions
+  Filter cache(0, 0, 0.001);
+  cache.set_cache_mode(true);
+  for (int i = 0; cache.rebuilds() == 0; i++) {
+    assert(i < 2 * (int)cache.filter().Capacity());
+    const bool inserted = cache.insert(i, i);
+    assert(inserted);
+  }
+  assert(cache.filter().evictions() >= Filter::kMinRebuildErasures);
+  // collected first, as lookups may adapt tags under for_each()
+  std::vector<int> cached;
+  cache.for_each([&cached](const int &key, uint64_t) { cached.push_back(key); });
+  size_t kept = 0;
+  for (const int key : cached) {
+    uint64_t val;
+    kept += cache.find(key, val) && val == (uint64_t)key;
+  }
+  assert(kept == cache.Size());
+
+  // items merged in behind the wrapper's back still pass the prefilter
+  Filter merged(0);
+  Filter::Filter older(0, merged.filter().hasher());
+  for (int i = 0; i < 1000; i++) {
+    const bool inserted = older.insert(i, i);
+    assert(inserted);
+  }
+  const bool merged_ok = merged.merge(older);
+  assert(merged_ok && merged.Size() == 1000);
+  for (int i = 0; i < 1000; i++) {
+    uint64_t val;
+    const bool found = merged.find(i, val);
+    assert(found && val == (uint64_t)i);
+  }
+  std::cout << "Prefiltered filter done: " << std::endl;
+}
+
+// A cascade of block or cuckoo levels answers exactly over its universe, at
+// a few bits per key of the universe; overlapping sets are refused.
+template <typename LevelFilter>
+void TestFilterCascade(const char *name) {
+  std::vector<uint64_t> include, exclude;
+  for (uint64_t i = 0; i < 110000; i++) {
+    const uint64_t key = i * 0x9e3779b97f4a7c15ULL;
+    (i % 11 == 0 ? include : exclude).push_back(key);
+  }
+  cuckoofilter::FilterCascade<LevelFilter> cascade;
+  const bool built = cascade.Build(include.data(), include.size(),
+                                   exclude.data(), exclude.size());
+  assert(built);
+  size_t errors = 0;
+  for (const uint64_t key : include) errors += !cascade.contains(key);
+  for (const uint64_t key : exclude) errors += cascade.contains(key);
+  assert(errors == 0);
+  const size_t num_levels = cascade.NumLevels();
+  assert(num_levels > 1);
+  assert(cascade.SizeInBytes() * 8 < 2 * (include.size() + exclude.size()));
+
+  const bool overlapping = cascade.Build(include.data(), include.size(),
+                                         include.data(), 1);
+  assert(!overlapping);
+  std::cout << name << " filter cascade done: " << num_levels << " levels"
+            << std::endl;
+}
+
+// Counts the keys [first, last) that filter contains.
+template <typename Filter>
+int CountContained(Filter &filter, int first, int last) {
+  int contained = 0;
+  for (int i = first; i < last; i++) {
+    contained += filter.contains(i);
+  }
+  return contained;
+}
+
+// Items expire ttl generations after insertion, those stored while expiry
+// was off count from when it is turned back on, and so does an item left in
+// the victim slot, which then frees the filter for inserts again.
+void TestExpiry() {
+  typedef CuckooFilter<int, 12> Filter;
+  Filter filter(0);
+  filter.set_ttl(2);
+  int inserted = 0;
+  for (int i = 0; i < 1000; i++) {
+    inserted += filter.insert(i, i);
+  }
+  assert(inserted == 1000);
+  filter.advance_generation();
+  assert(CountContained(filter, 0, 1000) == 1000);
+  filter.advance_generation();
+  assert(CountContained(filter, 0, 1000) == 0);
+
+  filter.set_ttl(0);
+  inserted = 0;
+  for (int i = 1000; i < 2000; i++) {
+    inserted += filter.insert(i, i);
+  }
+  assert(inserted == 1000);
+  for (int g = 0; g < 5; g++) {
+    filter.advance_generation();
+  }
+  filter.set_ttl(2);
+  assert(CountContained(filter, 1000, 2000) == 1000);
+  filter.advance_generation();
+  filter.advance_generation();
+  assert(CountContained(filter, 1000, 2000) == 0);
+
+  int n = 0;
+  while (!filter.Full()) {
+    inserted = filter.insert(n, n);
+    assert(inserted);
+    n++;
+  }
+  filter.advance_generation();
+  assert(filter.Full());
+  filter.advance_generation();
+  assert(!filter.Full());
+  assert(CountContained(filter, 0, n) == 0);
+  inserted = filter.insert(n, n);
+  assert(inserted && filter.Size() == 1);
+
+  // a replica keeps the age items had at the source
+  Filter source(0), replica(0, source.hasher());
+  source.set_ttl(2);
+  replica.set_ttl(2);
+  for (int i = 0; i < 1000; i++) {
+    source.insert(i, i);
+  }
+  source.advance_generation();
+  const bool applied = replica.apply_delta(source.export_delta(0));
+  assert(applied);
+  assert(CountContained(replica, 0, 1000) == 1000);
+  replica.advance_generation();
+  assert(CountContained(replica, 0, 1000) == 0);
+  std::cout << "Expiry done: " << std::endl;
+}
+
+// In cache mode a stream of more keys than the filter holds evicts the cold
+// ones, while keys looked up between evictions of their buckets survive.
+// A hot key can only go if its bucket sees two evictions between lookups,
+// so they come every few inserts.
+void TestCacheMode() {
+  typedef CuckooFilter<int, 12> Filter;
+  Filter filter(0);
+  filter.set_cache_mode(true);
+  const int num_hot = 100;
+  for (int i = 0; i < num_hot; i++) {
+    const bool inserted = filter.insert(i, i);
+    assert(inserted);
+  }
+  const int num_cold = filter.Capacity() + 20000;
+  for (int i = 0; i < num_cold; i++) {
+    const bool inserted = filter.insert(num_hot + i, 0);
+    assert(inserted);
+    // the lookups set the reference bits of the hot keys
+    if (i % 10 == 0) {
+      CountContained(filter, 0, num_hot);
+    }
+  }
+  assert(!filter.Full() && filter.evictions() > 20000);
+  assert(CountContained(filter, 0, num_hot) == num_hot);
+  const int cold_left = CountContained(filter, num_hot, num_hot + num_cold);
+  assert(cold_left < num_cold - 20000);
+  // every insert stored one item or evicted one, and undone kicks put each
+  // item back where its own tags find it
+  assert(num_hot + cold_left == (int)filter.Size());
+  assert(filter.Size() + filter.evictions() == (size_t)(num_hot + num_cold));
+  // a full cache-mode filter cannot report running out of room
+  Filter older(0);
+  const bool merged = filter.merge(older);
+  assert(!merged);
+
+  // With every resident referenced, only keys inserted since are candidates,
+  // wherever the kicks left them, so the next eviction undoes kicks as far as
+  // needed to drop one of those and keeps every referenced key.
+  Filter path(0);
+  path.set_cache_mode(true);
+  int num_keys = 0;
+  while (path.evictions() == 0) {
+    path.insert(num_keys++, 0);
+  }
+  const int num_referenced = num_keys;
+  const int present = CountContained(path, 0, num_referenced);
+  while (path.evictions() == 1) {
+    path.insert(num_keys++, 0);
+  }
+  assert(CountContained(path, 0, num_referenced) == present);
+  assert(path.Size() + path.evictions() == (size_t)num_keys);
+  std::cout << "Cache mode done: " << filter.evictions() << " evictions"
+            << std::endl;
+}
+
 int main(int argc, char **argv) {
   int total_items = 1000000;
 
@@ -40,6 +485,28 @@ int main(int argc, char **argv) {
   }
   std::cout << "Find done: " << std::endl;
 
+  // Training on a log of absent keys adapts away their false positives
+  std::vector<int> negatives;
+  for (int i = total_items; i < 2 * total_items; i++) {
+    negatives.push_back(i);
+  }
+  size_t false_positives_before = 0;
+  for (int i : negatives) {
+    false_positives_before += filteredhash.findinfilter(i);
+  }
+  const size_t adaptations_before = filteredhash.adaptations();
+  const size_t adapted = filteredhash.train(negatives.data(), negatives.size(), 4);
+  assert(filteredhash.adaptations() - adaptations_before == adapted);
+  size_t false_positives = 0;
+  for (int i : negatives) {
+    false_positives += filteredhash.findinfilter(i);
+  }
+  // every round adapts each false positive it finds, so some must be gone
+  assert(false_positives_before > 0 && adapted > 0);
+  assert(false_positives < false_positives_before);
+  std::cout << "Training done, false positives left: " << false_positives
+            << " of " << false_positives_before << std::endl;
+
   // Check non-existing items, no false positives expected
     // std::cout << "Bla: " << std::endl;
   for (int i = total_items; i < 10 * total_items; i++) {
@@ -49,6 +516,31 @@ int main(int argc, char **argv) {
     // std::cout << "Blu: " << std::endl;
   std::cout << "Contains of non existent things done: " << std::endl;
 
+  // Without adaptation a false positive stays, costing a remote read each time
+  int false_positive = 10 * total_items;
+  while (!filteredhash.findinfilter(false_positive)) false_positive++;
+  filteredhash.set_adaptive(false);
+  const size_t reads_before = filteredhash.remote_reads();
+  const size_t adaptations_fixed = filteredhash.adaptations();
+  const bool contained_once = filteredhash.contains(false_positive);
+  const bool contained_twice = filteredhash.contains(false_positive);
+  assert(!contained_once && !contained_twice);
+  assert(filteredhash.adaptations() == adaptations_fixed);
+  assert(filteredhash.remote_reads() - reads_before >= 2);
+  const bool still_in_filter = filteredhash.findinfilter(false_positive);
+  assert(still_in_filter);
+  filteredhash.set_adaptive(true);
+  const bool contained_adaptive = filteredhash.contains(false_positive);
+  assert(!contained_adaptive);
+  assert(filteredhash.adaptations() > adaptations_fixed);
+
+
+  TestDeltaSync();
+  TestSnapshots();
+  TestFilterStack();
+  TestPrefilteredFilter();
+  TestFilterCascade<SimdBlockFilter<> >("Block");
+  TestFilterCascade<cuckoofilter::PackedCuckooFilter<8> >("Cuckoo");
 
   // Delete all the values, true expected
   // find should return false
@@ -60,6 +552,9 @@ int main(int argc, char **argv) {
     assert(!filteredhash.contains(i));
   }
 
+  TestExpiry();
+  TestCacheMode();
+
   std::cout << "Test Successful" << std::endl;
 
   return 0;
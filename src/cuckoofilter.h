@@ -2,7 +2,15 @@
 #define CUCKOO_FILTER_CUCKOO_FILTER_H_
 
 #include <assert.h>
+#include <string.h>
 #include <algorithm>
+#include <deque>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <libcuckoo/cuckoohash_map.hh>
 
 #include "debug.h"
@@ -10,6 +18,7 @@
 #include "packedtable.h"
 #include "printutil.h"
 #include "singletable.h"
+#include "snapshot.h"
 
 namespace cuckoofilter {
 // status returned by a cuckoo filter operation
@@ -23,6 +32,18 @@ enum Status {
 // maximum number of cuckoo kicks before claiming failure
 const size_t kMaxCuckooCount = 500;
 
+// number of keys hashed and prefetched together by batched probes
+const size_t kProbeBatch = 16;
+
+// number of past epochs whose changed buckets are kept for incremental deltas
+const size_t kDeltaHistory = 16;
+
+// generations are counted modulo kGenerationMask + 1
+const uint32_t kGenerationMask = 0xf;
+
+// longest time to live, in generations
+const uint32_t kMaxTtl = kGenerationMask;
+
 // A cuckoo filter class exposes a Bloomier filter interface,
 // providing methods of Add, Delete, Contain. It takes three
 // template parameters:
@@ -36,6 +57,8 @@ template <typename ItemType, size_t bits_per_item,
 class CuckooFilter {
   // Storage of items
   TableType<bits_per_item> *table_;
+  static const size_t kSlotsPerBucket =
+      TableType<bits_per_item>::kTagsPerBucket;
   cuckoohash_map<ItemType, uint64_t> hashmap;
 
   // Number of items stored
@@ -47,12 +70,144 @@ class CuckooFilter {
     bool used;
     ItemType key;
     uint64_t val;
+    // generation at insertion, as for the slots
+    uint32_t generation;
   } VictimCache;
 
   VictimCache victim_;
 
   HashFamily hasher_;
 
+  // One bit per bucket of table_, set whenever a tag or its remote slot in
+  // that bucket changes. Cleared by export_delta().
+  std::vector<uint64_t> dirty_;
+
+  // The dirty bits of each of the last kDeltaHistory epochs, the newest
+  // (that of epoch_) at the back.
+  std::deque<std::vector<uint64_t> > history_;
+
+  // Number of deltas exported so far; a replica is in sync at epoch e once it
+  // has applied every delta up to e.
+  uint64_t epoch_;
+
+  inline void MarkDirty(size_t i) { dirty_[i >> 6] |= 1ULL << (i & 63); }
+
+  // Generation of each slot at insertion, 4 bits per slot packed two per
+  // byte. Empty unless set_ttl() enabled expiry.
+  std::vector<uint8_t> generations_;
+  uint32_t ttl_;
+  uint32_t generation_;
+  // next bucket to be visited by sweep()
+  size_t sweep_cursor_;
+  // items dropped on expiry, the victim included
+  size_t num_expired_;
+
+  inline uint32_t ReadGeneration(size_t i, size_t j) const {
+    size_t s = 4 * i + j;
+    return (generations_[s >> 1] >> ((s & 1) << 2)) & kGenerationMask;
+  }
+
+  inline void WriteGeneration(size_t i, size_t j, uint32_t g) {
+    size_t s = 4 * i + j;
+    uint8_t shift = (s & 1) << 2;
+    generations_[s >> 1] =
+        (generations_[s >> 1] & ~(kGenerationMask << shift)) | (g << shift);
+  }
+
+  // whether the item at pos(i,j) is at least ttl_ generations old
+  inline bool Expired(size_t i, size_t j) const {
+    return ttl_ != 0 &&
+           ((generation_ - ReadGeneration(i, j)) & kGenerationMask) >= ttl_;
+  }
+
+  void ExpireSlot(size_t i, size_t j);
+  size_t ExpireBucket(size_t i);
+  // Makes every item, the victim included, start aging now.
+  void RestampGenerations();
+
+  inline bool VictimExpired() const {
+    return ttl_ != 0 &&
+           ((generation_ - victim_.generation) & kGenerationMask) >= ttl_;
+  }
+
+  inline void DropExpiredVictim() {
+    if (victim_.used && VictimExpired()) {
+      victim_.used = false;
+      num_expired_++;
+    }
+  }
+
+  // whether the victim slot holds key, whose buckets are i1 and i2; an
+  // expired victim is dropped instead
+  inline bool VictimHolds(const ItemType &key, size_t i1, size_t i2) {
+    if (!victim_.used || !(key == victim_.key) ||
+        (i1 != victim_.index && i2 != victim_.index)) {
+      return false;
+    }
+    DropExpiredVictim();
+    return victim_.used;
+  }
+
+  // CLOCK state, one byte per bucket: the reference bit of each slot, set by
+  // hits in find() and contains(), in bits 0-3, and in the bits above the
+  // bucket's hand, the next candidate for eviction: a slot, or
+  // kSlotsPerBucket for the item left without a place. Empty unless
+  // set_cache_mode() enabled eviction.
+  std::vector<uint8_t> referenced_;
+  bool cache_mode_;
+  size_t num_evictions_;
+  // slots the last insert's kick chain displaced items from, oldest first;
+  // recorded in cache mode only
+  std::vector<std::pair<size_t, size_t> > kick_path_;
+
+  // Stores key, left without a place by a chain ending at the full bucket
+  // i, by evicting one item along the path (see set_cache_mode()).
+  void EvictByClock(size_t i, ItemType key, uint64_t val, uint32_t gen,
+                    bool ref);
+
+  // number of false positives resolved by remove_false_positives()
+  size_t num_adaptations_;
+  // whether lookups and erase() resolve the false positives they meet
+  bool adaptive_;
+
+  // remote slots read to check keys behind matching tags, and written by
+  // adaptations
+  size_t num_remote_reads_;
+  size_t num_remote_writes_;
+
+  inline bool Referenced(size_t i, size_t j) const {
+    return (referenced_[i] >> j) & 1;
+  }
+
+  inline void SetReferenced(size_t i, size_t j, bool r) {
+    referenced_[i] = (referenced_[i] & ~(1 << j)) | (r << j);
+  }
+
+  static_assert(kSlotsPerBucket <= 4,
+                "the CLOCK state packs 4 reference bits and a hand up to 4");
+
+  inline size_t ClockHand(size_t i) const { return referenced_[i] >> 4; }
+
+  inline void SetClockHand(size_t i, size_t hand) {
+    referenced_[i] = (referenced_[i] & 0xf) | (hand << 4);
+  }
+
+  // An occupied slot read from a snapshot, kept until the remote store is
+  // filled on one thread:
+  struct SnapshotSlot {
+    size_t index;
+    size_t slot;
+    ItemType key;
+    uint64_t val;
+  };
+
+  void EncodeSnapshotBlock(size_t first, size_t last,
+                           const SnapshotCodec *codec, std::string *out);
+  // Writes the tags of a block and appends its occupied slots to slots.
+  bool DecodeSnapshotBlock(size_t first, size_t last,
+                           const SnapshotCodec *codec, const char *data,
+                           size_t size, std::vector<SnapshotSlot> *slots);
+
   // inline size_t IndexHash(uint32_t hv) const {
     // table_->num_buckets is always a power of two, so modulo can be replaced
     // with
@@ -88,13 +243,46 @@ class CuckooFilter {
     // }
   }
 
-  // load factor is the fraction of occupancy
-  double LoadFactor() const { return 1.0 * Size() / table_->SizeInTags(); }
-
   double BitsPerItem() const { return 8.0 * table_->SizeInBytes() / Size(); }
 
  public:
-  explicit CuckooFilter(const size_t max_num_keys) : hashmap(), num_items_(0), victim_(), hasher_()
+  // The changed buckets of a filter between two epochs, as produced by
+  // export_delta(). tags holds kTagsPerDelta entries per bucket in buckets;
+  // slots holds one remote key/value pair per non-zero tag, in order. When
+  // the source expires items, ages holds the generations each of those slots
+  // has lived, and victim_age that of the victim, so that the replica keeps
+  // their TTLs; otherwise ages is empty.
+  struct Delta {
+    uint64_t from_epoch;
+    uint64_t to_epoch;
+    bool full;
+    size_t num_items;
+    VictimCache victim;
+    uint8_t victim_age;
+    std::vector<uint32_t> buckets;
+    std::vector<uint32_t> tags;
+    std::vector<std::pair<ItemType, uint64_t> > slots;
+    std::vector<uint8_t> ages;
+
+    size_t SizeInBytes() const {
+      return sizeof(*this) + buckets.size() * sizeof(uint32_t) +
+             tags.size() * sizeof(uint32_t) +
+             slots.size() * sizeof(std::pair<ItemType, uint64_t>) +
+             ages.size();
+    }
+  };
+
+  static const size_t kTagsPerDelta = 4;
+  static_assert(kTagsPerDelta == kSlotsPerBucket,
+                "deltas ship every slot of a bucket");
+
+  explicit CuckooFilter(const size_t max_num_keys,
+                        const HashFamily &hasher = HashFamily())
+      : hashmap(), num_items_(0), victim_(), hasher_(hasher), epoch_(0),
+        ttl_(0), generation_(0), sweep_cursor_(0), num_expired_(0),
+        cache_mode_(false),
+        num_evictions_(0), num_adaptations_(0),
+        adaptive_(true), num_remote_reads_(0), num_remote_writes_(0)
   {
     size_t assoc = 4;
     size_t max_num_keys_1 = (1U << 16) * 2;
@@ -105,6 +293,7 @@ class CuckooFilter {
     }
     victim_.used = false;
     table_ = new TableType<bits_per_item>(num_buckets);
+    dirty_.assign((num_buckets + 63) / 64, 0);
     // std::cout << "Bits per Item " << bits_per_item << std::endl;
     // hashmap = new cuckoohash_map<ItemType, uint64_t>(max_num_keys);
   }
@@ -121,17 +310,153 @@ class CuckooFilter {
   // number of current inserted items;
   size_t Size() const { return num_items_; }
 
+  // whether an insert had to leave an item in the victim slot, after which
+  // inserts fail until an erase makes room
+  bool Full() const { return victim_.used; }
+
   // size of the filter in bytes.
   size_t SizeInBytes() const { return table_->SizeInBytes(); }
 
+  // number of slots, the most items the filter can hold. It is fixed by the
+  // constructor, whatever max_num_keys asked for.
+  size_t Capacity() const { return table_->SizeInTags(); }
+
+  // load factor is the fraction of occupancy
+  double LoadFactor() const { return 1.0 * Size() / table_->SizeInTags(); }
+
+  // the hash family in use; replicas must be constructed with a copy of it so
+  // that shipped tags match their own lookups.
+  const HashFamily &hasher() const { return hasher_; }
+
+  // epoch of the last exported or applied delta
+  uint64_t epoch() const { return epoch_; }
+
+  // The bucket indices and per-slot tags of a key. They only depend on the
+  // hasher and the number of buckets, so filters sharing both can reuse one
+  // HashedKey, e.g. to probe a stack of runs with a single hash computation.
+  struct HashedKey {
+    uint32_t i1;
+    uint32_t i2;
+    uint32_t tag[4];
+    uint64_t tag_hash;
+  };
+
+  void hash_key(const ItemType &key, HashedKey *h) const {
+    GenerateIndexTagHash(key, &h->i1, &h->i2, h->tag, h->tag_hash);
+  }
+
+  // starts loading both candidate buckets of a hashed key into cache
+  void prefetch(const HashedKey &h) const {
+    table_->Prefetch(h.i1);
+    table_->Prefetch(h.i2);
+  }
+
+  // Calls f(key, val) for every stored item.
+  template <typename F>
+  void for_each(F f);
+
   bool find(const ItemType &key, uint64_t& val);
+  bool find(const ItemType &key, const HashedKey &h, uint64_t& val);
+  // Like find(), but changes nothing: it neither adapts on false positives
+  // nor drops expired items, sets reference bits or counts remote reads. So
+  // any number of threads may call it at once while none writes the filter.
+  bool find_readonly(const ItemType &key, const HashedKey &h, uint64_t& val);
   bool findinfilter(const ItemType &key);
+  bool findinfilter(const ItemType &key, const HashedKey &h);
   bool contains(const ItemType &key);
+  bool contains(const ItemType &key, const HashedKey &h);
   bool insert(const ItemType &key, const uint64_t &val);
-  bool insert_impl(const ItemType &key, const uint64_t &val, size_t i, uint32_t tag[4], uint64_t taghash);
+  // gen is the generation the item was inserted in
+  bool insert_impl(const ItemType &key, const uint64_t &val, size_t i,
+                   uint32_t tag[4], uint64_t taghash, uint32_t gen);
   bool erase(const ItemType &key);
   void remove_false_positives(size_t index, size_t slot);
 
+  // Adapts the filter to a log of keys known to be absent, as if each had
+  // been queried with contains(). All keys are probed first, in prefetched
+  // groups, and the false-positive slots found are then resolved bucket by
+  // bucket. Adaptation can move another tag into a matching position, so up
+  // to max_rounds passes are made while they still find false positives.
+  // Returns the number of adaptations.
+  size_t train(const ItemType *negative_keys, size_t n, size_t max_rounds = 1);
+
+  // Makes items expire ttl generations after they were inserted; 0 turns
+  // expiry off. Expired items are dropped lazily when a probe or an insert
+  // meets them, and by sweep(). Items stored while expiry was off start
+  // aging when it is turned on. Generations and ttl are per filter: deltas,
+  // snapshots and merges carry items, not their ages, so their items start
+  // aging on arrival.
+  void set_ttl(uint32_t ttl);
+  uint32_t ttl() const { return ttl_; }
+  // Starts a new generation. Generation numbers wrap around, so this also
+  // sweeps enough buckets for every bucket to be visited before an item
+  // could look young again.
+  void advance_generation();
+  // Drops the expired items of the next num_buckets buckets, continuing
+  // where the last sweep stopped. Returns the number of items dropped.
+  size_t sweep(size_t num_buckets);
+  // Number of items dropped on expiry so far, however they were found.
+  size_t expirations() const { return num_expired_; }
+
+  // In cache mode an insert that runs out of cuckoo kicks evicts an item
+  // instead of parking it in the victim slot. Every item along the kick
+  // path competes under CLOCK: the residents of the last bucket from its
+  // hand on, the item left without a place, then the items the chain moved,
+  // newest first. The first one not referenced since it was last passed is
+  // dropped, undoing the kicks that followed it.
+  void set_cache_mode(bool enabled);
+  size_t evictions() const { return num_evictions_; }
+
+  // Number of adaptations so far, by lookups and train() alike. A lookup
+  // that raised it paid for moving tags, which callers timing lookups may
+  // want to tell apart.
+  size_t adaptations() const { return num_adaptations_; }
+
+  // With adaptation off, lookups and erase() still check the remote key
+  // behind every matching tag but leave false positives in place, as a
+  // plain cuckoo filter would. train() adapts either way.
+  void set_adaptive(bool enabled) { adaptive_ = enabled; }
+  bool adaptive() const { return adaptive_; }
+
+  // Remote slots read by lookups, erase() and train() to check the key
+  // behind a matching tag, and by adaptations, which also write two. Inserts
+  // and bulk operations are not counted.
+  size_t remote_reads() const { return num_remote_reads_; }
+  size_t remote_writes() const { return num_remote_writes_; }
+
+  // Collects every bucket changed since since_epoch and starts a new epoch.
+  // The changed buckets of the last kDeltaHistory epochs are kept, so any
+  // number of replicas can sync at their own pace; one further behind, or
+  // ahead, gets a full copy instead.
+  Delta export_delta(uint64_t since_epoch);
+  // Applies a delta exported by a filter built with the same hasher and
+  // capacity. Returns false, changing nothing, if the delta does not start
+  // at epoch() or is malformed: a bucket out of range, or tags and slots
+  // that do not add up. The epoch jumps to that of the delta, so the history
+  // of this filter is dropped: its own replicas get one full copy after
+  // that. With set_ttl(), applied items keep the age they had at the source,
+  // or start aging now if the source does not expire items.
+  bool apply_delta(const Delta &delta);
+
+  // Moves every item of older that this filter does not hold already into
+  // this filter; both must share the hasher and capacity. Items present in
+  // both keep the value stored here. Returns false if this filter filled up,
+  // and at once, changing nothing, in cache mode, where a full filter would
+  // evict items instead of reporting it.
+  bool merge(CuckooFilter &older);
+
+  // Serializes the filter, its hasher and its remote slots, writing only the
+  // occupied slots. codec compresses the remote columns of each block; NULL
+  // stores them as they are.
+  std::string save_snapshot(const SnapshotCodec *codec = NULL);
+  // Restores a snapshot into this freshly constructed filter of the same
+  // capacity, decoding blocks on num_threads threads. The codec is looked up
+  // among the built-in ones unless given. Returns false on any mismatch or
+  // corruption, including an item count that disagrees with the occupied
+  // slots, after which the filter must be discarded.
+  bool load_snapshot(const std::string &data, unsigned num_threads = 1,
+                     const SnapshotCodec *codec = NULL);
+
 };
 
 template <typename ItemType, size_t bits_per_item,
@@ -157,16 +482,22 @@ template <typename ItemType, size_t bits_per_item,
 bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::find(
                                 const ItemType &key, uint64_t& val)
 {
+  HashedKey h;
+  hash_key(key, &h);
+  return find(key, h, val);
+}
 
-  bool found = false;
-  uint32_t i1, i2;
-  uint32_t tag[4];
-  uint64_t tag_hash;
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::find(
+                const ItemType &key, const HashedKey &h, uint64_t& val)
+{
 
-  GenerateIndexTagHash(key, &i1, &i2, tag, tag_hash);
+  bool found = false;
+  const uint32_t i1 = h.i1, i2 = h.i2;
+  const uint32_t *tag = h.tag;
 
-  found = victim_.used && (key == victim_.key) &&
-          (i1 == victim_.index || i2 == victim_.index);
+  found = VictimHolds(key, i1, i2);
 
   if (found) {
     val = victim_.val;
@@ -181,12 +512,20 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::find(
   for (int slot = 0; slot < 4; slot++) {
     // std::cout << "Checking find for key: " << key << " in bucket " << i1 << "," << slot << " and got " << table_->ReadTag(i1, slot) << ", expected " << tag[slot] << std::endl;
     if(tag[slot] == table_->ReadTag(i1, slot)) {
+      if (Expired(i1, slot)) {
+        ExpireSlot(i1, slot);
+        continue;
+      }
       std::pair<ItemType, uint64_t> key_value;
       hashmap.read_from_bucket_at_slot(i1, slot, key_value);
+      num_remote_reads_++;
       // std::cout << "Finger print matched and hashmap gave " << key_value.first << " " << key_value.second << std::endl;
       if(key == key_value.first) {
         val = key_value.second;
         found = true;
+        if (cache_mode_) {
+          SetReferenced(i1, slot, true);
+        }
         // goto find_false_positive_removal;
       }
       else {
@@ -202,12 +541,20 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::find(
     // std::cout << "Checking find for key: " << key << " in bucket " << i2 << "," << slot << " and got " << table_->ReadTag(i2, slot) << ", expected " << tag[slot] << std::endl;
 
     if(tag[slot] == table_->ReadTag(i2, slot)) {
+      if (Expired(i2, slot)) {
+        ExpireSlot(i2, slot);
+        continue;
+      }
       std::pair<ItemType, uint64_t> key_value;
       hashmap.read_from_bucket_at_slot(i2, slot, key_value);
+      num_remote_reads_++;
       // std::cout << "Finger print matched and hashmap gave " << key_value.first << " " << key_value.second << std::endl;
       if(key == key_value.first) {
         val = key_value.second;
         found = true;
+        if (cache_mode_) {
+          SetReferenced(i2, slot, true);
+        }
         // goto find_false_positive_removal;
       }
       else {
@@ -217,7 +564,7 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::find(
     }
   }
 
-  for(unsigned int i = 0; i < false_positives.size(); i++) {
+  for(unsigned int i = 0; adaptive_ && i < false_positives.size(); i++) {
     // std::cout << "Called remove_false_positives " << std::endl;
     remove_false_positives(false_positives[i].first, false_positives[i].second);
   }
@@ -234,21 +581,54 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::find(
 
 }
 
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::find_readonly(
+                const ItemType &key, const HashedKey &h, uint64_t& val)
+{
+  if (victim_.used && key == victim_.key && !VictimExpired() &&
+      (h.i1 == victim_.index || h.i2 == victim_.index)) {
+    val = victim_.val;
+    return true;
+  }
+  const uint32_t buckets[2] = {h.i1, h.i2};
+  for (const uint32_t i : buckets) {
+    for (size_t slot = 0; slot < kSlotsPerBucket; slot++) {
+      if (h.tag[slot] != table_->ReadTag(i, slot) || Expired(i, slot)) {
+        continue;
+      }
+      std::pair<ItemType, uint64_t> key_value;
+      hashmap.read_from_bucket_at_slot(i, slot, key_value);
+      if (key == key_value.first) {
+        val = key_value.second;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
 template <typename ItemType, size_t bits_per_item,
           template <size_t> class TableType, typename HashFamily>
 bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::findinfilter(
                                 const ItemType &key)
 {
+  HashedKey h;
+  hash_key(key, &h);
+  return findinfilter(key, h);
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::findinfilter(
+                                const ItemType &key, const HashedKey &h)
+{
 
   bool found = false;
-  uint32_t i1, i2;
-  uint32_t tag[4];
-  uint64_t tag_hash;
+  const uint32_t i1 = h.i1, i2 = h.i2;
+  const uint32_t *tag = h.tag;
 
-  GenerateIndexTagHash(key, &i1, &i2, tag, tag_hash);
-
-  found = victim_.used && (key == victim_.key) &&
-          (i1 == victim_.index || i2 == victim_.index);
+  found = VictimHolds(key, i1, i2);
 
   if (found) {
     return true;
@@ -256,14 +636,14 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::findinfilter(
 
   // check in i1
   for (int slot = 0; slot < 4; slot++) {
-    if(tag[slot] == table_->ReadTag(i1, slot)) {
+    if(tag[slot] == table_->ReadTag(i1, slot) && !Expired(i1, slot)) {
       return true;
     }
   }
   
   // check in i2
   for (int slot = 0; slot < 4; slot++) {
-    if(tag[slot] == table_->ReadTag(i2, slot)) {
+    if(tag[slot] == table_->ReadTag(i2, slot) && !Expired(i2, slot)) {
       return true;
     }
   }
@@ -277,15 +657,21 @@ template <typename ItemType, size_t bits_per_item,
 bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::contains(
                                                   const ItemType &key)
 {
-  bool found = false;
-  uint32_t i1, i2;
-  uint32_t tag[4];
-  uint64_t tag_hash;
+  HashedKey h;
+  hash_key(key, &h);
+  return contains(key, h);
+}
 
-  GenerateIndexTagHash(key, &i1, &i2, tag, tag_hash);
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::contains(
+                            const ItemType &key, const HashedKey &h)
+{
+  bool found = false;
+  const uint32_t i1 = h.i1, i2 = h.i2;
+  const uint32_t *tag = h.tag;
 
-  found = victim_.used && (key == victim_.key) &&
-          (i1 == victim_.index || i2 == victim_.index);
+  found = VictimHolds(key, i1, i2);
 
   if (found) {
     return true;
@@ -299,12 +685,20 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::contains(
   for (int slot = 0; slot < 4; slot++) {
     // std::cout << "Checking contains for key: " << key << " in bucket " << i1 << "," << slot << " and got " << table_->ReadTag(i1, slot) << ", expected " << tag[slot] << std::endl;
     if(tag[slot] == table_->ReadTag(i1, slot)) {
+      if (Expired(i1, slot)) {
+        ExpireSlot(i1, slot);
+        continue;
+      }
       std::pair<ItemType, uint64_t> key_value;
       hashmap.read_from_bucket_at_slot(i1, slot, key_value);
+      num_remote_reads_++;
       // std::cout << "Finger print matched and hashmap gave " << key_value.first << " " << key_value.second << std::endl;
       // std::cout << "Key from hashmap: " << key_value.first << " " << key_value.second << std::endl;
       if(key == key_value.first) {
         found = true;
+        if (cache_mode_) {
+          SetReferenced(i1, slot, true);
+        }
         // goto contains_false_positive_removal;
       }
       else {
@@ -318,12 +712,20 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::contains(
   for (int slot = 0; slot < 4; slot++) {
     // std::cout << "Checking contains for key: " << key << " in bucket " << i2 << "," << slot << " and got " << table_->ReadTag(i2, slot) << ", expected " << tag[slot] << std::endl;
     if(tag[slot] == table_->ReadTag(i2, slot)) {
+      if (Expired(i2, slot)) {
+        ExpireSlot(i2, slot);
+        continue;
+      }
       // std::cout << "Finger print matched: " << i2 << " " << slot << std::endl;
       std::pair<ItemType, uint64_t> key_value;
       hashmap.read_from_bucket_at_slot(i2, slot, key_value);
+      num_remote_reads_++;
       // std::cout << "Finger print matched and hashmap gave " << key_value.first << " " << key_value.second << std::endl;
       if(key == key_value.first) {
         found = true;
+        if (cache_mode_) {
+          SetReferenced(i2, slot, true);
+        }
         // goto contains_false_positive_removal;
       }
       else {
@@ -335,7 +737,7 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::contains(
   // return false;
 
   // call false positive removal for each pair in false_positives
-  for(unsigned int i = 0; i < false_positives.size(); i++) {
+  for(unsigned int i = 0; adaptive_ && i < false_positives.size(); i++) {
     // std::cout << "Calling rem_false_pos" << std::endl;
     remove_false_positives(false_positives[i].first, false_positives[i].second);
   }
@@ -353,30 +755,39 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::insert(
   uint32_t tag[4];
   uint64_t tag_hash;
 
+  DropExpiredVictim();
   if (victim_.used) {
     return false;
   }
 
   GenerateIndexTagHash(key, &i1, &i2, tag, tag_hash);
   // std::cout << "Here" << std::endl;
-  return insert_impl(key, val, i1, tag, tag_hash);
+  return insert_impl(key, val, i1, tag, tag_hash, generation_);
 }
 
 template <typename ItemType, size_t bits_per_item,
           template <size_t> class TableType, typename HashFamily>
 bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::insert_impl(
-  const ItemType &key, const uint64_t &val, size_t i, uint32_t curtag[4], uint64_t curtaghash)
+  const ItemType &key, const uint64_t &val, size_t i, uint32_t curtag[4], uint64_t curtaghash,
+  uint32_t gen)
 {
   uint32_t i1, i2;
   size_t curindex = i;
   ItemType curkey = key;
   uint64_t curval = val;
+  uint32_t curgen = gen;
+  bool curref = false;
   size_t slot;
+  kick_path_.clear();
   // std::cout << "Here1" << std::endl;
 
   for (uint32_t count = 0; count < kMaxCuckooCount; count++) {
     bool kickout = count > 0;
     slot = -1;
+    MarkDirty(curindex);
+    if (ttl_ != 0) {
+      ExpireBucket(curindex);
+    }
   // std::cout << "Here2" << std::endl;
 
     if (table_->InsertTagToBucket(curindex, curtag, kickout, slot)) {
@@ -384,6 +795,12 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::insert_impl(
       std::pair<ItemType, uint64_t> key_value;
       // std::cout<< "ReadTag after write " << curindex << " " << slot << " " << table_->ReadTag(curindex, slot) << "\n";
       hashmap.add_to_bucket_at_slot(curindex, slot, curkey, curval);
+      if (ttl_ != 0) {
+        WriteGeneration(curindex, slot, curgen);
+      }
+      if (cache_mode_) {
+        SetReferenced(curindex, slot, curref);
+      }
 
       hashmap.read_from_bucket_at_slot(curindex, slot, key_value);
 
@@ -401,6 +818,17 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::insert_impl(
       hashmap.add_to_bucket_at_slot(curindex, slot, curkey, curval);
       curkey = old_key_value.first;
       curval = old_key_value.second;
+      if (ttl_ != 0) {
+        uint32_t oldgen = ReadGeneration(curindex, slot);
+        WriteGeneration(curindex, slot, curgen);
+        curgen = oldgen;
+      }
+      if (cache_mode_) {
+        bool oldref = Referenced(curindex, slot);
+        SetReferenced(curindex, slot, curref);
+        curref = oldref;
+        kick_path_.push_back(std::make_pair(curindex, slot));
+      }
       // std::cout << "Kicked out" << curkey << " " << curval << std::endl;
     }
 
@@ -408,14 +836,129 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::insert_impl(
     curindex = (curindex == i1) ? i2 : i1;
   }
 
+  if (cache_mode_) {
+    MarkDirty(curindex);
+    if (ttl_ != 0) {
+      ExpireBucket(curindex);
+    }
+    if (table_->InsertTagToBucket(curindex, curtag, false, slot)) {
+      num_items_++;
+    } else {
+      EvictByClock(curindex, curkey, curval, curgen, curref);
+      return true;
+    }
+    hashmap.add_to_bucket_at_slot(curindex, slot, curkey, curval);
+    SetReferenced(curindex, slot, curref);
+    if (ttl_ != 0) {
+      WriteGeneration(curindex, slot, curgen);
+    }
+    return true;
+  }
+
   victim_.index = curindex;
   victim_.tag_hash = curtaghash;
   victim_.key = curkey;
   victim_.val = curval;
+  victim_.generation = curgen;
   victim_.used = true;
   return true;
 }
 
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::EvictByClock(
+    size_t i, ItemType key, uint64_t val, uint32_t gen, bool ref)
+{
+  // Candidates on the path, newest first. A slot the chain passed through
+  // twice holds what it left there last, so only its newest entry counts;
+  // slots of bucket i are candidates already.
+  std::vector<size_t> order;
+  std::set<std::pair<size_t, size_t> > seen;
+  for (size_t k = kick_path_.size(); k-- > 0;) {
+    if (kick_path_[k].first != i && seen.insert(kick_path_[k]).second) {
+      order.push_back(k);
+    }
+  }
+
+  // The second pass finds every bit cleared, so it always picks one.
+  size_t evict = 0;
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (size_t n = 0; n <= kSlotsPerBucket; n++) {
+      size_t hand = ClockHand(i);
+      SetClockHand(i, (hand + 1) % (kSlotsPerBucket + 1));
+      if (hand == kSlotsPerBucket) {
+        if (!ref) {
+          // the homeless item itself goes
+          num_evictions_++;
+          return;
+        }
+        ref = false;
+      } else if (Referenced(i, hand)) {
+        SetReferenced(i, hand, false);
+      } else {
+        uint32_t tag[4];
+        uint32_t i1, i2;
+        uint64_t tag_hash;
+        GenerateIndexTagHash(key, &i1, &i2, tag, tag_hash);
+        table_->WriteTag(i, hand, 0);
+        table_->WriteTag(i, hand, tag[hand]);
+        hashmap.add_to_bucket_at_slot(i, hand, key, val);
+        SetReferenced(i, hand, ref);
+        if (ttl_ != 0) {
+          WriteGeneration(i, hand, gen);
+        }
+        num_evictions_++;
+        return;
+      }
+    }
+    for (size_t k : order) {
+      size_t b = kick_path_[k].first, slot = kick_path_[k].second;
+      if (!Referenced(b, slot)) {
+        evict = k;
+        pass = 2;
+        break;
+      }
+      SetReferenced(b, slot, false);
+    }
+  }
+
+  // Undo the kicks back to the chosen slot: each item returns to the slot
+  // it was kicked out of, and the one the chain had moved into the chosen
+  // slot is left without a place and dropped.
+  for (size_t k = kick_path_.size(); k-- > evict;) {
+    size_t b = kick_path_[k].first, slot = kick_path_[k].second;
+    bool occupied = table_->ReadTag(b, slot) != 0;
+    uint32_t tag[4];
+    uint32_t i1, i2;
+    uint64_t tag_hash;
+    GenerateIndexTagHash(key, &i1, &i2, tag, tag_hash);
+    std::pair<ItemType, uint64_t> key_value;
+    if (occupied) {
+      hashmap.read_from_bucket_at_slot(b, slot, key_value);
+    }
+    table_->WriteTag(b, slot, 0);
+    table_->WriteTag(b, slot, tag[slot]);
+    hashmap.add_to_bucket_at_slot(b, slot, key, val);
+    bool oldref = Referenced(b, slot);
+    SetReferenced(b, slot, ref);
+    ref = oldref;
+    if (ttl_ != 0) {
+      uint32_t oldgen = ReadGeneration(b, slot);
+      WriteGeneration(b, slot, gen);
+      gen = oldgen;
+    }
+    MarkDirty(b);
+    if (!occupied) {
+      // its item expired during the chain, leaving room
+      num_items_++;
+      return;
+    }
+    key = key_value.first;
+    val = key_value.second;
+  }
+  num_evictions_++;
+}
+
 template <typename ItemType, size_t bits_per_item,
           template <size_t> class TableType, typename HashFamily>
 bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::erase(
@@ -429,8 +972,7 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::erase(
 
   GenerateIndexTagHash(key, &i1, &i2, tag, tag_hash);
 
-  found = victim_.used && (key == victim_.key) &&
-          (i1 == victim_.index || i2 == victim_.index);
+  found = VictimHolds(key, i1, i2);
 
   if (found) {
     victim_.used = false;
@@ -444,11 +986,17 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::erase(
 
   for (int slot = 0; slot < 4; slot++) {
     if(tag[slot] == table_->ReadTag(i1, slot)) {
+      if (Expired(i1, slot)) {
+        ExpireSlot(i1, slot);
+        continue;
+      }
       std::pair<ItemType, uint64_t> key_value;
       hashmap.read_from_bucket_at_slot(i1, slot, key_value);
+      num_remote_reads_++;
       if(key == key_value.first) {
         table_->WriteTag(i1, slot, 0);
         hashmap.del_from_bucket_at_slot(i1, slot);
+        MarkDirty(i1);
         found = true;
         // goto delete_false_positive_removal;
       }
@@ -462,11 +1010,17 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::erase(
 
   for (int slot = 0; slot < 4; slot++) {
     if(tag[slot] == table_->ReadTag(i2, slot)) {
+      if (Expired(i2, slot)) {
+        ExpireSlot(i2, slot);
+        continue;
+      }
       std::pair<ItemType, uint64_t> key_value;
       hashmap.read_from_bucket_at_slot(i2, slot, key_value);
+      num_remote_reads_++;
       if(key == key_value.first) {
         table_->WriteTag(i2, slot, 0);
         hashmap.del_from_bucket_at_slot(i2, slot);
+        MarkDirty(i2);
         found = true;
         // goto delete_false_positive_removal;
       }
@@ -480,7 +1034,7 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::erase(
 
   // delete_false_positive_removal:
   // call false positive removal for each pair in false_positives
-  for(unsigned int i = 0; i < false_positives.size(); i++) {
+  for(unsigned int i = 0; adaptive_ && i < false_positives.size(); i++) {
     remove_false_positives(false_positives[i].first, false_positives[i].second);
   }
 
@@ -493,7 +1047,8 @@ bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::erase(
     victim_.used = false;
     uint32_t tag[4];
     TagHash(victim_.tag_hash, tag);
-    insert_impl(victim_.key, victim_.val, victim_.index, tag, victim_.tag_hash);
+    insert_impl(victim_.key, victim_.val, victim_.index, tag, victim_.tag_hash,
+                victim_.generation);
   }
 
   return true;
@@ -542,7 +1097,596 @@ void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::remove_false_
   else
     hashmap.del_from_bucket_at_slot(index, slot);
   hashmap.add_to_bucket_at_slot(index, new_slot, key_value_slot.first, key_value_slot.second);
+  if (cache_mode_) {
+    bool ref_slot = Referenced(index, slot);
+    SetReferenced(index, slot, Referenced(index, new_slot));
+    SetReferenced(index, new_slot, ref_slot);
+  }
+  if (ttl_ != 0) {
+    uint32_t gen_slot = ReadGeneration(index, slot);
+    WriteGeneration(index, slot, ReadGeneration(index, new_slot));
+    WriteGeneration(index, new_slot, gen_slot);
+  }
+  MarkDirty(index);
+  num_adaptations_++;
+  num_remote_reads_ += empty_new_slot ? 1 : 2;
+  num_remote_writes_ += 2;
+
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+template <typename F>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::for_each(F f)
+{
+  for (size_t i = 0; i < table_->NumBuckets(); i++) {
+    for (size_t slot = 0; slot < 4; slot++) {
+      if (table_->ReadTag(i, slot) == 0) continue;
+      std::pair<ItemType, uint64_t> key_value;
+      hashmap.read_from_bucket_at_slot(i, slot, key_value);
+      f(key_value.first, key_value.second);
+    }
+  }
+  if (victim_.used && !VictimExpired()) {
+    f(victim_.key, victim_.val);
+  }
+}
 
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+size_t CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::train(
+    const ItemType *negative_keys, size_t n, size_t max_rounds)
+{
+  // a slot whose tag matched a negative key during probing
+  struct Candidate {
+    uint32_t index;
+    uint32_t slot;
+    uint32_t tag;
+    size_t key;
+    bool operator<(const Candidate &other) const {
+      return index < other.index || (index == other.index && slot < other.slot);
+    }
+  };
+
+  size_t adaptations = 0;
+  std::vector<Candidate> candidates;
+  for (size_t round = 0; round < max_rounds; round++) {
+    candidates.clear();
+    HashedKey h[kProbeBatch];
+    for (size_t begin = 0; begin < n; begin += kProbeBatch) {
+      const size_t end = std::min(n, begin + kProbeBatch);
+      for (size_t k = begin; k < end; k++) {
+        hash_key(negative_keys[k], &h[k - begin]);
+        prefetch(h[k - begin]);
+      }
+      for (size_t k = begin; k < end; k++) {
+        const HashedKey &hk = h[k - begin];
+        for (uint32_t slot = 0; slot < 4; slot++) {
+          if (hk.tag[slot] == table_->ReadTag(hk.i1, slot)) {
+            Candidate c = {hk.i1, slot, hk.tag[slot], k};
+            candidates.push_back(c);
+          }
+          if (hk.i2 != hk.i1 && hk.tag[slot] == table_->ReadTag(hk.i2, slot)) {
+            Candidate c = {hk.i2, slot, hk.tag[slot], k};
+            candidates.push_back(c);
+          }
+        }
+      }
+    }
+
+    // Resolve in bucket order so the remote slots are visited sequentially.
+    // An earlier adaptation may have swapped the slot out already.
+    std::sort(candidates.begin(), candidates.end());
+    size_t round_adaptations = 0;
+    for (const Candidate &c : candidates) {
+      if (table_->ReadTag(c.index, c.slot) != c.tag) continue;
+      if (Expired(c.index, c.slot)) {
+        ExpireSlot(c.index, c.slot);
+        continue;
+      }
+      std::pair<ItemType, uint64_t> key_value;
+      hashmap.read_from_bucket_at_slot(c.index, c.slot, key_value);
+      num_remote_reads_++;
+      if (key_value.first == negative_keys[c.key]) continue;
+      remove_false_positives(c.index, c.slot);
+      round_adaptations++;
+    }
+    adaptations += round_adaptations;
+    if (round_adaptations == 0) break;
+  }
+  return adaptations;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::ExpireSlot(size_t i, size_t j)
+{
+  table_->WriteTag(i, j, 0);
+  hashmap.del_from_bucket_at_slot(i, j);
+  num_items_--;
+  num_expired_++;
+  MarkDirty(i);
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+size_t CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::ExpireBucket(size_t i)
+{
+  size_t expired = 0;
+  for (size_t slot = 0; slot < 4; slot++) {
+    if (table_->ReadTag(i, slot) != 0 && Expired(i, slot)) {
+      ExpireSlot(i, slot);
+      expired++;
+    }
+  }
+  return expired;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::set_ttl(uint32_t ttl)
+{
+  assert(ttl <= kMaxTtl);
+  if (ttl != 0 && ttl_ == 0) {
+    // Generations are not kept while expiry is off, so the items stored
+    // meanwhile, or before it was ever on, start aging now.
+    if (generations_.empty()) {
+      generations_.resize((table_->NumBuckets() * 4 + 1) / 2);
+    }
+    RestampGenerations();
+  }
+  ttl_ = ttl;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::RestampGenerations()
+{
+  for (size_t i = 0; i < table_->NumBuckets(); i++) {
+    for (size_t slot = 0; slot < kSlotsPerBucket; slot++) {
+      WriteGeneration(i, slot, generation_);
+    }
+  }
+  victim_.generation = generation_;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::set_cache_mode(bool enabled)
+{
+  if (enabled && referenced_.empty()) {
+    referenced_.resize(table_->NumBuckets());
+  }
+  cache_mode_ = enabled;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::advance_generation()
+{
+  generation_ = (generation_ + 1) & kGenerationMask;
+  if (ttl_ != 0) {
+    // an item becomes expired at age ttl_ and would look fresh again at age
+    // kGenerationMask + 1, leaving that many generations to visit it
+    const size_t window = kGenerationMask + 1 - ttl_;
+    sweep((table_->NumBuckets() + window - 1) / window);
+  }
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+size_t CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::sweep(size_t num_buckets)
+{
+  if (ttl_ == 0) {
+    return 0;
+  }
+  DropExpiredVictim();
+  size_t expired = 0;
+  num_buckets = std::min(num_buckets, table_->NumBuckets());
+  for (size_t k = 0; k < num_buckets; k++) {
+    expired += ExpireBucket(sweep_cursor_);
+    if (++sweep_cursor_ == table_->NumBuckets()) {
+      sweep_cursor_ = 0;
+    }
+  }
+  return expired;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+typename CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::Delta
+CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::export_delta(
+                                                       uint64_t since_epoch)
+{
+  Delta delta;
+  delta.from_epoch = since_epoch;
+  delta.full = since_epoch > epoch_ || epoch_ - since_epoch > history_.size();
+  delta.num_items = num_items_;
+  delta.victim = victim_;
+  delta.victim_age =
+      ttl_ != 0 ? (generation_ - victim_.generation) & kGenerationMask : 0;
+
+  // the buckets changed in the epochs after since_epoch, and in this one
+  std::vector<uint64_t> changed(dirty_);
+  if (!delta.full) {
+    const size_t behind = epoch_ - since_epoch;
+    for (size_t e = history_.size() - behind; e < history_.size(); e++) {
+      for (size_t w = 0; w < changed.size(); w++) {
+        changed[w] |= history_[e][w];
+      }
+    }
+  }
+
+  const size_t num_buckets = table_->NumBuckets();
+  for (size_t w = 0; w < changed.size(); w++) {
+    uint64_t bits = delta.full ? ~0ULL : changed[w];
+    while (bits != 0) {
+      size_t i = (w << 6) + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      if (i >= num_buckets) break;
+      delta.buckets.push_back(i);
+      for (size_t slot = 0; slot < kSlotsPerBucket; slot++) {
+        uint32_t tag = table_->ReadTag(i, slot);
+        delta.tags.push_back(tag);
+        if (tag != 0) {
+          std::pair<ItemType, uint64_t> key_value;
+          hashmap.read_from_bucket_at_slot(i, slot, key_value);
+          delta.slots.push_back(key_value);
+          if (ttl_ != 0) {
+            delta.ages.push_back((generation_ - ReadGeneration(i, slot)) &
+                                 kGenerationMask);
+          }
+        }
+      }
+    }
+  }
+
+  history_.push_back(dirty_);
+  if (history_.size() > kDeltaHistory) {
+    history_.pop_front();
+  }
+  std::fill(dirty_.begin(), dirty_.end(), 0);
+  delta.to_epoch = ++epoch_;
+  return delta;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::apply_delta(
+                                                          const Delta &delta)
+{
+  if (!delta.full && delta.from_epoch != epoch_) {
+    return false;
+  }
+
+  // check the whole delta before touching the table, so that a truncated or
+  // corrupt one leaves this filter as it was
+  const size_t num_buckets = table_->NumBuckets();
+  const uint64_t max_tag = (1ULL << bits_per_item) - 1;
+  if (delta.tags.size() != delta.buckets.size() * kTagsPerDelta ||
+      (!delta.ages.empty() && delta.ages.size() != delta.slots.size()) ||
+      delta.victim_age > kGenerationMask ||
+      (delta.victim.used && delta.victim.index >= num_buckets) ||
+      delta.num_items > table_->SizeInTags()) {
+    return false;
+  }
+  for (uint32_t i : delta.buckets) {
+    if (i >= num_buckets) {
+      return false;
+    }
+  }
+  size_t num_tags = 0;
+  for (uint32_t tag : delta.tags) {
+    if (tag > max_tag) {
+      return false;
+    }
+    num_tags += (tag != 0);
+  }
+  if (num_tags != delta.slots.size()) {
+    return false;
+  }
+  for (uint8_t age : delta.ages) {
+    if (age > kGenerationMask) {
+      return false;
+    }
+  }
+
+  size_t next_slot = 0;
+  for (size_t k = 0; k < delta.buckets.size(); k++) {
+    size_t i = delta.buckets[k];
+    for (size_t slot = 0; slot < kSlotsPerBucket; slot++) {
+      uint32_t tag = delta.tags[k * kTagsPerDelta + slot];
+      bool occupied = (table_->ReadTag(i, slot) != 0);
+      // WriteTag only ORs in narrow tags, so clear the slot first
+      table_->WriteTag(i, slot, 0);
+      table_->WriteTag(i, slot, tag);
+      if (tag != 0) {
+        const uint32_t age = delta.ages.empty() ? 0 : delta.ages[next_slot];
+        const std::pair<ItemType, uint64_t> &key_value = delta.slots[next_slot++];
+        hashmap.add_to_bucket_at_slot(i, slot, key_value.first, key_value.second);
+        if (ttl_ != 0) {
+          WriteGeneration(i, slot, (generation_ - age) & kGenerationMask);
+        }
+      } else if (occupied) {
+        hashmap.del_from_bucket_at_slot(i, slot);
+      }
+    }
+    MarkDirty(i);
+  }
+
+  num_items_ = delta.num_items;
+  victim_ = delta.victim;
+  victim_.generation = (generation_ - delta.victim_age) & kGenerationMask;
+  epoch_ = delta.to_epoch;
+  history_.clear();
+  return true;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::merge(CuckooFilter &older)
+{
+  if (cache_mode_) {
+    return false;
+  }
+  bool ok = true;
+  DropExpiredVictim();
+  older.for_each([&](const ItemType &key, uint64_t val) {
+    if (!ok) return;
+    HashedKey h;
+    hash_key(key, &h);
+    uint64_t existing;
+    if (find(key, h, existing)) return;
+    // the victim slot is the only thing insert_impl can fail into
+    ok = !victim_.used &&
+         insert_impl(key, val, h.i1, h.tag, h.tag_hash, generation_) &&
+         !victim_.used;
+  });
+  return ok;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+void CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::EncodeSnapshotBlock(
+    size_t first, size_t last, const SnapshotCodec *codec, std::string *out)
+{
+  std::string masks((last - first + 1) / 2, '\0');
+  std::string tags;
+  std::string keys;
+  std::string vals;
+  TagPacker packer(&tags);
+  uint32_t num_slots = 0;
+
+  static_assert(kSlotsPerBucket <= 4,
+                "snapshots keep a 4-bit occupancy mask per bucket");
+  for (size_t i = first; i < last; i++) {
+    uint8_t mask = 0;
+    for (size_t slot = 0; slot < kSlotsPerBucket; slot++) {
+      uint32_t tag = table_->ReadTag(i, slot);
+      if (tag == 0) continue;
+      std::pair<ItemType, uint64_t> key_value;
+      hashmap.read_from_bucket_at_slot(i, slot, key_value);
+      mask |= 1 << slot;
+      packer.Put(tag, bits_per_item);
+      SnapshotPut(&keys, key_value.first);
+      SnapshotPut(&vals, key_value.second);
+      num_slots++;
+    }
+    masks[(i - first) >> 1] |= mask << (((i - first) & 1) << 2);
+  }
+  packer.Flush();
+
+  std::string keys_enc;
+  std::string vals_enc;
+  codec->Compress(keys.data(), keys.size(), sizeof(ItemType), &keys_enc);
+  codec->Compress(vals.data(), vals.size(), sizeof(uint64_t), &vals_enc);
+
+  SnapshotPut(out, num_slots);
+  SnapshotPut(out, static_cast<uint64_t>(keys_enc.size()));
+  SnapshotPut(out, static_cast<uint64_t>(vals_enc.size()));
+  out->append(masks);
+  out->append(tags);
+  out->append(keys_enc);
+  out->append(vals_enc);
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::DecodeSnapshotBlock(
+    size_t first, size_t last, const SnapshotCodec *codec, const char *data,
+    size_t size, std::vector<SnapshotSlot> *slots)
+{
+  SnapshotReader in(data, size);
+  uint32_t num_slots;
+  uint64_t keys_size, vals_size;
+  if (!in.Get(&num_slots) || !in.Get(&keys_size) || !in.Get(&vals_size)) {
+    return false;
+  }
+  const char *masks = in.Skip((last - first + 1) / 2);
+  const char *tags = in.Skip(PackedTagBytes(num_slots, bits_per_item));
+  const char *keys_enc = in.Skip(keys_size);
+  const char *vals_enc = in.Skip(vals_size);
+  if (masks == NULL || tags == NULL || keys_enc == NULL || vals_enc == NULL) {
+    return false;
+  }
+
+  std::vector<ItemType> keys(num_slots);
+  std::vector<uint64_t> vals(num_slots);
+  if (!codec->Decompress(keys_enc, keys_size, sizeof(ItemType),
+                         num_slots * sizeof(ItemType),
+                         reinterpret_cast<char *>(keys.data())) ||
+      !codec->Decompress(vals_enc, vals_size, sizeof(uint64_t),
+                         num_slots * sizeof(uint64_t),
+                         reinterpret_cast<char *>(vals.data()))) {
+    return false;
+  }
+
+  TagUnpacker unpacker(tags);
+  size_t next = 0;
+  for (size_t i = first; i < last; i++) {
+    uint8_t mask = (masks[(i - first) >> 1] >> (((i - first) & 1) << 2)) & 0xf;
+    for (size_t slot = 0; slot < kSlotsPerBucket; slot++) {
+      if (!(mask & (1 << slot))) continue;
+      if (next == num_slots) return false;
+      table_->WriteTag(i, slot, unpacker.Get(bits_per_item));
+      SnapshotSlot decoded = {i, slot, keys[next], vals[next]};
+      slots->push_back(decoded);
+      next++;
+    }
+  }
+  return next == num_slots;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+std::string CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::save_snapshot(
+                                                    const SnapshotCodec *codec)
+{
+  static_assert(std::is_trivially_copyable<ItemType>::value &&
+                    std::is_trivially_copyable<HashFamily>::value,
+                "snapshots copy keys and hash seeds bytewise");
+  if (codec == NULL) {
+    codec = BuiltinSnapshotCodec(0);
+  }
+
+  const size_t num_buckets = table_->NumBuckets();
+  const size_t num_blocks =
+      (num_buckets + kSnapshotBucketsPerBlock - 1) / kSnapshotBucketsPerBlock;
+
+  std::string out;
+  SnapshotPut(&out, kSnapshotMagic);
+  SnapshotPut(&out, kSnapshotVersion);
+  SnapshotPut(&out, static_cast<uint32_t>(bits_per_item));
+  SnapshotPut(&out, codec->Id());
+  SnapshotPut(&out, static_cast<uint64_t>(num_buckets));
+  SnapshotPut(&out, static_cast<uint64_t>(num_items_));
+  SnapshotPut(&out, static_cast<uint32_t>(sizeof(ItemType)));
+  SnapshotPut(&out, hasher_);
+  SnapshotPut(&out, static_cast<uint8_t>(victim_.used));
+  SnapshotPut(&out, static_cast<uint64_t>(victim_.index));
+  SnapshotPut(&out, victim_.tag_hash);
+  SnapshotPut(&out, victim_.key);
+  SnapshotPut(&out, victim_.val);
+  SnapshotPut(&out, static_cast<uint64_t>(num_blocks));
+
+  // block offsets, relative to the end of the offset table
+  const size_t offsets_at = out.size();
+  out.resize(offsets_at + num_blocks * sizeof(uint64_t));
+  const size_t blocks_at = out.size();
+  for (size_t b = 0; b < num_blocks; b++) {
+    uint64_t offset = out.size() - blocks_at;
+    memcpy(&out[offsets_at + b * sizeof(uint64_t)], &offset, sizeof(offset));
+    size_t first = b * kSnapshotBucketsPerBlock;
+    size_t last = std::min(num_buckets, first + kSnapshotBucketsPerBlock);
+    EncodeSnapshotBlock(first, last, codec, &out);
+  }
+  return out;
+}
+
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType, typename HashFamily>
+bool CuckooFilter<ItemType, bits_per_item, TableType, HashFamily>::load_snapshot(
+    const std::string &data, unsigned num_threads, const SnapshotCodec *codec)
+{
+  if (num_items_ != 0 || victim_.used) {
+    return false;
+  }
+
+  SnapshotReader in(data.data(), data.size());
+  uint32_t magic, version, bits, codec_id, item_size;
+  uint64_t num_buckets, num_items, victim_index, num_blocks;
+  uint8_t victim_used;
+  VictimCache victim;
+  HashFamily hasher;
+  if (!in.Get(&magic) || !in.Get(&version) || !in.Get(&bits) ||
+      !in.Get(&codec_id) || !in.Get(&num_buckets) || !in.Get(&num_items) ||
+      !in.Get(&item_size) || !in.Get(&hasher) || !in.Get(&victim_used) ||
+      !in.Get(&victim_index) || !in.Get(&victim.tag_hash) ||
+      !in.Get(&victim.key) || !in.Get(&victim.val) || !in.Get(&num_blocks)) {
+    return false;
+  }
+  if (magic != kSnapshotMagic || version != kSnapshotVersion ||
+      bits != bits_per_item || item_size != sizeof(ItemType) ||
+      num_buckets != table_->NumBuckets() ||
+      num_blocks != (num_buckets + kSnapshotBucketsPerBlock - 1) /
+                        kSnapshotBucketsPerBlock) {
+    return false;
+  }
+  if (codec == NULL) {
+    codec = BuiltinSnapshotCodec(codec_id);
+  }
+  if (codec == NULL || codec->Id() != codec_id) {
+    return false;
+  }
+
+  const char *offsets = in.Skip(num_blocks * sizeof(uint64_t));
+  if (offsets == NULL) {
+    return false;
+  }
+  const char *blocks = offsets + num_blocks * sizeof(uint64_t);
+  const size_t blocks_size = data.data() + data.size() - blocks;
+
+  // Blocks cover disjoint buckets, so threads never touch the same slots. The
+  // remote store need not be thread-safe: threads only write tags and collect
+  // the slots, which are stored below on this thread.
+  num_threads = std::max(1u, std::min<unsigned>(num_threads, num_blocks));
+  std::vector<char> ok(num_threads, 1);
+  std::vector<std::vector<SnapshotSlot> > slots(num_threads);
+  auto decode = [&](unsigned t) {
+    for (size_t b = t; b < num_blocks; b += num_threads) {
+      uint64_t begin, end = blocks_size;
+      memcpy(&begin, offsets + b * sizeof(uint64_t), sizeof(begin));
+      if (b + 1 < num_blocks) {
+        memcpy(&end, offsets + (b + 1) * sizeof(uint64_t), sizeof(end));
+      }
+      size_t first = b * kSnapshotBucketsPerBlock;
+      size_t last = std::min<size_t>(num_buckets, first + kSnapshotBucketsPerBlock);
+      if (begin > end || end > blocks_size ||
+          !DecodeSnapshotBlock(first, last, codec, blocks + begin, end - begin,
+                               &slots[t])) {
+        ok[t] = 0;
+        return;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < num_threads; t++) {
+    threads.push_back(std::thread(decode, t));
+  }
+  decode(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (std::find(ok.begin(), ok.end(), 0) != ok.end()) {
+    return false;
+  }
+
+  // The item count must match the slots actually decoded.
+  size_t num_decoded = 0;
+  for (const auto &decoded : slots) {
+    num_decoded += decoded.size();
+  }
+  if (num_decoded != num_items) {
+    return false;
+  }
+  for (auto &decoded : slots) {
+    for (const SnapshotSlot &s : decoded) {
+      hashmap.add_to_bucket_at_slot(s.index, s.slot, s.key, s.val);
+    }
+    std::vector<SnapshotSlot>().swap(decoded);
+  }
+
+  hasher_ = hasher;
+  num_items_ = num_items;
+  victim.used = victim_used;
+  victim.index = victim_index;
+  victim.generation = generation_;
+  victim_ = victim;
+  if (ttl_ != 0) {
+    RestampGenerations();
+  }
+  dirty_.assign(dirty_.size(), ~0ULL);
+  return true;
 }
 
 }  // namespace cuckoofilter
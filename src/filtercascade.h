@@ -0,0 +1,146 @@
+#ifndef CUCKOO_FILTER_FILTER_CASCADE_H_
+#define CUCKOO_FILTER_FILTER_CASCADE_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "packedcuckoofilter.h"
+#include "simd-block.h"
+
+namespace cuckoofilter {
+
+// How a FilterCascade builds and queries one level. Specialize it to stack
+// other approximate filters; a level only needs to be sized for a number of
+// keys and a false positive rate, and to add and look up keys. Add() returns
+// false once the level is full, and the level is then built again with room
+// for twice the keys.
+template <typename LevelFilter>
+struct CascadeLevelTraits {};
+
+template <typename HashFamily>
+struct CascadeLevelTraits<SimdBlockFilter<HashFamily> > {
+  typedef SimdBlockFilter<HashFamily> Level;
+
+  static Level *Make(size_t num_keys, double fpp) {
+    return new Level(Level::WithFalsePositiveRate(num_keys, fpp));
+  }
+  static bool Add(uint64_t key, Level *level) {
+    level->Add(key);
+    return true;
+  }
+  static bool Find(uint64_t key, const Level &level) { return level.Find(key); }
+  static size_t SizeInBytes(const Level &level) { return level.SizeInBytes(); }
+};
+
+// A cuckoo level stores tags only, so its false positive rate is fixed by
+// bits_per_item, about 8 / 2^bits_per_item, and fpp is ignored; it is sized
+// for num_keys at a load of kCascadeCuckooLoad.
+const double kCascadeCuckooLoad = 0.9;
+
+template <size_t bits_per_item, typename HashFamily>
+struct CascadeLevelTraits<PackedCuckooFilter<bits_per_item, HashFamily> > {
+  typedef PackedCuckooFilter<bits_per_item, HashFamily> Level;
+
+  static Level *Make(size_t num_keys, double /* fpp */) {
+    return new Level(num_keys / kCascadeCuckooLoad + 1);
+  }
+  static bool Add(uint64_t key, Level *level) { return level->Add(key); }
+  static bool Find(uint64_t key, const Level &level) {
+    return level.Contain(key);
+  }
+  static size_t SizeInBytes(const Level &level) { return level.SizeInBytes(); }
+};
+
+// Exact membership over a known universe without any remote store, after
+// CRLite (Larisch et al., "CRLite: A Scalable System for Pushing All TLS
+// Revocations to All Browsers"). Level 0 holds the included keys; each
+// following level holds the keys of the other side that were false positives
+// of the level before, alternating, until a level has no false positives
+// over the universe. A key of the universe is included iff the first level
+// rejecting it is odd, or no level does and there is an odd number of them.
+// Keys outside the universe get an arbitrary answer.
+//
+// As in CRLite, the levels after the first are sized for a false positive
+// rate p, and the first for |include| / |exclude| * sqrt(p), which minimizes
+// the total size when few keys are included out of many: the first level
+// holds the included keys at few bits each, yet its false positives, the
+// second level's keys, stay about as many as the included ones. CRLite's
+// p = 1/2 suits Bloom filters setting one bit per key; block filters set
+// eight and do best around p = 1/4. Cuckoo levels, PackedCuckooFilter, have
+// the rate of their tag size at every level instead.
+template <typename LevelFilter = SimdBlockFilter<> >
+class FilterCascade {
+  typedef CascadeLevelTraits<LevelFilter> Traits;
+
+  std::vector<std::unique_ptr<LevelFilter> > levels_;
+
+ public:
+  // give up after this many levels, which only happens if a key is both
+  // included and excluded
+  static const size_t kMaxLevels = 64;
+
+  FilterCascade() {}
+
+  // Builds the cascade for the universe include ∪ exclude, the levels after
+  // the first with false positive rate fpp. Returns false if the two sets
+  // overlap.
+  bool Build(const uint64_t *include, size_t num_include,
+             const uint64_t *exclude, size_t num_exclude,
+             double fpp = 0.25) {
+    levels_.clear();
+    std::vector<uint64_t> in(include, include + num_include);
+    std::vector<uint64_t> out(exclude, exclude + num_exclude);
+    while (!in.empty()) {
+      if (levels_.size() == kMaxLevels) {
+        levels_.clear();
+        return false;
+      }
+      double level_fpp = fpp;
+      if (levels_.empty() && !out.empty()) {
+        level_fpp = std::min(
+            fpp, std::sqrt(fpp) * in.size() / static_cast<double>(out.size()));
+      }
+      std::unique_ptr<LevelFilter> level;
+      for (size_t room = in.size(); !level; room *= 2) {
+        level.reset(Traits::Make(room, level_fpp));
+        for (size_t k = 0; k < in.size() && level; k++) {
+          if (!Traits::Add(in[k], level.get())) level.reset();
+        }
+      }
+      // the false positives of this level become the next level's keys
+      std::vector<uint64_t> false_positives;
+      for (uint64_t key : out) {
+        if (Traits::Find(key, *level)) false_positives.push_back(key);
+      }
+      levels_.push_back(std::move(level));
+      out.swap(in);
+      in.swap(false_positives);
+    }
+    return true;
+  }
+
+  bool contains(uint64_t key) const {
+    for (size_t l = 0; l < levels_.size(); l++) {
+      if (!Traits::Find(key, *levels_[l])) return l & 1;
+    }
+    return levels_.size() & 1;
+  }
+
+  size_t NumLevels() const { return levels_.size(); }
+
+  size_t SizeInBytes() const {
+    size_t bytes = 0;
+    for (const auto &level : levels_) {
+      bytes += Traits::SizeInBytes(*level);
+    }
+    return bytes;
+  }
+};
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_FILTER_CASCADE_H_
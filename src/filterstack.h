@@ -0,0 +1,137 @@
+#ifndef CUCKOO_FILTER_FILTER_STACK_H_
+#define CUCKOO_FILTER_FILTER_STACK_H_
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "cuckoofilter.h"
+
+namespace cuckoofilter {
+
+// the highest load a compaction fills a run to; beyond it inserts start
+// failing, so Compact() refuses up front
+const double kMaxCompactLoad = 0.9;
+
+// A stack of cuckoo filters, one per immutable run of an LSM-tree-like
+// store, newest on top. All runs share one hasher and capacity, so a lookup
+// hashes the key once, prefetches the candidate buckets of every run in a
+// single pass so the cache misses overlap, and then probes the runs from
+// newest to oldest, touching the remote store only on a tag match.
+// FindBatch() overlaps the misses of groups of keys as well. Lookups change
+// no run, so any number of threads may look up at once while none pushes,
+// fills or compacts runs.
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType = SingleTable,
+          typename HashFamily = TwoIndependentMultiplyShift>
+class FilterStack {
+ public:
+  typedef CuckooFilter<ItemType, bits_per_item, TableType, HashFamily> Filter;
+
+ private:
+  typedef typename Filter::HashedKey HashedKey;
+
+  const size_t keys_per_run_;
+  const HashFamily hasher_;
+
+  // runs_[0] is the oldest run, runs_.back() the newest
+  std::vector<std::unique_ptr<Filter> > runs_;
+
+ public:
+  explicit FilterStack(const size_t keys_per_run)
+      : keys_per_run_(keys_per_run), hasher_() {}
+
+  size_t NumRuns() const { return runs_.size(); }
+
+  // run r, counting from 0 for the newest run
+  Filter &Run(size_t r) { return *runs_[runs_.size() - 1 - r]; }
+
+  // Starts a new, empty newest run and returns it for filling.
+  Filter &PushRun() {
+    runs_.push_back(std::unique_ptr<Filter>(new Filter(keys_per_run_, hasher_)));
+    return *runs_.back();
+  }
+
+  // Returns the number of the newest run (0 being the newest) holding key
+  // and sets val to its value there, or returns -1.
+  int Find(const ItemType &key, uint64_t &val) {
+    if (runs_.empty()) return -1;
+    HashedKey h;
+    runs_[0]->hash_key(key, &h);
+    for (size_t r = 0; r < runs_.size(); r++) {
+      runs_[r]->prefetch(h);
+    }
+    return Probe(key, h, val);
+  }
+
+  // Like Find() on each of the n keys, setting runs[k] and vals[k]. Keys are
+  // hashed kProbeBatch at a time and their buckets prefetched in every run
+  // before any is probed, so the misses of the whole group overlap.
+  void FindBatch(const ItemType *keys, size_t n, int *runs, uint64_t *vals) {
+    HashedKey h[kProbeBatch];
+    for (size_t begin = 0; begin < n; begin += kProbeBatch) {
+      const size_t end = std::min(n, begin + kProbeBatch);
+      for (size_t k = begin; k < end && !runs_.empty(); k++) {
+        runs_[0]->hash_key(keys[k], &h[k - begin]);
+        for (size_t r = 0; r < runs_.size(); r++) {
+          runs_[r]->prefetch(h[k - begin]);
+        }
+      }
+      for (size_t k = begin; k < end; k++) {
+        runs[k] = runs_.empty() ? -1 : Probe(keys[k], h[k - begin], vals[k]);
+      }
+    }
+  }
+
+  // Merges runs first..last (counted from the newest) into one run in place
+  // of run first, newer values winning, and drops the others. This is a full
+  // rebuild, not a table-level merge: the tags of different runs compete for
+  // the same buckets, so every item is looked up in the new run and
+  // inserted, with its cuckoo kicks and remote write, O(items) in all. Returns
+  // NotFound unless first <= last < NumRuns(). Every run has the same fixed
+  // capacity, so the merge is refused with NotEnoughSpace when the runs hold
+  // more items than kMaxCompactLoad of it, counting keys shadowed by newer
+  // runs. The runs are copied into a fresh filter, which replaces them only
+  // once all fit: should it fill up all the same, NotEnoughSpace is returned
+  // with the stack as it was. The merged run keeps the adaptivity and TTL of
+  // run first.
+  Status Compact(size_t first, size_t last) {
+    if (first > last || last >= runs_.size()) return NotFound;
+    const size_t newest = runs_.size() - 1 - first;
+    const size_t oldest = runs_.size() - 1 - last;
+    size_t num_items = 0;
+    for (size_t r = oldest; r <= newest; r++) {
+      num_items += runs_[r]->Size();
+    }
+    if (num_items > kMaxCompactLoad * runs_[newest]->Capacity()) {
+      return NotEnoughSpace;
+    }
+    std::unique_ptr<Filter> merged(new Filter(keys_per_run_, hasher_));
+    merged->set_adaptive(runs_[newest]->adaptive());
+    merged->set_ttl(runs_[newest]->ttl());
+    for (size_t r = newest + 1; r-- > oldest;) {
+      if (!merged->merge(*runs_[r])) return NotEnoughSpace;
+    }
+    runs_[newest] = std::move(merged);
+    runs_.erase(runs_.begin() + oldest, runs_.begin() + newest);
+    return Ok;
+  }
+
+ private:
+  // Probes the runs from newest to oldest for a key hashed into h, whose
+  // buckets should be on their way into cache already. Runs are immutable,
+  // so false positives are not adapted away.
+  int Probe(const ItemType &key, const HashedKey &h, uint64_t &val) {
+    for (size_t r = runs_.size(); r-- > 0;) {
+      // checks the remote slot only behind a matching tag
+      if (runs_[r]->find_readonly(key, h, val)) {
+        return static_cast<int>(runs_.size() - 1 - r);
+      }
+    }
+    return -1;
+  }
+};
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_FILTER_STACK_H_
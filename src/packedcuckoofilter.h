@@ -0,0 +1,132 @@
+#ifndef CUCKOO_FILTER_PACKED_CUCKOO_FILTER_H_
+#define CUCKOO_FILTER_PACKED_CUCKOO_FILTER_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "bitsutil.h"
+#include "cuckoofilter.h"
+#include "hashutil.h"
+#include "packedtable.h"
+
+namespace cuckoofilter {
+
+// A plain cuckoo filter over the semi-sorted PackedTable: one tag per key
+// and no remote store, so it neither adapts nor answers exactly, and a hit
+// is a false positive with probability about 8 / 2^bits_per_item. Like the
+// cuckoo filter it was first written for, it is sized from its capacity and
+// parks one item in a victim slot once an insert runs out of kicks, after
+// which it is full. bits_per_item must be one PackedTable encodes: 5 to 9,
+// 13 or 17.
+template <size_t bits_per_item,
+          typename HashFamily = TwoIndependentMultiplyShift>
+class PackedCuckooFilter {
+  typedef PackedTable<bits_per_item> Table;
+
+  Table table_;
+  HashFamily hasher_;
+  size_t num_items_;
+  struct {
+    size_t index;
+    uint32_t tag;
+    bool used;
+  } victim_;
+
+  static size_t NumBuckets(size_t capacity) {
+    const size_t assoc = Table::kTagsPerBucket;
+    size_t num_buckets = upperpower2(std::max<uint64_t>(1, capacity / assoc));
+    if (static_cast<double>(capacity) / num_buckets / assoc > 0.96) {
+      num_buckets <<= 1;
+    }
+    return num_buckets;
+  }
+
+  size_t IndexHash(uint32_t hv) const { return hv & (table_.NumBuckets() - 1); }
+
+  uint32_t TagHash(uint32_t hv) const {
+    const uint32_t tag = hv & ((1ULL << bits_per_item) - 1);
+    return tag + (tag == 0);
+  }
+
+  void IndexTag(uint64_t key, size_t *index, uint32_t *tag) const {
+    const uint64_t hash = hasher_(key);
+    *index = IndexHash(hash >> 32);
+    *tag = TagHash(hash);
+  }
+
+  // The other bucket of a tag in index, computable from the tag alone so
+  // that kicked tags can move without their keys.
+  size_t AltIndex(size_t index, uint32_t tag) const {
+    return IndexHash(static_cast<uint32_t>(index ^ (tag * 0x5bd1e995)));
+  }
+
+  bool AddTag(size_t index, uint32_t tag) {
+    for (size_t count = 0; count < kMaxCuckooCount; ++count) {
+      uint32_t old_tag = 0;
+      if (table_.InsertTagToBucket(index, tag, count > 0, old_tag)) {
+        ++num_items_;
+        return true;
+      }
+      if (count > 0) tag = old_tag;
+      index = AltIndex(index, tag);
+    }
+    victim_.index = index;
+    victim_.tag = tag;
+    victim_.used = true;
+    return true;
+  }
+
+ public:
+  explicit PackedCuckooFilter(size_t capacity)
+      : table_(NumBuckets(capacity)), hasher_(), num_items_(0), victim_() {}
+
+  // False once the filter is full.
+  bool Add(uint64_t key) {
+    if (victim_.used) return false;
+    size_t index;
+    uint32_t tag;
+    IndexTag(key, &index, &tag);
+    return AddTag(index, tag);
+  }
+
+  bool Contain(uint64_t key) const {
+    size_t i1;
+    uint32_t tag;
+    IndexTag(key, &i1, &tag);
+    const size_t i2 = AltIndex(i1, tag);
+    return (victim_.used && tag == victim_.tag &&
+            (i1 == victim_.index || i2 == victim_.index)) ||
+           table_.FindTagInBuckets(i1, i2, tag);
+  }
+
+  bool Remove(uint64_t key) {
+    size_t i1;
+    uint32_t tag;
+    IndexTag(key, &i1, &tag);
+    const size_t i2 = AltIndex(i1, tag);
+    if (table_.DeleteTagFromBucket(i1, tag) ||
+        table_.DeleteTagFromBucket(i2, tag)) {
+      --num_items_;
+      if (victim_.used) {
+        // the removal made room for the victim
+        victim_.used = false;
+        AddTag(victim_.index, victim_.tag);
+      }
+      return true;
+    }
+    if (victim_.used && tag == victim_.tag &&
+        (i1 == victim_.index || i2 == victim_.index)) {
+      victim_.used = false;
+      return true;
+    }
+    return false;
+  }
+
+  size_t Size() const { return num_items_; }
+  size_t SizeInBytes() const { return table_.SizeInBytes(); }
+};
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_PACKED_CUCKOO_FILTER_H_
@@ -13,6 +13,10 @@ namespace cuckoofilter {
 // Using Permutation encoding to save 1 bit per tag
 template <size_t bits_per_tag>
 class PackedTable {
+ public:
+  static const size_t kTagsPerBucket = 4;
+
+ private:
   static const size_t kDirBitsPerTag = bits_per_tag - 4;
   static const size_t kBitsPerBucket = (3 + kDirBitsPerTag) * 4;
   static const size_t kBytesPerBucket = (kBitsPerBucket + 7) >> 3;
@@ -320,6 +324,11 @@ class PackedTable {
     // ReadBucket(i1, tags1);
     // ReadBucket(i2, tags2);
 
+    // the unrolled decoding below assumes the 13-bit layout
+    if (bits_per_tag != 13) {
+      return FindTagInBucket(i1, tag) || FindTagInBucket(i2, tag);
+    }
+
     uint16_t v;
     uint64_t bucketbits1 = *((uint64_t *)(buckets_ + kBitsPerBucket * i1 / 8));
     uint64_t bucketbits2 = *((uint64_t *)(buckets_ + kBitsPerBucket * i2 / 8));
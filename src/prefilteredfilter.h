@@ -0,0 +1,174 @@
+#ifndef CUCKOO_FILTER_PREFILTERED_FILTER_H_
+#define CUCKOO_FILTER_PREFILTERED_FILTER_H_
+
+#include <math.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "cuckoofilter.h"
+#include "simd-block.h"
+
+namespace cuckoofilter {
+
+// A CuckooFilter behind a small SimdBlockFilter over the same keys. The
+// block filter is sized to stay in L2/LLC and answers with a single cache
+// line, so most negative queries are rejected without the two DRAM misses of
+// the cuckoo table, let alone a remote read. Block filters cannot delete, so
+// removed keys linger in the prefilter (costing only a wasted cuckoo probe)
+// until it is rebuilt from the cuckoo filter, which happens automatically
+// once the removals since the last rebuild exceed a fraction of the items
+// and kMinRebuildErasures, as each rebuild walks the whole table. Removals
+// are erasures, cache-mode evictions and expired items; the last two are
+// counted at the next insert or erase.
+template <typename ItemType, size_t bits_per_item,
+          template <size_t> class TableType = SingleTable,
+          typename HashFamily = TwoIndependentMultiplyShift>
+class PrefilteredCuckooFilter {
+ public:
+  typedef CuckooFilter<ItemType, bits_per_item, TableType, HashFamily> Filter;
+
+  // bits of prefilter per cuckoo slot when no size is given
+  static const size_t kPrefilterBitsPerKey = 8;
+  // largest default prefilter, in log2 bytes, to stay cache resident
+  static const int kMaxLogPrefilterBytes = 22;
+  // fewest removals since the last rebuild that trigger another
+  static const size_t kMinRebuildErasures = 1024;
+
+ private:
+  Filter filter_;
+  std::unique_ptr<SimdBlockFilter<> > prefilter_;
+  const int log_prefilter_bytes_;
+  const double rebuild_fraction_;
+  // erasures since the prefilter was last rebuilt
+  size_t stale_;
+  // the filter's evictions and expirations at the last rebuild
+  size_t dropped_at_rebuild_;
+  size_t num_rebuilds_;
+
+  size_t Dropped() const { return filter_.evictions() + filter_.expirations(); }
+
+  // Rebuilds once enough keys left the cuckoo filter without leaving the
+  // prefilter.
+  void MaybeRebuild() {
+    const size_t removed = stale_ + Dropped() - dropped_at_rebuild_;
+    if (removed >= kMinRebuildErasures &&
+        removed > rebuild_fraction_ * filter_.Size()) {
+      rebuild_prefilter();
+    }
+  }
+
+  static int DefaultLogPrefilterBytes(size_t num_keys) {
+    double bytes = std::max<size_t>(num_keys, 1) * kPrefilterBitsPerKey / 8.0;
+    const int max_log_bytes = kMaxLogPrefilterBytes;
+    return std::min<int>(max_log_bytes, ceil(log2(bytes)));
+  }
+
+ public:
+  // log_prefilter_bytes sizes the block filter; 0 picks kPrefilterBitsPerKey
+  // per slot of the cuckoo filter, which holds more than max_num_keys,
+  // capped at 2^kMaxLogPrefilterBytes bytes.
+  explicit PrefilteredCuckooFilter(const size_t max_num_keys,
+                                   const int log_prefilter_bytes = 0,
+                                   const double rebuild_fraction = 0.1)
+      : filter_(max_num_keys),
+        log_prefilter_bytes_(
+            log_prefilter_bytes > 0
+                ? log_prefilter_bytes
+                : DefaultLogPrefilterBytes(filter_.Capacity())),
+        rebuild_fraction_(rebuild_fraction),
+        stale_(0),
+        dropped_at_rebuild_(0),
+        num_rebuilds_(0) {
+    prefilter_.reset(new SimdBlockFilter<>(log_prefilter_bytes_));
+  }
+
+  size_t Size() const { return filter_.Size(); }
+
+  size_t SizeInBytes() const {
+    return filter_.SizeInBytes() + prefilter_->SizeInBytes();
+  }
+
+  // The cuckoo filter, read-only: anything stored in it must also reach the
+  // prefilter, so changes go through the members below.
+  const Filter &filter() const { return filter_; }
+
+  // Like the CuckooFilter members of the same names. Expiry and eviction
+  // only take items away, which the rebuild accounting picks up.
+  void set_adaptive(bool enabled) { filter_.set_adaptive(enabled); }
+  void set_ttl(uint32_t ttl) { filter_.set_ttl(ttl); }
+  void advance_generation() { filter_.advance_generation(); }
+  size_t sweep(size_t num_buckets) { return filter_.sweep(num_buckets); }
+  void set_cache_mode(bool enabled) { filter_.set_cache_mode(enabled); }
+
+  template <typename F>
+  void for_each(F f) { filter_.for_each(f); }
+
+  // Like the CuckooFilter members of the same names, but as they store items
+  // the prefilter knows nothing of, it is rebuilt afterwards, whatever the
+  // outcome.
+  bool apply_delta(const typename Filter::Delta &delta) {
+    const bool applied = filter_.apply_delta(delta);
+    rebuild_prefilter();
+    return applied;
+  }
+  bool merge(Filter &older) {
+    const bool merged = filter_.merge(older);
+    rebuild_prefilter();
+    return merged;
+  }
+  bool load_snapshot(const std::string &data, unsigned num_threads = 1,
+                     const SnapshotCodec *codec = NULL) {
+    const bool loaded = filter_.load_snapshot(data, num_threads, codec);
+    rebuild_prefilter();
+    return loaded;
+  }
+
+  // number of times the prefilter was rebuilt
+  size_t rebuilds() const { return num_rebuilds_; }
+
+  bool find(const ItemType &key, uint64_t &val) {
+    return prefilter_->Find(static_cast<uint64_t>(key)) && filter_.find(key, val);
+  }
+
+  bool findinfilter(const ItemType &key) {
+    return prefilter_->Find(static_cast<uint64_t>(key)) && filter_.findinfilter(key);
+  }
+
+  bool contains(const ItemType &key) {
+    return prefilter_->Find(static_cast<uint64_t>(key)) && filter_.contains(key);
+  }
+
+  bool insert(const ItemType &key, const uint64_t &val) {
+    if (!filter_.insert(key, val)) return false;
+    prefilter_->Add(static_cast<uint64_t>(key));
+    MaybeRebuild();
+    return true;
+  }
+
+  bool erase(const ItemType &key) {
+    if (!filter_.erase(key)) return false;
+    stale_++;
+    MaybeRebuild();
+    return true;
+  }
+
+  // Rebuilds the prefilter from the items in the cuckoo filter, dropping the
+  // bits of removed keys.
+  void rebuild_prefilter() {
+    std::unique_ptr<SimdBlockFilter<> > fresh(
+        new SimdBlockFilter<>(log_prefilter_bytes_));
+    filter_.for_each([&fresh](const ItemType &key, uint64_t) {
+      fresh->Add(static_cast<uint64_t>(key));
+    });
+    prefilter_.swap(fresh);
+    stale_ = 0;
+    dropped_at_rebuild_ = Dropped();
+    num_rebuilds_++;
+  }
+};
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_PREFILTERED_FILTER_H_
@@ -0,0 +1,74 @@
+#ifndef CUCKOO_FILTER_SERVER_PROTOCOL_H_
+#define CUCKOO_FILTER_SERVER_PROTOCOL_H_
+
+#include <stdint.h>
+
+namespace cuckoofilter {
+
+// Wire format of filter-server (example/filter-server.cc). All integers are
+// little-endian. A client may send any number of requests without waiting;
+// responses come back in request order on the same connection.
+//
+// request:  RequestHeader, then count keys (uint64_t), or for kOpInsert
+//           count key/value pairs (uint64_t, uint64_t)
+// response: ResponseHeader, then count result bytes (ServerResult), then
+//           for kOpFind count values (uint64_t), zero where the key was not
+//           found
+//
+// A request with a bad magic, an unknown op or a count over kServerMaxBatch
+// is answered with a ResponseHeader of status kServerBadRequest, count 0 and
+// the request's op and seq, after which the server closes the connection.
+enum ServerOp {
+  kOpFind = 1,
+  kOpContains = 2,
+  kOpInsert = 3,
+  kOpErase = 4,
+};
+
+enum ServerStatus {
+  kServerOk = 0,
+  kServerBadRequest = 1,
+};
+
+// the result byte of each key
+enum ServerResult {
+  kResultNo = 0,   // not found, inserted or erased
+  kResultYes = 1,  // found, inserted or erased
+  // kOpInsert only: inserted, but the shard is now full and rejects further
+  // inserts until erases make room
+  kResultFull = 2,
+};
+
+// largest batch accepted in one request
+const uint32_t kServerMaxBatch = 1 << 16;
+
+struct RequestHeader {
+  uint32_t magic;  // kRequestMagic
+  uint16_t op;     // ServerOp
+  uint16_t flags;  // reserved, 0
+  uint32_t count;  // number of keys in the batch
+  uint32_t seq;    // echoed back in the response
+} __attribute__((__packed__));
+
+struct ResponseHeader {
+  uint32_t magic;   // kResponseMagic
+  uint16_t op;      // ServerOp of the request
+  uint16_t status;  // ServerStatus
+  uint32_t count;   // number of results
+  uint32_t seq;     // seq of the request
+} __attribute__((__packed__));
+
+const uint32_t kRequestMagic = 0x51524643;   // "CFRQ"
+const uint32_t kResponseMagic = 0x53524643;  // "CFRS"
+
+inline uint64_t RequestPayloadBytes(uint16_t op, uint32_t count) {
+  return static_cast<uint64_t>(count) * (op == kOpInsert ? 16 : 8);
+}
+
+inline uint64_t ResponsePayloadBytes(uint16_t op, uint32_t count) {
+  return static_cast<uint64_t>(count) * (op == kOpFind ? 9 : 1);
+}
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_SERVER_PROTOCOL_H_
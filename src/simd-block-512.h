@@ -0,0 +1,332 @@
+// A 512-bit wide variant of SimdBlockFilter (see simd-block.h) for AVX-512 hosts.
+//
+// Each bucket is a full 64-byte cache line split into sixteen 32-bit lanes, and every
+// Add() sets one bit in each lane, so a lookup still touches a single cache line but
+// checks sixteen bits instead of eight. Each lane then sees twice the items, so this
+// only pays off for larger filters: measured at equal size, it has the lower false
+// positive rate above roughly 17 bits per item (0.0064% against 0.017% at 24) and the
+// higher one below (0.46% against 0.25% at 14).
+//
+// Like SimdBlockFilter, Add() and Find() pick their kernel at runtime: AVX-512F, else
+// AVX2 on two halves of the bucket, else SSE4.2 on four quarters, else plain C++, all
+// with the same bit layout. It also picks buckets by multiply-high range reduction, so
+// it may have any size.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+#include <immintrin.h>
+
+#include "hashutil.h"
+#include "simd-block.h"
+
+template<typename HashFamily = ::cuckoofilter::TwoIndependentMultiplyShift>
+class SimdBlockFilter512 {
+ private:
+  // The filter is divided up into Buckets:
+  using Bucket = uint32_t[16];
+
+  // log2(number of bytes in a bucket):
+  static constexpr int LOG_BUCKET_BYTE_SIZE = 6;
+
+  static_assert(
+      (1 << LOG_BUCKET_BYTE_SIZE) == sizeof(Bucket) && sizeof(Bucket) == sizeof(__m512i),
+      "Bucket sizing has gone awry.");
+
+  BlockFilterDirectory<Bucket> directory_;
+
+  HashFamily hasher_;
+
+  // The kernels Add() and Find() use, chosen in the constructor:
+  struct Kernels {
+    SimdBlockIsa isa;
+    void (*add)(Bucket* bucket, const uint32_t hash);
+    bool (*find)(const Bucket* bucket, const uint32_t hash);
+  };
+  Kernels kernels_;
+
+  // Odd contants for hashing; the first eight are the ones SimdBlockFilter uses:
+  static constexpr uint32_t kRehash[16] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+      0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U, 0x3a8f05c5U,
+      0x7ac6a2b1U, 0xe63f0b0dU, 0x1b873593U, 0xcc9e2d51U, 0x85ebca6bU, 0xc2b2ae35U,
+      0x27d4eb2fU};
+
+ public:
+  // Consumes at most (1 << log_heap_space) bytes on the heap. Add() and Find() use the
+  // fastest kernel that needs no more than 'isa'; the constructor throws if the CPU does
+  // not support 'isa'.
+  explicit SimdBlockFilter512(
+      const int log_heap_space, const SimdBlockIsa isa = BestSimdBlockIsa());
+  // A filter of 'bytes' bytes, rounded down to whole 64-byte buckets, at least one:
+  static SimdBlockFilter512 WithBytes(
+      const uint64_t bytes, const SimdBlockIsa isa = BestSimdBlockIsa());
+  // The smallest filter whose expected false positive probability is at most 'fpp'
+  // after adding num_items distinct keys:
+  static SimdBlockFilter512 WithFalsePositiveRate(const uint64_t num_items,
+      const double fpp, const SimdBlockIsa isa = BestSimdBlockIsa());
+  SimdBlockFilter512(SimdBlockFilter512&&) = default;
+  void Add(const uint64_t key) noexcept;
+  bool Find(const uint64_t key) const noexcept;
+  uint64_t SizeInBytes() const { return directory_.SizeInBytes(); }
+  // The instruction set of the kernels in use:
+  SimdBlockIsa Isa() const { return kernels_.isa; }
+
+  // Writes the filter, with its size and hash seeds, to 'path'. Returns false on I/O
+  // errors.
+  bool Save(const char* path) const;
+  // Reads a filter written by Save() onto the heap. Throws runtime_error if the file
+  // cannot be read or was saved by a different type of filter.
+  static SimdBlockFilter512 Load(
+      const char* path, const SimdBlockIsa isa = BestSimdBlockIsa());
+  // Like Load(), but maps the file instead of reading it, so that starting up only
+  // costs the page faults of the buckets actually probed. The mapping is private: Add()
+  // works on copies of the pages it touches and never changes the file.
+  static SimdBlockFilter512 Map(
+      const char* path, const SimdBlockIsa isa = BestSimdBlockIsa());
+
+ private:
+  SimdBlockFilter512(BlockFilterDirectory<Bucket>&& directory, const SimdBlockIsa isa);
+
+  static SimdBlockFilter512 Open(
+      const char* path, const SimdBlockIsa isa, const bool map);
+
+  // A helper function for Add()/Find(). Turns a 32-bit hash into a 512-bit Bucket
+  // with 1 single 1-bit set in each 32-bit lane.
+  static __m512i MakeMask(const uint32_t hash) noexcept;
+  // The same for one half of a Bucket, lanes 8 * half to 8 * half + 7:
+  static __m256i MakeMaskAvx2(const uint32_t hash, const int half) noexcept;
+  // And for one quarter, lanes 4 * quarter to 4 * quarter + 3:
+  static __m128i MakeMaskSse(const uint32_t hash, const int quarter) noexcept;
+
+  static void AddAvx512(Bucket* bucket, const uint32_t hash);
+  static bool FindAvx512(const Bucket* bucket, const uint32_t hash);
+  static void AddAvx2(Bucket* bucket, const uint32_t hash);
+  static bool FindAvx2(const Bucket* bucket, const uint32_t hash);
+  static void AddSse(Bucket* bucket, const uint32_t hash);
+  static bool FindSse(const Bucket* bucket, const uint32_t hash);
+  static void AddScalar(Bucket* bucket, const uint32_t hash);
+  static bool FindScalar(const Bucket* bucket, const uint32_t hash);
+
+  SimdBlockFilter512(const SimdBlockFilter512&) = delete;
+  void operator=(const SimdBlockFilter512&) = delete;
+};
+
+template<typename HashFamily>
+constexpr uint32_t SimdBlockFilter512<HashFamily>::kRehash[16];
+
+template<typename HashFamily>
+SimdBlockFilter512<HashFamily>::SimdBlockFilter512(
+    const int log_heap_space, const SimdBlockIsa isa)
+  : SimdBlockFilter512(
+        BlockFilterDirectory<Bucket>::Allocate(
+            BlockFilterBucketsForLogSpace(log_heap_space, LOG_BUCKET_BYTE_SIZE)),
+        isa) {}
+
+template<typename HashFamily>
+SimdBlockFilter512<HashFamily> SimdBlockFilter512<HashFamily>::WithBytes(
+    const uint64_t bytes, const SimdBlockIsa isa) {
+  return SimdBlockFilter512(BlockFilterDirectory<Bucket>::Allocate(
+                                BlockFilterBucketsForBytes(bytes, sizeof(Bucket))),
+      isa);
+}
+
+template<typename HashFamily>
+SimdBlockFilter512<HashFamily> SimdBlockFilter512<HashFamily>::WithFalsePositiveRate(
+    const uint64_t num_items, const double fpp, const SimdBlockIsa isa) {
+  return SimdBlockFilter512(BlockFilterDirectory<Bucket>::Allocate(
+                                BlockFilterBucketsForFpp(num_items, fpp, 16)),
+      isa);
+}
+
+template<typename HashFamily>
+SimdBlockFilter512<HashFamily>::SimdBlockFilter512(
+    BlockFilterDirectory<Bucket>&& directory, const SimdBlockIsa isa)
+  : directory_(::std::move(directory)), hasher_() {
+  static const Kernels kKernels[] = {
+      {SimdBlockIsa::kScalar, &AddScalar, &FindScalar},
+      {SimdBlockIsa::kSse42, &AddSse, &FindSse},
+      {SimdBlockIsa::kAvx2, &AddAvx2, &FindAvx2},
+      {SimdBlockIsa::kAvx512, &AddAvx512, &FindAvx512},
+  };
+  kernels_ = PickBlockFilterKernels(kKernels, isa, "SimdBlockFilter512");
+}
+
+template<typename HashFamily>
+bool SimdBlockFilter512<HashFamily>::Save(const char* path) const {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "the hasher is saved by copying its bytes");
+  return directory_.Save(path, &hasher_, sizeof(hasher_));
+}
+
+template<typename HashFamily>
+SimdBlockFilter512<HashFamily> SimdBlockFilter512<HashFamily>::Load(
+    const char* path, const SimdBlockIsa isa) {
+  return Open(path, isa, false);
+}
+
+template<typename HashFamily>
+SimdBlockFilter512<HashFamily> SimdBlockFilter512<HashFamily>::Map(
+    const char* path, const SimdBlockIsa isa) {
+  return Open(path, isa, true);
+}
+
+template<typename HashFamily>
+SimdBlockFilter512<HashFamily> SimdBlockFilter512<HashFamily>::Open(
+    const char* path, const SimdBlockIsa isa, const bool map) {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "the hasher is saved by copying its bytes");
+  HashFamily hasher;
+  SimdBlockFilter512 filter(
+      BlockFilterDirectory<Bucket>::Open(path, &hasher, sizeof(hasher), map), isa);
+  memcpy(&filter.hasher_, &hasher, sizeof(hasher));
+  return filter;
+}
+
+// GCC's AVX-512 intrinsics start from _mm512_undefined_epi32(), which trips
+// -Wuninitialized wherever they are inlined.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+template <typename HashFamily>
+inline void SimdBlockFilter512<HashFamily>::Add(const uint64_t key) noexcept {
+  const auto hash = hasher_(key);
+  const uint32_t bucket_idx = ((hash >> 32) * directory_.size()) >> 32;
+#ifdef __AVX512F__
+  // The build targets these instructions anyway, so call the kernel directly, where it
+  // can be inlined.
+  if (kernels_.isa == SimdBlockIsa::kAvx512) {
+    return AddAvx512(&directory_[bucket_idx], hash);
+  }
+#endif
+  kernels_.add(&directory_[bucket_idx], hash);
+}
+
+template <typename HashFamily>
+inline bool SimdBlockFilter512<HashFamily>::Find(const uint64_t key) const noexcept {
+  const auto hash = hasher_(key);
+  const uint32_t bucket_idx = ((hash >> 32) * directory_.size()) >> 32;
+#ifdef __AVX512F__
+  if (kernels_.isa == SimdBlockIsa::kAvx512) {
+    return FindAvx512(&directory_[bucket_idx], hash);
+  }
+#endif
+  return kernels_.find(&directory_[bucket_idx], hash);
+}
+
+template <typename HashFamily>
+[[gnu::always_inline, gnu::target("avx512f")]] inline __m512i
+SimdBlockFilter512<HashFamily>::MakeMask(const uint32_t hash) noexcept {
+  const __m512i ones = _mm512_set1_epi32(1);
+  const __m512i rehash = _mm512_loadu_si512(kRehash);
+  // Multiply-shift hashing ala Dietzfelbinger et al.: multiply 'hash' by sixteen
+  // different odd constants, then keep the 5 most significant bits from each product.
+  __m512i hash_data = _mm512_set1_epi32(hash);
+  hash_data = _mm512_mullo_epi32(rehash, hash_data);
+  hash_data = _mm512_srli_epi32(hash_data, 27);
+  // Use these 5 bits to shift a single bit to a location in each 32-bit lane
+  return _mm512_sllv_epi32(ones, hash_data);
+}
+
+template <typename HashFamily>
+[[gnu::target("avx512f")]] void
+SimdBlockFilter512<HashFamily>::AddAvx512(Bucket* bucket, const uint32_t hash) {
+  __m512i* const b = reinterpret_cast<__m512i*>(bucket);
+  _mm512_store_si512(b, _mm512_or_si512(_mm512_load_si512(b), MakeMask(hash)));
+}
+
+template <typename HashFamily>
+[[gnu::target("avx512f")]] bool
+SimdBlockFilter512<HashFamily>::FindAvx512(const Bucket* bucket, const uint32_t hash) {
+  const __m512i b = _mm512_load_si512(bucket);
+  // 'mask' has exactly one bit set per lane, so a lane of 'bucket' & 'mask' is nonzero
+  // iff the bucket has that bit. _mm512_test_epi32_mask sets one result bit per
+  // nonzero lane; the key may be present iff all sixteen are set.
+  return _mm512_test_epi32_mask(b, MakeMask(hash)) == 0xffff;
+}
+
+template <typename HashFamily>
+[[gnu::always_inline, gnu::target("avx2")]] inline __m256i
+SimdBlockFilter512<HashFamily>::MakeMaskAvx2(
+    const uint32_t hash, const int half) noexcept {
+  const __m256i rehash =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kRehash) + half);
+  __m256i hash_data = _mm256_mullo_epi32(rehash, _mm256_set1_epi32(hash));
+  hash_data = _mm256_srli_epi32(hash_data, 27);
+  return _mm256_sllv_epi32(_mm256_set1_epi32(1), hash_data);
+}
+
+template <typename HashFamily>
+[[gnu::target("avx2")]] void
+SimdBlockFilter512<HashFamily>::AddAvx2(Bucket* bucket, const uint32_t hash) {
+  __m256i* const b = reinterpret_cast<__m256i*>(bucket);
+  _mm256_store_si256(&b[0], _mm256_or_si256(b[0], MakeMaskAvx2(hash, 0)));
+  _mm256_store_si256(&b[1], _mm256_or_si256(b[1], MakeMaskAvx2(hash, 1)));
+}
+
+template <typename HashFamily>
+[[gnu::target("avx2")]] bool
+SimdBlockFilter512<HashFamily>::FindAvx2(const Bucket* bucket, const uint32_t hash) {
+  const __m256i* const b = reinterpret_cast<const __m256i*>(bucket);
+  return _mm256_testc_si256(b[0], MakeMaskAvx2(hash, 0)) &
+         _mm256_testc_si256(b[1], MakeMaskAvx2(hash, 1));
+}
+
+template <typename HashFamily>
+[[gnu::always_inline, gnu::target("sse4.2")]] inline __m128i
+SimdBlockFilter512<HashFamily>::MakeMaskSse(
+    const uint32_t hash, const int quarter) noexcept {
+  const __m128i rehash =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kRehash) + quarter);
+  __m128i hash_data = _mm_mullo_epi32(rehash, _mm_set1_epi32(hash));
+  hash_data = _mm_srli_epi32(hash_data, 27);
+  // 1 << x as the float 2^x, as in SimdBlockFilter::MakeMaskSse():
+  const __m128i exponent =
+      _mm_add_epi32(_mm_slli_epi32(hash_data, 23), _mm_set1_epi32(127 << 23));
+  return _mm_cvttps_epi32(_mm_castsi128_ps(exponent));
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2")]] void
+SimdBlockFilter512<HashFamily>::AddSse(Bucket* bucket, const uint32_t hash) {
+  __m128i* const b = reinterpret_cast<__m128i*>(bucket);
+  for (int quarter = 0; quarter < 4; ++quarter) {
+    _mm_store_si128(
+        &b[quarter], _mm_or_si128(b[quarter], MakeMaskSse(hash, quarter)));
+  }
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2")]] bool
+SimdBlockFilter512<HashFamily>::FindSse(const Bucket* bucket, const uint32_t hash) {
+  const __m128i* const b = reinterpret_cast<const __m128i*>(bucket);
+  return _mm_testc_si128(b[0], MakeMaskSse(hash, 0)) &
+         _mm_testc_si128(b[1], MakeMaskSse(hash, 1)) &
+         _mm_testc_si128(b[2], MakeMaskSse(hash, 2)) &
+         _mm_testc_si128(b[3], MakeMaskSse(hash, 3));
+}
+
+template <typename HashFamily>
+void SimdBlockFilter512<HashFamily>::AddScalar(Bucket* bucket, const uint32_t hash) {
+  for (int i = 0; i < 16; ++i) {
+    (*bucket)[i] |= 1u << ((hash * kRehash[i]) >> 27);
+  }
+}
+
+template <typename HashFamily>
+bool SimdBlockFilter512<HashFamily>::FindScalar(
+    const Bucket* bucket, const uint32_t hash) {
+  for (int i = 0; i < 16; ++i) {
+    if (!(((*bucket)[i] >> ((hash * kRehash[i]) >> 27)) & 1)) return false;
+  }
+  return true;
+}
+
+#pragma GCC diagnostic pop
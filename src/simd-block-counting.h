@@ -0,0 +1,351 @@
+// A counting variant of SimdBlockFilter (see simd-block.h) that supports Remove().
+//
+// Each bucket is a 64-byte cache line of eight 64-bit lanes, and each lane holds sixteen
+// 4-bit counters instead of 32 bits. Add() increments one counter per lane, Remove()
+// decrements the same ones, and Find() checks that none of them is zero, so every
+// operation still touches a single cache line. The price is four bits per position: at
+// the same size as a SimdBlockFilter, a lane has 16 positions instead of 32 and the
+// filter a correspondingly higher false positive probability.
+//
+// Counters saturate at 15 and then stay there, as in Fan et al.'s "Summary Cache": a
+// saturated counter can no longer tell how many keys share it, so it is never
+// decremented. Remove() must only be passed keys that were added; removing any other key
+// that happens to be a false positive takes counts away from keys that were.
+//
+// Add(), Remove() and Find() use AVX2 where available, else SSE4.2, else plain C++,
+// with the same layout.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+#include <immintrin.h>
+
+#include "hashutil.h"
+#include "simd-block.h"
+
+template<typename HashFamily = ::cuckoofilter::TwoIndependentMultiplyShift>
+class CountingSimdBlockFilter {
+ private:
+  // The filter is divided up into Buckets:
+  using Bucket = uint64_t[8];
+
+  // log2(number of bytes in a bucket):
+  static constexpr int LOG_BUCKET_BYTE_SIZE = 6;
+
+  static_assert((1 << LOG_BUCKET_BYTE_SIZE) == sizeof(Bucket) &&
+                    sizeof(Bucket) == 2 * sizeof(__m256i),
+      "Bucket sizing has gone awry.");
+
+  // The largest value of a counter; it sticks once reached:
+  static constexpr uint64_t kMaxCount = 15;
+
+  BlockFilterDirectory<Bucket> directory_;
+
+  HashFamily hasher_;
+
+  // The kernels Add(), Remove() and Find() use, chosen in the constructor:
+  struct Kernels {
+    SimdBlockIsa isa;
+    void (*add)(Bucket* bucket, const uint32_t hash);
+    bool (*remove)(Bucket* bucket, const uint32_t hash);
+    bool (*find)(const Bucket* bucket, const uint32_t hash);
+  };
+  Kernels kernels_;
+
+  // Odd contants for hashing, the ones SimdBlockFilter uses:
+  static constexpr uint32_t kRehash[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+      0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+ public:
+  // Consumes at most (1 << log_heap_space) bytes on the heap. The kernels need no more
+  // than 'isa'; the constructor throws if the CPU does not support 'isa'.
+  explicit CountingSimdBlockFilter(
+      const int log_heap_space, const SimdBlockIsa isa = BestSimdBlockIsa());
+  // A filter of 'bytes' bytes, rounded down to whole 64-byte buckets, at least one:
+  static CountingSimdBlockFilter WithBytes(
+      const uint64_t bytes, const SimdBlockIsa isa = BestSimdBlockIsa());
+  CountingSimdBlockFilter(CountingSimdBlockFilter&&) = default;
+  void Add(const uint64_t key) noexcept;
+  // Undoes an Add() of 'key'. Returns false, changing nothing, if Find(key) is false.
+  bool Remove(const uint64_t key) noexcept;
+  bool Find(const uint64_t key) const noexcept;
+  uint64_t SizeInBytes() const { return directory_.SizeInBytes(); }
+  // The instruction set of the kernels in use:
+  SimdBlockIsa Isa() const { return kernels_.isa; }
+
+ private:
+  CountingSimdBlockFilter(
+      BlockFilterDirectory<Bucket>&& directory, const SimdBlockIsa isa);
+
+  // A helper function for the AVX2 kernels. Turns a 32-bit hash into the bit offset of
+  // one counter in each 64-bit lane, for lanes 4 * half to 4 * half + 3.
+  static __m256i MakeShifts(const uint32_t hash, const int half) noexcept;
+  // A helper function for the SSE4.2 kernels, which cannot shift 64-bit lanes by
+  // different amounts. Sets one[p] to a 1 in the lowest bit, and all[p] to ones in all
+  // four bits, of the counter of lanes 2 * p and 2 * p + 1, for p < 4.
+  static void MakeCountersSse(
+      const uint32_t hash, __m128i one[4], __m128i all[4]) noexcept;
+  // The bit offset of the counter of lane i for the scalar kernels:
+  static int Shift(const uint32_t hash, const int i) noexcept {
+    return ((hash * kRehash[i]) >> 28) * 4;
+  }
+
+  static void AddAvx2(Bucket* bucket, const uint32_t hash);
+  static bool RemoveAvx2(Bucket* bucket, const uint32_t hash);
+  static bool FindAvx2(const Bucket* bucket, const uint32_t hash);
+  static void AddSse(Bucket* bucket, const uint32_t hash);
+  static bool RemoveSse(Bucket* bucket, const uint32_t hash);
+  static bool FindSse(const Bucket* bucket, const uint32_t hash);
+  static void AddScalar(Bucket* bucket, const uint32_t hash);
+  static bool RemoveScalar(Bucket* bucket, const uint32_t hash);
+  static bool FindScalar(const Bucket* bucket, const uint32_t hash);
+
+  CountingSimdBlockFilter(const CountingSimdBlockFilter&) = delete;
+  void operator=(const CountingSimdBlockFilter&) = delete;
+};
+
+template<typename HashFamily>
+constexpr uint32_t CountingSimdBlockFilter<HashFamily>::kRehash[8];
+
+template<typename HashFamily>
+CountingSimdBlockFilter<HashFamily>::CountingSimdBlockFilter(
+    const int log_heap_space, const SimdBlockIsa isa)
+  : CountingSimdBlockFilter(
+        BlockFilterDirectory<Bucket>::Allocate(
+            BlockFilterBucketsForLogSpace(log_heap_space, LOG_BUCKET_BYTE_SIZE)),
+        isa) {}
+
+template<typename HashFamily>
+CountingSimdBlockFilter<HashFamily> CountingSimdBlockFilter<HashFamily>::WithBytes(
+    const uint64_t bytes, const SimdBlockIsa isa) {
+  return CountingSimdBlockFilter(BlockFilterDirectory<Bucket>::Allocate(
+                                     BlockFilterBucketsForBytes(bytes, sizeof(Bucket))),
+      isa);
+}
+
+template<typename HashFamily>
+CountingSimdBlockFilter<HashFamily>::CountingSimdBlockFilter(
+    BlockFilterDirectory<Bucket>&& directory, const SimdBlockIsa isa)
+  : directory_(::std::move(directory)), hasher_() {
+  static const Kernels kKernels[] = {
+      {SimdBlockIsa::kScalar, &AddScalar, &RemoveScalar, &FindScalar},
+      {SimdBlockIsa::kSse42, &AddSse, &RemoveSse, &FindSse},
+      {SimdBlockIsa::kAvx2, &AddAvx2, &RemoveAvx2, &FindAvx2},
+  };
+  kernels_ = PickBlockFilterKernels(kKernels, isa, "CountingSimdBlockFilter");
+}
+
+template <typename HashFamily>
+inline void CountingSimdBlockFilter<HashFamily>::Add(const uint64_t key) noexcept {
+  const auto hash = hasher_(key);
+  const uint32_t bucket_idx = ((hash >> 32) * directory_.size()) >> 32;
+#ifdef __AVX2__
+  // The build targets AVX2 anyway, so call the kernel directly, where it can be inlined.
+  if (kernels_.isa == SimdBlockIsa::kAvx2) return AddAvx2(&directory_[bucket_idx], hash);
+#endif
+  kernels_.add(&directory_[bucket_idx], hash);
+}
+
+template <typename HashFamily>
+inline bool CountingSimdBlockFilter<HashFamily>::Remove(const uint64_t key) noexcept {
+  const auto hash = hasher_(key);
+  const uint32_t bucket_idx = ((hash >> 32) * directory_.size()) >> 32;
+#ifdef __AVX2__
+  if (kernels_.isa == SimdBlockIsa::kAvx2) {
+    return RemoveAvx2(&directory_[bucket_idx], hash);
+  }
+#endif
+  return kernels_.remove(&directory_[bucket_idx], hash);
+}
+
+template <typename HashFamily>
+inline bool CountingSimdBlockFilter<HashFamily>::Find(const uint64_t key) const noexcept {
+  const auto hash = hasher_(key);
+  const uint32_t bucket_idx = ((hash >> 32) * directory_.size()) >> 32;
+#ifdef __AVX2__
+  if (kernels_.isa == SimdBlockIsa::kAvx2) return FindAvx2(&directory_[bucket_idx], hash);
+#endif
+  return kernels_.find(&directory_[bucket_idx], hash);
+}
+
+template <typename HashFamily>
+[[gnu::always_inline, gnu::target("avx2")]] inline __m256i
+CountingSimdBlockFilter<HashFamily>::MakeShifts(
+    const uint32_t hash, const int half) noexcept {
+  const __m128i rehash =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kRehash) + half);
+  // Multiply-shift hashing ala Dietzfelbinger et al., keeping the 4 most significant
+  // bits to pick one of the sixteen counters of each lane:
+  __m128i counter = _mm_mullo_epi32(rehash, _mm_set1_epi32(hash));
+  counter = _mm_srli_epi32(counter, 28);
+  return _mm256_slli_epi64(_mm256_cvtepu32_epi64(counter), 2);
+}
+
+template <typename HashFamily>
+[[gnu::target("avx2")]] void
+CountingSimdBlockFilter<HashFamily>::AddAvx2(Bucket* bucket, const uint32_t hash) {
+  __m256i* const b = reinterpret_cast<__m256i*>(bucket);
+  const __m256i ones = _mm256_set1_epi64x(1);
+  const __m256i max_count = _mm256_set1_epi64x(kMaxCount);
+  for (int half = 0; half < 2; ++half) {
+    const __m256i shifts = MakeShifts(hash, half);
+    const __m256i counts =
+        _mm256_and_si256(_mm256_srlv_epi64(b[half], shifts), max_count);
+    // Add one to each counter that is not saturated yet. Counters below 15 cannot carry
+    // into their neighbours.
+    const __m256i saturated = _mm256_cmpeq_epi64(counts, max_count);
+    const __m256i increment =
+        _mm256_andnot_si256(saturated, _mm256_sllv_epi64(ones, shifts));
+    b[half] = _mm256_add_epi64(b[half], increment);
+  }
+}
+
+template <typename HashFamily>
+[[gnu::target("avx2")]] bool
+CountingSimdBlockFilter<HashFamily>::RemoveAvx2(Bucket* bucket, const uint32_t hash) {
+  if (!FindAvx2(bucket, hash)) return false;
+  __m256i* const b = reinterpret_cast<__m256i*>(bucket);
+  const __m256i ones = _mm256_set1_epi64x(1);
+  const __m256i max_count = _mm256_set1_epi64x(kMaxCount);
+  for (int half = 0; half < 2; ++half) {
+    const __m256i shifts = MakeShifts(hash, half);
+    const __m256i counts =
+        _mm256_and_si256(_mm256_srlv_epi64(b[half], shifts), max_count);
+    // Every counter is at least one, so none borrows from its neighbours.
+    const __m256i saturated = _mm256_cmpeq_epi64(counts, max_count);
+    const __m256i decrement =
+        _mm256_andnot_si256(saturated, _mm256_sllv_epi64(ones, shifts));
+    b[half] = _mm256_sub_epi64(b[half], decrement);
+  }
+  return true;
+}
+
+template <typename HashFamily>
+[[gnu::target("avx2")]] bool
+CountingSimdBlockFilter<HashFamily>::FindAvx2(const Bucket* bucket, const uint32_t hash) {
+  const __m256i* const b = reinterpret_cast<const __m256i*>(bucket);
+  const __m256i max_count = _mm256_set1_epi64x(kMaxCount);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i empty = zero;
+  for (int half = 0; half < 2; ++half) {
+    const __m256i counts =
+        _mm256_and_si256(_mm256_srlv_epi64(b[half], MakeShifts(hash, half)), max_count);
+    empty = _mm256_or_si256(empty, _mm256_cmpeq_epi64(counts, zero));
+  }
+  // The key may be present iff no lane has a zero counter:
+  return _mm256_testz_si256(empty, empty);
+}
+
+template <typename HashFamily>
+[[gnu::always_inline, gnu::target("sse4.2")]] inline void
+CountingSimdBlockFilter<HashFamily>::MakeCountersSse(
+    const uint32_t hash, __m128i one[4], __m128i all[4]) noexcept {
+  // The byte of each lane, repeated over its 64 bits, tells which byte holds the
+  // counter:
+  const __m128i byte_in_lane =
+      _mm_set_epi8(7, 6, 5, 4, 3, 2, 1, 0, 7, 6, 5, 4, 3, 2, 1, 0);
+  const __m128i first_pair = _mm_set_epi8(4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i second_pair =
+      _mm_set_epi8(12, 12, 12, 12, 12, 12, 12, 12, 8, 8, 8, 8, 8, 8, 8, 8);
+  for (int half = 0; half < 2; ++half) {
+    const __m128i rehash =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(kRehash) + half);
+    // The counter of each of four lanes, as in MakeShifts():
+    const __m128i counter =
+        _mm_srli_epi32(_mm_mullo_epi32(rehash, _mm_set1_epi32(hash)), 28);
+    // Counter c is the low nibble of byte c / 2 if c is even, else the high one:
+    const __m128i byte = _mm_srli_epi32(counter, 1);
+    const __m128i odd = _mm_and_si128(counter, _mm_set1_epi32(1));
+    const __m128i one_in_byte =
+        _mm_or_si128(_mm_slli_epi32(odd, 4), _mm_xor_si128(odd, _mm_set1_epi32(1)));
+    const __m128i all_in_byte =
+        _mm_sub_epi32(_mm_slli_epi32(one_in_byte, 4), one_in_byte);
+    for (int pair = 0; pair < 2; ++pair) {
+      const __m128i spread = pair == 0 ? first_pair : second_pair;
+      const __m128i in_byte =
+          _mm_cmpeq_epi8(_mm_shuffle_epi8(byte, spread), byte_in_lane);
+      one[2 * half + pair] =
+          _mm_and_si128(in_byte, _mm_shuffle_epi8(one_in_byte, spread));
+      all[2 * half + pair] =
+          _mm_and_si128(in_byte, _mm_shuffle_epi8(all_in_byte, spread));
+    }
+  }
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2")]] void
+CountingSimdBlockFilter<HashFamily>::AddSse(Bucket* bucket, const uint32_t hash) {
+  __m128i* const b = reinterpret_cast<__m128i*>(bucket);
+  __m128i one[4], all[4];
+  MakeCountersSse(hash, one, all);
+  for (int pair = 0; pair < 4; ++pair) {
+    const __m128i saturated =
+        _mm_cmpeq_epi64(_mm_and_si128(b[pair], all[pair]), all[pair]);
+    b[pair] = _mm_add_epi64(b[pair], _mm_andnot_si128(saturated, one[pair]));
+  }
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2")]] bool
+CountingSimdBlockFilter<HashFamily>::RemoveSse(Bucket* bucket, const uint32_t hash) {
+  if (!FindSse(bucket, hash)) return false;
+  __m128i* const b = reinterpret_cast<__m128i*>(bucket);
+  __m128i one[4], all[4];
+  MakeCountersSse(hash, one, all);
+  for (int pair = 0; pair < 4; ++pair) {
+    const __m128i saturated =
+        _mm_cmpeq_epi64(_mm_and_si128(b[pair], all[pair]), all[pair]);
+    b[pair] = _mm_sub_epi64(b[pair], _mm_andnot_si128(saturated, one[pair]));
+  }
+  return true;
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2")]] bool
+CountingSimdBlockFilter<HashFamily>::FindSse(const Bucket* bucket, const uint32_t hash) {
+  const __m128i* const b = reinterpret_cast<const __m128i*>(bucket);
+  __m128i one[4], all[4];
+  MakeCountersSse(hash, one, all);
+  __m128i empty = _mm_setzero_si128();
+  for (int pair = 0; pair < 4; ++pair) {
+    empty = _mm_or_si128(empty, _mm_cmpeq_epi64(_mm_and_si128(b[pair], all[pair]),
+                                                _mm_setzero_si128()));
+  }
+  // The key may be present iff no lane has a zero counter:
+  return _mm_testz_si128(empty, empty);
+}
+
+template <typename HashFamily>
+void CountingSimdBlockFilter<HashFamily>::AddScalar(Bucket* bucket, const uint32_t hash) {
+  for (int i = 0; i < 8; ++i) {
+    const int shift = Shift(hash, i);
+    if (((*bucket)[i] >> shift & kMaxCount) != kMaxCount) (*bucket)[i] += 1ull << shift;
+  }
+}
+
+template <typename HashFamily>
+bool CountingSimdBlockFilter<HashFamily>::RemoveScalar(
+    Bucket* bucket, const uint32_t hash) {
+  if (!FindScalar(bucket, hash)) return false;
+  for (int i = 0; i < 8; ++i) {
+    const int shift = Shift(hash, i);
+    if (((*bucket)[i] >> shift & kMaxCount) != kMaxCount) (*bucket)[i] -= 1ull << shift;
+  }
+  return true;
+}
+
+template <typename HashFamily>
+bool CountingSimdBlockFilter<HashFamily>::FindScalar(
+    const Bucket* bucket, const uint32_t hash) {
+  for (int i = 0; i < 8; ++i) {
+    if (((*bucket)[i] >> Shift(hash, i) & kMaxCount) == 0) return false;
+  }
+  return true;
+}
@@ -9,22 +9,347 @@
 //
 // 2. The number of bits set per Add() is contant in order to take advantage of SIMD
 // instructions.
+//
+// Add() and Find() pick their kernel at runtime, so a single build runs everywhere: AVX2
+// where available, else SSE4.2, else plain C++. All kernels set the same bits, so a
+// filter built by one can be queried by any other. Add() and Find() reach the kernel
+// through a pointer, which cannot be inlined unless the build itself targets AVX2;
+// AddBatch() and FindBatch() pick it once per call instead and run a loop compiled for
+// its instruction set, with the kernel inlined.
+//
+// The filter may have any number of buckets: the top 32 bits of the hash pick one by
+// multiply-high range reduction (Lemire, "A fast alternative to the modulo reduction"),
+// and the bottom 32 bits pick the bits to set within it.
 
 #pragma once
 
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
+#include <cmath>
 #include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
+#include <fcntl.h>
 #include <immintrin.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "hashutil.h"
 
 using uint32_t = ::std::uint32_t;
 using uint64_t = ::std::uint64_t;
 
+// The instruction sets block filters have kernels for, from slowest to fastest:
+enum class SimdBlockIsa { kScalar, kSse42, kAvx2, kAvx512 };
+
+inline bool SimdBlockIsaSupported(const SimdBlockIsa isa) {
+  switch (isa) {
+    case SimdBlockIsa::kScalar: return true;
+    case SimdBlockIsa::kSse42: return __builtin_cpu_supports("sse4.2");
+    case SimdBlockIsa::kAvx2: return __builtin_cpu_supports("avx2");
+    case SimdBlockIsa::kAvx512: return __builtin_cpu_supports("avx512f");
+  }
+  return false;
+}
+
+// The expected false positive probability of a block filter of num_buckets buckets with
+// num_lanes 32-bit lanes each, after adding num_items distinct keys. The number of keys
+// per bucket is Poisson distributed; a bucket with k keys has each bit of a lane set
+// with probability 1 - (31/32)^k.
+inline double BlockFilterFalsePositiveRate(
+    const uint64_t num_items, const uint64_t num_buckets, const int num_lanes) {
+  const double lambda = static_cast<double>(num_items) / num_buckets;
+  const double spread = 12 * ::std::sqrt(lambda) + 12;
+  const uint64_t first = lambda > spread ? static_cast<uint64_t>(lambda - spread) : 0;
+  const uint64_t last = static_cast<uint64_t>(lambda + spread);
+  double result = 0;
+  for (uint64_t k = first; k <= last; ++k) {
+    const double log_poisson =
+        (k == 0 ? 0 : k * ::std::log(lambda)) - lambda - ::std::lgamma(k + 1.0);
+    const double lane_fpp = 1 - ::std::pow(31 / 32.0, k);
+    result += ::std::exp(log_poisson) * ::std::pow(lane_fpp, num_lanes);
+  }
+  return result;
+}
+
+// A saved block filter starts with this header, followed by the bytes of its hasher and
+// zero padding up to header_bytes, a multiple of 64 so that the directory after it is
+// cache line aligned when the file is mapped.
+struct BlockFilterFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t bucket_bytes;
+  uint64_t num_buckets;
+  uint32_t hasher_bytes;
+  uint32_t header_bytes;
+};
+
+constexpr uint64_t kBlockFilterMagic = 0x52544c464b4c4253ull;  // "SBLKFLTR"
+constexpr uint32_t kBlockFilterVersion = 1;
+
+inline bool BlockFilterWriteAll(const int fd, const void* data, size_t n) {
+  const char* p = static_cast<const char*>(data);
+  while (n > 0) {
+    const ssize_t written = write(fd, p, n);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    p += written;
+    n -= written;
+  }
+  return true;
+}
+
+inline bool BlockFilterReadAll(const int fd, void* data, size_t n) {
+  char* p = static_cast<char*>(data);
+  while (n > 0) {
+    const ssize_t got = read(fd, p, n);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    p += got;
+    n -= got;
+  }
+  return true;
+}
+
+// Writes a block filter file to 'path'. Returns false on I/O errors.
+inline bool SaveBlockFilter(const char* path, const uint32_t bucket_bytes,
+    const uint64_t num_buckets, const void* hasher, const uint32_t hasher_bytes,
+    const void* directory) {
+  BlockFilterFileHeader header;
+  header.magic = kBlockFilterMagic;
+  header.version = kBlockFilterVersion;
+  header.bucket_bytes = bucket_bytes;
+  header.num_buckets = num_buckets;
+  header.hasher_bytes = hasher_bytes;
+  header.header_bytes = (sizeof(header) + hasher_bytes + 63) / 64 * 64;
+  ::std::vector<char> head(header.header_bytes, 0);
+  memcpy(head.data(), &header, sizeof(header));
+  memcpy(head.data() + sizeof(header), hasher, hasher_bytes);
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  const bool ok = BlockFilterWriteAll(fd, head.data(), head.size()) &&
+                  BlockFilterWriteAll(fd, directory, bucket_bytes * num_buckets);
+  return (close(fd) == 0) && ok;
+}
+
+// Opens a block filter file, checks that it was saved by a filter with the same bucket
+// size and hasher type, and reads the hasher. Returns the descriptor, positioned at the
+// directory, and sets the number of buckets and the size of the header. Throws
+// runtime_error if the file cannot be read or does not match.
+inline int OpenBlockFilter(const char* path, const uint32_t bucket_bytes, void* hasher,
+    const uint32_t hasher_bytes, uint64_t* num_buckets, uint32_t* header_bytes) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) throw ::std::runtime_error(::std::string("cannot open ") + path);
+  BlockFilterFileHeader header;
+  struct stat st;
+  const char* error = nullptr;
+  if (fstat(fd, &st) != 0 || !BlockFilterReadAll(fd, &header, sizeof(header))) {
+    error = "cannot read ";
+  } else if (header.magic != kBlockFilterMagic ||
+             header.version != kBlockFilterVersion) {
+    error = "not a block filter file: ";
+  } else if (header.bucket_bytes != bucket_bytes ||
+             header.hasher_bytes != hasher_bytes || header.header_bytes % 64 != 0 ||
+             header.header_bytes < sizeof(header) + hasher_bytes ||
+             header.num_buckets == 0 || header.num_buckets > (1ull << 32) ||
+             static_cast<uint64_t>(st.st_size) !=
+                 header.header_bytes + header.num_buckets * bucket_bytes) {
+    error = "block filter file does not match the filter type: ";
+  } else if (!BlockFilterReadAll(fd, hasher, hasher_bytes) ||
+             lseek(fd, header.header_bytes, SEEK_SET) < 0) {
+    error = "cannot read ";
+  }
+  if (error) {
+    close(fd);
+    throw ::std::runtime_error(error + ::std::string(path));
+  }
+  *num_buckets = header.num_buckets;
+  *header_bytes = header.header_bytes;
+  return fd;
+}
+
+// The fastest instruction set this CPU supports:
+inline SimdBlockIsa BestSimdBlockIsa() {
+  static const SimdBlockIsa best = SimdBlockIsaSupported(SimdBlockIsa::kAvx512)
+                                       ? SimdBlockIsa::kAvx512
+                                       : SimdBlockIsaSupported(SimdBlockIsa::kAvx2)
+                                             ? SimdBlockIsa::kAvx2
+                                             : SimdBlockIsaSupported(SimdBlockIsa::kSse42)
+                                                   ? SimdBlockIsa::kSse42
+                                                   : SimdBlockIsa::kScalar;
+  return best;
+}
+
+// At most 2^32 buckets, so that multiply-high range reduction of a 32-bit hash can reach
+// all of them:
+constexpr uint64_t kBlockFilterMaxBuckets = 1ull << 32;
+
+// The number of buckets of 2^log_bucket_bytes bytes in at most 2^log_heap_space bytes,
+// at least two:
+inline uint64_t BlockFilterBucketsForLogSpace(
+    const int log_heap_space, const int log_bucket_bytes) {
+  return 1ull << ::std::min(32, ::std::max(1, log_heap_space - log_bucket_bytes));
+}
+
+// The number of whole buckets of bucket_bytes bytes in 'bytes', at least one:
+inline uint64_t BlockFilterBucketsForBytes(
+    const uint64_t bytes, const uint64_t bucket_bytes) {
+  return ::std::min(
+      kBlockFilterMaxBuckets, ::std::max<uint64_t>(1, bytes / bucket_bytes));
+}
+
+// The fewest buckets of num_lanes lanes whose expected false positive probability is at
+// most 'fpp' after adding num_items distinct keys:
+inline uint64_t BlockFilterBucketsForFpp(
+    const uint64_t num_items, const double fpp, const int num_lanes) {
+  // The rate falls as buckets are added, so binary search for the fewest buckets:
+  uint64_t low = 1, high = kBlockFilterMaxBuckets;
+  while (low < high) {
+    const uint64_t mid = low + (high - low) / 2;
+    if (BlockFilterFalsePositiveRate(num_items, mid, num_lanes) <= fpp) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+// Picks, among the kernels of a filter type listed from slowest to fastest, the fastest
+// that needs no more than 'isa'. Kernels has an 'isa' member naming the instruction set
+// of each. Throws runtime_error, naming the filter type, if the CPU does not support
+// 'isa'.
+template <typename Kernels, size_t N>
+Kernels PickBlockFilterKernels(
+    const Kernels (&kernels)[N], const SimdBlockIsa isa, const char* filter) {
+  if (!SimdBlockIsaSupported(isa)) {
+    throw ::std::runtime_error(
+        ::std::string(filter) + ": the CPU lacks the requested instructions");
+  }
+  size_t best = 0;
+  for (size_t i = 1; i < N; ++i) {
+    if (kernels[i].isa <= isa) best = i;
+  }
+  return kernels[best];
+}
+
+// The buckets of a block filter, cache line aligned: zeroed on the heap, or read or
+// mapped from a file saved by SaveBlockFilter().
+template <typename Bucket>
+class BlockFilterDirectory {
+  uint64_t num_buckets_;
+  Bucket* buckets_;
+  // The file mapping holding the buckets, if they were mapped by Open():
+  void* mapping_;
+  size_t mapping_bytes_;
+
+  explicit BlockFilterDirectory(const uint64_t num_buckets)
+    : num_buckets_(num_buckets),
+      buckets_(nullptr),
+      mapping_(nullptr),
+      mapping_bytes_(0) {}
+
+ public:
+  // num_buckets zeroed buckets on the heap:
+  static BlockFilterDirectory Allocate(const uint64_t num_buckets) {
+    BlockFilterDirectory directory(num_buckets);
+    const size_t alloc_size = directory.SizeInBytes();
+    const int malloc_failed =
+        posix_memalign(reinterpret_cast<void**>(&directory.buckets_), 64, alloc_size);
+    if (malloc_failed) throw ::std::bad_alloc();
+    memset(directory.buckets_, 0, alloc_size);
+    return directory;
+  }
+
+  // The buckets of a filter file saved with a hasher of hasher_bytes bytes, which is
+  // read into 'hasher'. They are read onto the heap, or with 'map' privately mapped, so
+  // that only the pages probed are read and changes never reach the file. Throws
+  // runtime_error if the file cannot be read or does not match.
+  static BlockFilterDirectory Open(const char* path, void* hasher,
+      const uint32_t hasher_bytes, const bool map) {
+    uint64_t num_buckets;
+    uint32_t header_bytes;
+    const int fd = OpenBlockFilter(
+        path, sizeof(Bucket), hasher, hasher_bytes, &num_buckets, &header_bytes);
+    BlockFilterDirectory directory(num_buckets);
+    bool ok;
+    if (map) {
+      const size_t bytes = header_bytes + directory.SizeInBytes();
+      void* const mapping =
+          mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      ok = (mapping != MAP_FAILED);
+      if (ok) {
+        directory.mapping_ = mapping;
+        directory.mapping_bytes_ = bytes;
+        directory.buckets_ =
+            reinterpret_cast<Bucket*>(static_cast<char*>(mapping) + header_bytes);
+      }
+    } else {
+      try {
+        directory = Allocate(num_buckets);
+      } catch (...) {
+        close(fd);
+        throw;
+      }
+      ok = BlockFilterReadAll(fd, directory.buckets_, directory.SizeInBytes());
+    }
+    close(fd);
+    if (!ok) throw ::std::runtime_error(::std::string("cannot read ") + path);
+    return directory;
+  }
+
+  BlockFilterDirectory(BlockFilterDirectory&& that)
+    : num_buckets_(that.num_buckets_),
+      buckets_(that.buckets_),
+      mapping_(that.mapping_),
+      mapping_bytes_(that.mapping_bytes_) {
+    that.buckets_ = nullptr;
+    that.mapping_ = nullptr;
+  }
+
+  BlockFilterDirectory& operator=(BlockFilterDirectory&& that) {
+    ::std::swap(num_buckets_, that.num_buckets_);
+    ::std::swap(buckets_, that.buckets_);
+    ::std::swap(mapping_, that.mapping_);
+    ::std::swap(mapping_bytes_, that.mapping_bytes_);
+    return *this;
+  }
+
+  ~BlockFilterDirectory() noexcept {
+    if (mapping_) {
+      munmap(mapping_, mapping_bytes_);
+    } else {
+      free(buckets_);
+    }
+  }
+
+  uint64_t size() const { return num_buckets_; }
+  uint64_t SizeInBytes() const { return sizeof(Bucket) * num_buckets_; }
+  Bucket* data() { return buckets_; }
+  const Bucket* data() const { return buckets_; }
+  Bucket& operator[](const uint64_t i) { return buckets_[i]; }
+  const Bucket& operator[](const uint64_t i) const { return buckets_[i]; }
+
+  // Writes the buckets, with the hasher of a filter, to 'path'. Returns false on I/O
+  // errors.
+  bool Save(const char* path, const void* hasher, const uint32_t hasher_bytes) const {
+    return SaveBlockFilter(path, sizeof(Bucket), num_buckets_, hasher, hasher_bytes,
+        buckets_);
+  }
+
+  BlockFilterDirectory(const BlockFilterDirectory&) = delete;
+  void operator=(const BlockFilterDirectory&) = delete;
+};
+
 template<typename HashFamily = ::cuckoofilter::TwoIndependentMultiplyShift>
 class SimdBlockFilter {
  private:
@@ -38,74 +363,449 @@ class SimdBlockFilter {
       (1 << LOG_BUCKET_BYTE_SIZE) == sizeof(Bucket) && sizeof(Bucket) == sizeof(__m256i),
       "Bucket sizing has gone awry.");
 
-  // log_num_buckets_ is the log (base 2) of the number of buckets in the directory:
-  const int log_num_buckets_;
+  BlockFilterDirectory<Bucket> directory_;
 
-  // directory_mask_ is (1 << log_num_buckets_) - 1. It is precomputed in the contructor
-  // for efficiency reasons:
-  const uint32_t directory_mask_;
+  HashFamily hasher_;
 
-  Bucket* directory_;
+  // The kernels Add() and Find() use, chosen in the constructor:
+  struct Kernels {
+    SimdBlockIsa isa;
+    void (*add)(Bucket* bucket, const uint32_t hash);
+    bool (*find)(const Bucket* bucket, const uint32_t hash);
+  };
+  Kernels kernels_;
 
-  HashFamily hasher_;
+  // Odd contants for hashing:
+  static constexpr uint32_t kRehash[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+      0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
 
  public:
-  // Consumes at most (1 << log_heap_space) bytes on the heap:
-  explicit SimdBlockFilter(const int log_heap_space);
-  SimdBlockFilter(SimdBlockFilter&& that)
-    : log_num_buckets_(that.log_num_buckets_),
-      directory_mask_(that.directory_mask_),
-      directory_(that.directory_),
-      hasher_(that.hasher_) {}
-  ~SimdBlockFilter() noexcept;
+  // Consumes at most (1 << log_heap_space) bytes on the heap. Add() and Find() use the
+  // fastest kernel that needs no more than 'isa'; the constructor throws if the CPU does
+  // not support 'isa'.
+  explicit SimdBlockFilter(
+      const int log_heap_space, const SimdBlockIsa isa = BestSimdBlockIsa());
+  // A filter of 'bytes' bytes, rounded down to whole 32-byte buckets, at least one:
+  static SimdBlockFilter WithBytes(
+      const uint64_t bytes, const SimdBlockIsa isa = BestSimdBlockIsa());
+  // The smallest filter whose expected false positive probability is at most 'fpp'
+  // after adding num_items distinct keys:
+  static SimdBlockFilter WithFalsePositiveRate(const uint64_t num_items, const double fpp,
+      const SimdBlockIsa isa = BestSimdBlockIsa());
+  SimdBlockFilter(SimdBlockFilter&&) = default;
   void Add(const uint64_t key) noexcept;
   bool Find(const uint64_t key) const noexcept;
-  uint64_t SizeInBytes() const { return sizeof(Bucket) * (1ull << log_num_buckets_); }
+
+  // Keys hashed ahead of the bucket being tested in AddBatch()/FindBatch():
+  static constexpr size_t kBatchAhead = 16;
+  // log2(bytes of the filter per stripe when sorting by block):
+  static constexpr int LOG_STRIPE_BYTE_SIZE = 21;
+
+  // Sets out[i] to Find(keys[i]) for each i < n. Keys are hashed kBatchAhead ahead of
+  // the bucket being tested and their buckets prefetched, so the cache misses overlap.
+  // With sort_by_block, the keys are first grouped by which 2MiB stripe of the filter
+  // they fall into, which pays off for batches with several keys per cache line of a
+  // filter much larger than the cache.
+  void FindBatch(const uint64_t* keys, const size_t n, uint8_t* out,
+      const bool sort_by_block = false) const;
+  // Like calling Add() on each of the n keys, but batched as in FindBatch():
+  void AddBatch(const uint64_t* keys, const size_t n, const bool sort_by_block = false);
+
+  // Like Add() and AddBatch(), but safe to call from many threads at once, alongside
+  // Find(). The bucket's 64-bit words are or-ed in atomically, skipping the words that
+  // already have their bits. A key is found once its add happens-before the Find().
+  void AddConcurrent(const uint64_t key) noexcept;
+  void AddBatchConcurrent(const uint64_t* keys, const size_t n);
+
+  uint64_t SizeInBytes() const { return directory_.SizeInBytes(); }
+  // The instruction set of the kernels in use:
+  SimdBlockIsa Isa() const { return kernels_.isa; }
+
+  // Writes the filter, with its size and hash seeds, to 'path'. Returns false on I/O
+  // errors.
+  bool Save(const char* path) const;
+  // Reads a filter written by Save() onto the heap. Throws runtime_error if the file
+  // cannot be read or was saved by a different type of filter.
+  static SimdBlockFilter Load(
+      const char* path, const SimdBlockIsa isa = BestSimdBlockIsa());
+  // Like Load(), but maps the file instead of reading it, so that starting up only
+  // costs the page faults of the buckets actually probed. The mapping is private: Add()
+  // works on copies of the pages it touches and never changes the file.
+  static SimdBlockFilter Map(
+      const char* path, const SimdBlockIsa isa = BestSimdBlockIsa());
+
+  const HashFamily& hasher() const { return hasher_; }
+  // A new, empty filter with the same size, hash seeds and kernels as this one, to
+  // build a filter that can be combined with it:
+  SimdBlockFilter EmptyCopy() const;
+  // Whether UnionWith() and IntersectWith() accept 'other': it has the same number of
+  // buckets and the same hash seeds.
+  bool CompatibleWith(const SimdBlockFilter& other) const;
+
+  // Turns this filter into the union of itself and 'other', which then finds every key
+  // added to either, exactly as if they had all been added to one filter. The directory
+  // is split among num_threads threads. Returns false, changing nothing, unless
+  // CompatibleWith(other).
+  bool UnionWith(const SimdBlockFilter& other, const unsigned num_threads = 1);
+  // Like UnionWith(), but keeps only the bits set in both filters. The result finds
+  // every key added to both, with a false positive probability at least as high as a
+  // filter built from just those keys.
+  bool IntersectWith(const SimdBlockFilter& other, const unsigned num_threads = 1);
+
+  // Estimates the number of distinct keys added from the bits set in each bucket. With
+  // two compatible filters A and B, |A ∩ B| is about |A| + |B| - |A ∪ B|.
+  double EstimateCardinality() const;
+  // The probability that Find() returns true for a key that was not added, given the
+  // bits currently set: the mean over buckets of the product over lanes of the fraction
+  // of bits set in the lane.
+  double FalsePositiveRate() const;
 
  private:
+  SimdBlockFilter(BlockFilterDirectory<Bucket>&& directory, const SimdBlockIsa isa);
+
+  static SimdBlockFilter Open(const char* path, const SimdBlockIsa isa, const bool map);
+
+  // Where a key lands: its bucket and the hash bits left for MakeMask():
+  struct Probe {
+    uint32_t bucket_idx;
+    uint32_t hash;
+  };
+
+  Probe MakeProbe(const uint64_t key) const noexcept;
+  void AddProbe(const Probe probe) noexcept;
+  bool FindProbe(const Probe probe) const noexcept;
+
+  // Calls visit(i, get(i)) for each i < n, calling get() kBatchAhead ahead and
+  // prefetching the bucket of its Probe, for writing if kForWrite.
+  template <bool kForWrite, typename GetProbe, typename Visit>
+  void Pipeline(const size_t n, GetProbe get, Visit visit) const;
+
+  // FindBatch() and AddBatch() with the kernel fixed at compile time, so that it can be
+  // inlined into the loop:
+  template <bool (*kFind)(const Bucket*, const uint32_t)>
+  void FindBatchWith(const uint64_t* keys, const size_t n, uint8_t* out,
+      const bool sort_by_block) const;
+  template <void (*kAdd)(Bucket*, const uint32_t)>
+  void AddBatchWith(const uint64_t* keys, const size_t n, const bool sort_by_block);
+  // The same compiled for AVX2 and SSE4.2, whose kernels can only be inlined into code
+  // that targets them:
+  void FindBatchAvx2(const uint64_t* keys, const size_t n, uint8_t* out,
+      const bool sort_by_block) const;
+  void FindBatchSse(const uint64_t* keys, const size_t n, uint8_t* out,
+      const bool sort_by_block) const;
+  void AddBatchAvx2(const uint64_t* keys, const size_t n, const bool sort_by_block);
+  void AddBatchSse(const uint64_t* keys, const size_t n, const bool sort_by_block);
+
+  // Sets probes to the Probes of the n keys grouped by stripe, in input order within
+  // each stripe, and, unless it is null, order[i] to the index of the key of probes[i].
+  // Returns false if the filter is a single stripe.
+  bool SortByStripe(const uint64_t* keys, const size_t n, ::std::vector<Probe>* probes,
+      ::std::vector<size_t>* order) const;
+
   // A helper function for Insert()/Find(). Turns a 32-bit hash into a 256-bit Bucket
   // with 1 single 1-bit set in each 32-bit lane.
   static __m256i MakeMask(const uint32_t hash) noexcept;
+  // The same for one half of a Bucket, lanes 4 * half to 4 * half + 3:
+  static __m128i MakeMaskSse(const uint32_t hash, const int half) noexcept;
+
+  static void AddAvx2(Bucket* bucket, const uint32_t hash);
+  static bool FindAvx2(const Bucket* bucket, const uint32_t hash);
+  static void AddSse(Bucket* bucket, const uint32_t hash);
+  static bool FindSse(const Bucket* bucket, const uint32_t hash);
+  static void AddScalar(Bucket* bucket, const uint32_t hash);
+  static bool FindScalar(const Bucket* bucket, const uint32_t hash);
+  static void AddAtomic(Bucket* bucket, const uint32_t hash) noexcept;
+
+  template <bool kUnion>
+  bool Combine(const SimdBlockFilter& other, const unsigned num_threads);
+  // Sets dst[i] to dst[i] | src[i], or dst[i] & src[i] unless kUnion, for i < n:
+  template <bool kUnion>
+  static void CombineAvx2(Bucket* dst, const Bucket* src, const uint64_t n);
+  template <bool kUnion>
+  static void CombineSse(Bucket* dst, const Bucket* src, const uint64_t n);
+  template <bool kUnion>
+  static void CombineScalar(Bucket* dst, const Bucket* src, const uint64_t n);
+
+  // Adds up, over n buckets, the estimated number of keys and false positive
+  // probability of each:
+  static void BucketStats(const Bucket* buckets, const uint64_t n, double* keys,
+      double* fpp) noexcept;
+  static void BucketStatsPopcnt(const Bucket* buckets, const uint64_t n, double* keys,
+      double* fpp) noexcept;
+  void Stats(double* keys, double* fpp) const;
 
   SimdBlockFilter(const SimdBlockFilter&) = delete;
   void operator=(const SimdBlockFilter&) = delete;
 };
 
 template<typename HashFamily>
-SimdBlockFilter<HashFamily>::SimdBlockFilter(const int log_heap_space)
-  :  // Since log_heap_space is in bytes, we need to convert it to the number of Buckets
-     // we will use.
-    log_num_buckets_(::std::max(1, log_heap_space - LOG_BUCKET_BYTE_SIZE)),
-    // Don't use log_num_buckets_ if it will lead to undefined behavior by a shift that is
-    // too large.
-    directory_mask_((1ull << ::std::min(63, log_num_buckets_)) - 1),
-    directory_(nullptr),
-    hasher_() {
-  if (!__builtin_cpu_supports("avx2")) {
-    throw ::std::runtime_error("SimdBlockFilter does not work without AVX2 instructions");
-  }
-  const size_t alloc_size = 1ull << (log_num_buckets_ + LOG_BUCKET_BYTE_SIZE);
-  const int malloc_failed =
-      posix_memalign(reinterpret_cast<void**>(&directory_), 64, alloc_size);
-  if (malloc_failed) throw ::std::bad_alloc();
-  memset(directory_, 0, alloc_size);
+constexpr uint32_t SimdBlockFilter<HashFamily>::kRehash[8];
+
+
+template<typename HashFamily>
+SimdBlockFilter<HashFamily>::SimdBlockFilter(
+    const int log_heap_space, const SimdBlockIsa isa)
+  : SimdBlockFilter(BlockFilterDirectory<Bucket>::Allocate(BlockFilterBucketsForLogSpace(
+                        log_heap_space, LOG_BUCKET_BYTE_SIZE)),
+        isa) {}
+
+template<typename HashFamily>
+SimdBlockFilter<HashFamily> SimdBlockFilter<HashFamily>::WithBytes(
+    const uint64_t bytes, const SimdBlockIsa isa) {
+  return SimdBlockFilter(BlockFilterDirectory<Bucket>::Allocate(
+                             BlockFilterBucketsForBytes(bytes, sizeof(Bucket))),
+      isa);
 }
 
 template<typename HashFamily>
-SimdBlockFilter<HashFamily>::~SimdBlockFilter() noexcept {
-  free(directory_);
-  directory_ = nullptr;
+SimdBlockFilter<HashFamily> SimdBlockFilter<HashFamily>::WithFalsePositiveRate(
+    const uint64_t num_items, const double fpp, const SimdBlockIsa isa) {
+  return SimdBlockFilter(BlockFilterDirectory<Bucket>::Allocate(
+                             BlockFilterBucketsForFpp(num_items, fpp, 8)),
+      isa);
+}
+
+template<typename HashFamily>
+SimdBlockFilter<HashFamily>::SimdBlockFilter(
+    BlockFilterDirectory<Bucket>&& directory, const SimdBlockIsa isa)
+  : directory_(::std::move(directory)), hasher_() {
+  static const Kernels kKernels[] = {
+      {SimdBlockIsa::kScalar, &AddScalar, &FindScalar},
+      {SimdBlockIsa::kSse42, &AddSse, &FindSse},
+      {SimdBlockIsa::kAvx2, &AddAvx2, &FindAvx2},
+  };
+  kernels_ = PickBlockFilterKernels(kKernels, isa, "SimdBlockFilter");
+}
+
+template<typename HashFamily>
+bool SimdBlockFilter<HashFamily>::Save(const char* path) const {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "the hasher is saved by copying its bytes");
+  return directory_.Save(path, &hasher_, sizeof(hasher_));
+}
+
+template<typename HashFamily>
+SimdBlockFilter<HashFamily> SimdBlockFilter<HashFamily>::Load(
+    const char* path, const SimdBlockIsa isa) {
+  return Open(path, isa, false);
+}
+
+template<typename HashFamily>
+SimdBlockFilter<HashFamily> SimdBlockFilter<HashFamily>::Map(
+    const char* path, const SimdBlockIsa isa) {
+  return Open(path, isa, true);
+}
+
+template<typename HashFamily>
+SimdBlockFilter<HashFamily> SimdBlockFilter<HashFamily>::Open(
+    const char* path, const SimdBlockIsa isa, const bool map) {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "the hasher is saved by copying its bytes");
+  HashFamily hasher;
+  SimdBlockFilter filter(
+      BlockFilterDirectory<Bucket>::Open(path, &hasher, sizeof(hasher), map), isa);
+  memcpy(&filter.hasher_, &hasher, sizeof(hasher));
+  return filter;
+}
+
+template <typename HashFamily>
+[[gnu::always_inline]] inline typename SimdBlockFilter<HashFamily>::Probe
+SimdBlockFilter<HashFamily>::MakeProbe(const uint64_t key) const noexcept {
+  const auto hash = hasher_(key);
+  Probe probe;
+  probe.bucket_idx = ((hash >> 32) * directory_.size()) >> 32;
+  probe.hash = hash;
+  return probe;
+}
+
+template <typename HashFamily>
+[[gnu::always_inline]] inline void
+SimdBlockFilter<HashFamily>::AddProbe(const Probe probe) noexcept {
+#ifdef __AVX2__
+  // The build targets AVX2 anyway, so call the kernel directly, where it can be inlined.
+  if (kernels_.isa == SimdBlockIsa::kAvx2) {
+    return AddAvx2(&directory_[probe.bucket_idx], probe.hash);
+  }
+#endif
+  kernels_.add(&directory_[probe.bucket_idx], probe.hash);
+}
+
+template <typename HashFamily>
+[[gnu::always_inline]] inline bool
+SimdBlockFilter<HashFamily>::FindProbe(const Probe probe) const noexcept {
+#ifdef __AVX2__
+  if (kernels_.isa == SimdBlockIsa::kAvx2) {
+    return FindAvx2(&directory_[probe.bucket_idx], probe.hash);
+  }
+#endif
+  return kernels_.find(&directory_[probe.bucket_idx], probe.hash);
+}
+
+template <typename HashFamily>
+inline void SimdBlockFilter<HashFamily>::Add(const uint64_t key) noexcept {
+  AddProbe(MakeProbe(key));
+}
+
+template <typename HashFamily>
+inline bool SimdBlockFilter<HashFamily>::Find(const uint64_t key) const noexcept {
+  return FindProbe(MakeProbe(key));
+}
+
+template <typename HashFamily>
+template <bool kForWrite, typename GetProbe, typename Visit>
+inline void SimdBlockFilter<HashFamily>::Pipeline(
+    const size_t n, GetProbe get, Visit visit) const {
+  if (SizeInBytes() <= (1ull << LOG_STRIPE_BYTE_SIZE)) {
+    // The filter stays in cache, where prefetching only adds work.
+    for (size_t i = 0; i < n; ++i) visit(i, get(i));
+    return;
+  }
+  Probe ahead[kBatchAhead];
+  for (size_t i = 0; i < n && i < kBatchAhead; ++i) {
+    ahead[i] = get(i);
+    __builtin_prefetch(&directory_[ahead[i].bucket_idx], kForWrite);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    Probe& slot = ahead[i % kBatchAhead];
+    const Probe probe = slot;
+    if (i + kBatchAhead < n) {
+      slot = get(i + kBatchAhead);
+      __builtin_prefetch(&directory_[slot.bucket_idx], kForWrite);
+    }
+    visit(i, probe);
+  }
+}
+
+template <typename HashFamily>
+bool SimdBlockFilter<HashFamily>::SortByStripe(const uint64_t* keys, const size_t n,
+    ::std::vector<Probe>* probes, ::std::vector<size_t>* order) const {
+  const int shift = LOG_STRIPE_BYTE_SIZE - LOG_BUCKET_BYTE_SIZE;
+  const uint64_t num_stripes = ((directory_.size() - 1) >> shift) + 1;
+  if (num_stripes == 1) return false;
+  // A counting sort on the stripe number, the top bits of the bucket index. Hashing is
+  // cheaper than another pass over a temporary array, so the keys are hashed twice.
+  ::std::vector<size_t> start(num_stripes + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    ++start[(MakeProbe(keys[i]).bucket_idx >> shift) + 1];
+  }
+  for (size_t s = 1; s < start.size(); ++s) start[s] += start[s - 1];
+  probes->resize(n);
+  if (order) order->resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    const Probe probe = MakeProbe(keys[i]);
+    const size_t to = start[probe.bucket_idx >> shift]++;
+    (*probes)[to] = probe;
+    if (order) (*order)[to] = i;
+  }
+  return true;
+}
+
+template <typename HashFamily>
+template <bool (*kFind)(const typename SimdBlockFilter<HashFamily>::Bucket*,
+    const uint32_t)>
+[[gnu::always_inline]] inline void SimdBlockFilter<HashFamily>::FindBatchWith(
+    const uint64_t* keys, const size_t n, uint8_t* out, const bool sort_by_block) const {
+  ::std::vector<Probe> probes;
+  ::std::vector<size_t> order;
+  if (sort_by_block && SortByStripe(keys, n, &probes, &order)) {
+    Pipeline<false>(n, [&](size_t i) { return probes[i]; },
+        [&](size_t i, const Probe probe) {
+          out[order[i]] = kFind(&directory_[probe.bucket_idx], probe.hash);
+        });
+  } else {
+    Pipeline<false>(n, [&](size_t i) { return MakeProbe(keys[i]); },
+        [&](size_t i, const Probe probe) {
+          out[i] = kFind(&directory_[probe.bucket_idx], probe.hash);
+        });
+  }
+}
+
+template <typename HashFamily>
+template <void (*kAdd)(typename SimdBlockFilter<HashFamily>::Bucket*, const uint32_t)>
+[[gnu::always_inline]] inline void SimdBlockFilter<HashFamily>::AddBatchWith(
+    const uint64_t* keys, const size_t n, const bool sort_by_block) {
+  ::std::vector<Probe> probes;
+  if (sort_by_block && SortByStripe(keys, n, &probes, nullptr)) {
+    Pipeline<true>(n, [&](size_t i) { return probes[i]; },
+        [&](size_t, const Probe probe) {
+          kAdd(&directory_[probe.bucket_idx], probe.hash);
+        });
+  } else {
+    Pipeline<true>(n, [&](size_t i) { return MakeProbe(keys[i]); },
+        [&](size_t, const Probe probe) {
+          kAdd(&directory_[probe.bucket_idx], probe.hash);
+        });
+  }
+}
+
+// flatten inlines the lambdas of Pipeline() into these, and then the kernels into the
+// lambdas, now that the code around them targets the kernels' instruction set.
+template <typename HashFamily>
+[[gnu::target("avx2"), gnu::flatten]] void SimdBlockFilter<HashFamily>::FindBatchAvx2(
+    const uint64_t* keys, const size_t n, uint8_t* out, const bool sort_by_block) const {
+  FindBatchWith<&FindAvx2>(keys, n, out, sort_by_block);
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2"), gnu::flatten]] void SimdBlockFilter<HashFamily>::FindBatchSse(
+    const uint64_t* keys, const size_t n, uint8_t* out, const bool sort_by_block) const {
+  FindBatchWith<&FindSse>(keys, n, out, sort_by_block);
+}
+
+template <typename HashFamily>
+[[gnu::target("avx2"), gnu::flatten]] void SimdBlockFilter<HashFamily>::AddBatchAvx2(
+    const uint64_t* keys, const size_t n, const bool sort_by_block) {
+  AddBatchWith<&AddAvx2>(keys, n, sort_by_block);
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2"), gnu::flatten]] void SimdBlockFilter<HashFamily>::AddBatchSse(
+    const uint64_t* keys, const size_t n, const bool sort_by_block) {
+  AddBatchWith<&AddSse>(keys, n, sort_by_block);
+}
+
+template <typename HashFamily>
+void SimdBlockFilter<HashFamily>::FindBatch(const uint64_t* keys, const size_t n,
+    uint8_t* out, const bool sort_by_block) const {
+  switch (kernels_.isa) {
+    case SimdBlockIsa::kAvx2: return FindBatchAvx2(keys, n, out, sort_by_block);
+    case SimdBlockIsa::kSse42: return FindBatchSse(keys, n, out, sort_by_block);
+    default: return FindBatchWith<&FindScalar>(keys, n, out, sort_by_block);
+  }
+}
+
+template <typename HashFamily>
+void SimdBlockFilter<HashFamily>::AddBatch(
+    const uint64_t* keys, const size_t n, const bool sort_by_block) {
+  switch (kernels_.isa) {
+    case SimdBlockIsa::kAvx2: return AddBatchAvx2(keys, n, sort_by_block);
+    case SimdBlockIsa::kSse42: return AddBatchSse(keys, n, sort_by_block);
+    default: return AddBatchWith<&AddScalar>(keys, n, sort_by_block);
+  }
+}
+
+template <typename HashFamily>
+inline void SimdBlockFilter<HashFamily>::AddConcurrent(const uint64_t key) noexcept {
+  const Probe probe = MakeProbe(key);
+  AddAtomic(&directory_[probe.bucket_idx], probe.hash);
+}
+
+template <typename HashFamily>
+void SimdBlockFilter<HashFamily>::AddBatchConcurrent(
+    const uint64_t* keys, const size_t n) {
+  Pipeline<true>(n, [&](size_t i) { return MakeProbe(keys[i]); },
+      [&](size_t, const Probe probe) {
+        AddAtomic(&directory_[probe.bucket_idx], probe.hash);
+      });
 }
 
 // The SIMD reinterpret_casts technically violate C++'s strict aliasing rules. However, we
 // compile with -fno-strict-aliasing.
 template <typename HashFamily>
-[[gnu::always_inline]] inline __m256i
+[[gnu::always_inline, gnu::target("avx2")]] inline __m256i
 SimdBlockFilter<HashFamily>::MakeMask(const uint32_t hash) noexcept {
   const __m256i ones = _mm256_set1_epi32(1);
-  // Odd contants for hashing:
-  const __m256i rehash = _mm256_setr_epi32(0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
-      0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U);
+  const __m256i rehash = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kRehash));
   // Load hash into a YMM register, repeated eight times
   __m256i hash_data = _mm256_set1_epi32(hash);
   // Multiply-shift hashing ala Dietzfelbinger et al.: multiply 'hash' by eight different
@@ -117,25 +817,236 @@ SimdBlockFilter<HashFamily>::MakeMask(const uint32_t hash) noexcept {
 }
 
 template <typename HashFamily>
-[[gnu::always_inline]] inline void
-SimdBlockFilter<HashFamily>::Add(const uint64_t key) noexcept {
-  const auto hash = hasher_(key);
-  const uint32_t bucket_idx = hash & directory_mask_;
-  const __m256i mask = MakeMask(hash >> log_num_buckets_);
-  __m256i* const bucket = &reinterpret_cast<__m256i*>(directory_)[bucket_idx];
-  _mm256_store_si256(bucket, _mm256_or_si256(*bucket, mask));
+[[gnu::target("avx2")]] void
+SimdBlockFilter<HashFamily>::AddAvx2(Bucket* bucket, const uint32_t hash) {
+  const __m256i mask = MakeMask(hash);
+  __m256i* const b = reinterpret_cast<__m256i*>(bucket);
+  _mm256_store_si256(b, _mm256_or_si256(*b, mask));
 }
 
 template <typename HashFamily>
-[[gnu::always_inline]] inline bool
-SimdBlockFilter<HashFamily>::Find(const uint64_t key) const noexcept {
-  const auto hash = hasher_(key);
-  const uint32_t bucket_idx = hash & directory_mask_;
-  const __m256i mask = MakeMask(hash >> log_num_buckets_);
-  const __m256i bucket = reinterpret_cast<__m256i*>(directory_)[bucket_idx];
+[[gnu::target("avx2")]] bool
+SimdBlockFilter<HashFamily>::FindAvx2(const Bucket* bucket, const uint32_t hash) {
+  const __m256i mask = MakeMask(hash);
+  const __m256i b = *reinterpret_cast<const __m256i*>(bucket);
   // We should return true if 'bucket' has a one wherever 'mask' does. _mm256_testc_si256
   // takes the negation of its first argument and ands that with its second argument. In
   // our case, the result is zero everywhere iff there is a one in 'bucket' wherever
   // 'mask' is one. testc returns 1 if the result is 0 everywhere and returns 0 otherwise.
-  return _mm256_testc_si256(bucket, mask);
+  return _mm256_testc_si256(b, mask);
+}
+
+template <typename HashFamily>
+[[gnu::always_inline, gnu::target("sse4.2")]] inline __m128i
+SimdBlockFilter<HashFamily>::MakeMaskSse(const uint32_t hash, const int half) noexcept {
+  const __m128i rehash =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(kRehash) + half);
+  __m128i hash_data = _mm_mullo_epi32(rehash, _mm_set1_epi32(hash));
+  hash_data = _mm_srli_epi32(hash_data, 27);
+  // SSE has no per-lane variable shift, so build 1 << x as the float 2^x instead. 2^31
+  // is out of range for the conversion back to int32, which then returns 0x80000000:
+  // exactly 1 << 31.
+  const __m128i exponent =
+      _mm_add_epi32(_mm_slli_epi32(hash_data, 23), _mm_set1_epi32(127 << 23));
+  return _mm_cvttps_epi32(_mm_castsi128_ps(exponent));
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2")]] void
+SimdBlockFilter<HashFamily>::AddSse(Bucket* bucket, const uint32_t hash) {
+  __m128i* const b = reinterpret_cast<__m128i*>(bucket);
+  _mm_store_si128(&b[0], _mm_or_si128(b[0], MakeMaskSse(hash, 0)));
+  _mm_store_si128(&b[1], _mm_or_si128(b[1], MakeMaskSse(hash, 1)));
+}
+
+template <typename HashFamily>
+[[gnu::target("sse4.2")]] bool
+SimdBlockFilter<HashFamily>::FindSse(const Bucket* bucket, const uint32_t hash) {
+  const __m128i* const b = reinterpret_cast<const __m128i*>(bucket);
+  return _mm_testc_si128(b[0], MakeMaskSse(hash, 0)) &
+         _mm_testc_si128(b[1], MakeMaskSse(hash, 1));
+}
+
+template <typename HashFamily>
+void SimdBlockFilter<HashFamily>::AddScalar(Bucket* bucket, const uint32_t hash) {
+  for (int i = 0; i < 8; ++i) {
+    (*bucket)[i] |= 1u << ((hash * kRehash[i]) >> 27);
+  }
+}
+
+template <typename HashFamily>
+bool SimdBlockFilter<HashFamily>::FindScalar(const Bucket* bucket, const uint32_t hash) {
+  for (int i = 0; i < 8; ++i) {
+    if (!(((*bucket)[i] >> ((hash * kRehash[i]) >> 27)) & 1)) return false;
+  }
+  return true;
+}
+
+template <typename HashFamily>
+inline void SimdBlockFilter<HashFamily>::AddAtomic(
+    Bucket* bucket, const uint32_t hash) noexcept {
+  uint32_t mask[8];
+  for (int i = 0; i < 8; ++i) {
+    mask[i] = 1u << ((hash * kRehash[i]) >> 27);
+  }
+  uint64_t* const words = reinterpret_cast<uint64_t*>(bucket);
+  for (int w = 0; w < 4; ++w) {
+    uint64_t word_mask;
+    memcpy(&word_mask, &mask[2 * w], sizeof(word_mask));
+    // Once the filter fills up most words already have their bits, and a plain load is
+    // much cheaper than a locked or.
+    if ((__atomic_load_n(&words[w], __ATOMIC_RELAXED) & word_mask) != word_mask) {
+      __atomic_fetch_or(&words[w], word_mask, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+template <typename HashFamily>
+SimdBlockFilter<HashFamily> SimdBlockFilter<HashFamily>::EmptyCopy() const {
+  SimdBlockFilter copy(
+      BlockFilterDirectory<Bucket>::Allocate(directory_.size()), kernels_.isa);
+  copy.hasher_ = hasher_;
+  return copy;
+}
+
+template <typename HashFamily>
+bool SimdBlockFilter<HashFamily>::CompatibleWith(const SimdBlockFilter& other) const {
+  static_assert(::std::is_trivially_copyable<HashFamily>::value,
+      "hash seeds are compared bytewise");
+  // The one byte of a stateless hasher is padding that assignment does not copy:
+  return directory_.size() == other.directory_.size() &&
+         (::std::is_empty<HashFamily>::value ||
+          memcmp(&hasher_, &other.hasher_, sizeof(hasher_)) == 0);
+}
+
+template <typename HashFamily>
+bool SimdBlockFilter<HashFamily>::UnionWith(
+    const SimdBlockFilter& other, const unsigned num_threads) {
+  return Combine<true>(other, num_threads);
+}
+
+template <typename HashFamily>
+bool SimdBlockFilter<HashFamily>::IntersectWith(
+    const SimdBlockFilter& other, const unsigned num_threads) {
+  return Combine<false>(other, num_threads);
+}
+
+template <typename HashFamily>
+template <bool kUnion>
+bool SimdBlockFilter<HashFamily>::Combine(
+    const SimdBlockFilter& other, const unsigned num_threads) {
+  if (!CompatibleWith(other)) return false;
+  void (*combine)(Bucket*, const Bucket*, const uint64_t) =
+      kernels_.isa == SimdBlockIsa::kAvx2    ? &CombineAvx2<kUnion>
+      : kernels_.isa == SimdBlockIsa::kSse42 ? &CombineSse<kUnion>
+                                             : &CombineScalar<kUnion>;
+  // Each thread gets a whole number of cache lines:
+  const uint64_t num_buckets = directory_.size();
+  const uint64_t threads = ::std::max(1u, num_threads);
+  const uint64_t per_thread = ((num_buckets + threads - 1) / threads + 1) & ~1ull;
+  ::std::vector<::std::thread> workers;
+  for (uint64_t begin = per_thread; begin < num_buckets; begin += per_thread) {
+    const uint64_t n = ::std::min(per_thread, num_buckets - begin);
+    workers.push_back(::std::thread(
+        combine, directory_.data() + begin, other.directory_.data() + begin, n));
+  }
+  combine(
+      directory_.data(), other.directory_.data(), ::std::min(per_thread, num_buckets));
+  for (auto& worker : workers) worker.join();
+  return true;
+}
+
+template <typename HashFamily>
+template <bool kUnion>
+[[gnu::target("avx2")]] void SimdBlockFilter<HashFamily>::CombineAvx2(
+    Bucket* dst, const Bucket* src, const uint64_t n) {
+  __m256i* const d = reinterpret_cast<__m256i*>(dst);
+  const __m256i* const s = reinterpret_cast<const __m256i*>(src);
+  // Plain stores: the load of d[i] already brought its line into the cache, where a
+  // non-temporal store would only force it out again (measured 17 against 26 GB/s).
+  for (uint64_t i = 0; i < n; ++i) {
+    d[i] = kUnion ? _mm256_or_si256(d[i], s[i]) : _mm256_and_si256(d[i], s[i]);
+  }
+}
+
+template <typename HashFamily>
+template <bool kUnion>
+[[gnu::target("sse4.2")]] void SimdBlockFilter<HashFamily>::CombineSse(
+    Bucket* dst, const Bucket* src, const uint64_t n) {
+  __m128i* const d = reinterpret_cast<__m128i*>(dst);
+  const __m128i* const s = reinterpret_cast<const __m128i*>(src);
+  for (uint64_t i = 0; i < 2 * n; ++i) {
+    d[i] = kUnion ? _mm_or_si128(d[i], s[i]) : _mm_and_si128(d[i], s[i]);
+  }
+}
+
+template <typename HashFamily>
+template <bool kUnion>
+void SimdBlockFilter<HashFamily>::CombineScalar(
+    Bucket* dst, const Bucket* src, const uint64_t n) {
+  uint64_t* const d = reinterpret_cast<uint64_t*>(dst);
+  const uint64_t* const s = reinterpret_cast<const uint64_t*>(src);
+  for (uint64_t i = 0; i < 4 * n; ++i) {
+    d[i] = kUnion ? (d[i] | s[i]) : (d[i] & s[i]);
+  }
+}
+
+// The body of BucketStats() and BucketStatsPopcnt(), which only differ in the
+// instructions __builtin_popcount() compiles to.
+template <typename Bucket>
+[[gnu::always_inline]] inline void BlockFilterBucketStats(const Bucket* buckets,
+    const uint64_t n, const int num_lanes, double* keys, double* fpp) noexcept {
+  const double log_unset = ::std::log(31 / 32.0);
+  for (uint64_t b = 0; b < n; ++b) {
+    int set = 0;
+    double bucket_fpp = 1;
+    for (int i = 0; i < num_lanes; ++i) {
+      const int lane_set = __builtin_popcount(buckets[b][i]);
+      set += lane_set;
+      bucket_fpp *= lane_set / 32.0;
+    }
+    *fpp += bucket_fpp;
+    // Each key sets one bit per lane, so a lane keeps a given bit unset with
+    // probability (31/32)^keys. A full bucket only says keys is large; count it as if a
+    // single bit were still unset.
+    const double unset = ::std::max(1 - set / (32.0 * num_lanes), 0.5 / (32 * num_lanes));
+    *keys += ::std::log(unset) / log_unset;
+  }
+}
+
+template <typename HashFamily>
+void SimdBlockFilter<HashFamily>::BucketStats(const Bucket* buckets, const uint64_t n,
+    double* keys, double* fpp) noexcept {
+  BlockFilterBucketStats(buckets, n, 8, keys, fpp);
+}
+
+template <typename HashFamily>
+[[gnu::target("popcnt")]] void SimdBlockFilter<HashFamily>::BucketStatsPopcnt(
+    const Bucket* buckets, const uint64_t n, double* keys, double* fpp) noexcept {
+  BlockFilterBucketStats(buckets, n, 8, keys, fpp);
+}
+
+template <typename HashFamily>
+void SimdBlockFilter<HashFamily>::Stats(double* keys, double* fpp) const {
+  *keys = 0;
+  *fpp = 0;
+  if (__builtin_cpu_supports("popcnt")) {
+    BucketStatsPopcnt(directory_.data(), directory_.size(), keys, fpp);
+  } else {
+    BucketStats(directory_.data(), directory_.size(), keys, fpp);
+  }
+}
+
+template <typename HashFamily>
+double SimdBlockFilter<HashFamily>::EstimateCardinality() const {
+  double keys, fpp;
+  Stats(&keys, &fpp);
+  return keys;
+}
+
+template <typename HashFamily>
+double SimdBlockFilter<HashFamily>::FalsePositiveRate() const {
+  double keys, fpp;
+  Stats(&keys, &fpp);
+  return fpp / directory_.size();
 }
@@ -15,7 +15,10 @@ namespace cuckoofilter {
 // the most naive table implementation: one huge bit array
 template <size_t bits_per_tag>
 class SingleTable {
+ public:
   static const size_t kTagsPerBucket = 4;
+
+ private:
   static const size_t kBytesPerBucket =
       (bits_per_tag * kTagsPerBucket + 7) >> 3;
   static const uint32_t kTagMask = (1ULL << bits_per_tag) - 1;
@@ -67,6 +70,10 @@ class SingleTable {
     return ss.str();
   }
 
+  inline void Prefetch(const size_t i) const {
+    __builtin_prefetch(buckets_[i].bits_);
+  }
+
   // read tag from pos(i,j)
   inline uint32_t ReadTag(const size_t i, const size_t j) const {
     const char *p = buckets_[i].bits_;
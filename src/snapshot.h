@@ -0,0 +1,218 @@
+#ifndef CUCKOO_FILTER_SNAPSHOT_H_
+#define CUCKOO_FILTER_SNAPSHOT_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+namespace cuckoofilter {
+
+// Building blocks for the sparse snapshot format of CuckooFilter. A snapshot
+// is split into blocks of kSnapshotBucketsPerBlock buckets that can be
+// decoded independently; each block holds a 4-bit occupancy mask per bucket,
+// the tags of the occupied slots bit-packed back to back, and the remote
+// keys and values of those slots as two columns.
+const uint32_t kSnapshotMagic = 0x4e534643;  // "CFSN"
+const uint32_t kSnapshotVersion = 1;
+const size_t kSnapshotBucketsPerBlock = 4096;
+
+// Block-level compression of the remote columns. Implementations must be
+// stateless so that blocks can be decoded from several threads at once.
+class SnapshotCodec {
+ public:
+  virtual ~SnapshotCodec() {}
+  // identifier recorded in the snapshot header; 0 and 1 are built in
+  virtual uint32_t Id() const = 0;
+  // appends the encoding of n bytes, made of elem_size-byte elements, to out
+  virtual void Compress(const char *in, size_t n, size_t elem_size,
+                        std::string *out) const = 0;
+  // decodes exactly raw_size bytes into out; returns false on corrupt input
+  virtual bool Decompress(const char *in, size_t n, size_t elem_size,
+                          size_t raw_size, char *out) const = 0;
+};
+
+// Stores the columns as they are.
+class NullCodec : public SnapshotCodec {
+ public:
+  uint32_t Id() const { return 0; }
+
+  void Compress(const char *in, size_t n, size_t /* elem_size */,
+                std::string *out) const {
+    out->append(in, n);
+  }
+
+  bool Decompress(const char *in, size_t n, size_t /* elem_size */,
+                  size_t raw_size, char *out) const {
+    if (n != raw_size) return false;
+    memcpy(out, in, n);
+    return true;
+  }
+};
+
+// Transposes the column into byte planes (all first bytes, then all second
+// bytes, ...) and run-length encodes zero bytes. Keys and values are mostly
+// small or clustered integers, so their high planes collapse to a few runs.
+//
+// Token format: a control byte c < 128 is followed by c + 1 literal bytes;
+// c >= 128 stands for c - 127 zero bytes.
+class ShuffleRleCodec : public SnapshotCodec {
+ public:
+  uint32_t Id() const { return 1; }
+
+  void Compress(const char *in, size_t n, size_t elem_size,
+                std::string *out) const {
+    const size_t count = n / elem_size;
+    std::string plane(n, '\0');
+    for (size_t b = 0; b < elem_size; b++) {
+      for (size_t k = 0; k < count; k++) {
+        plane[b * count + k] = in[k * elem_size + b];
+      }
+    }
+    size_t i = 0;
+    while (i < n) {
+      size_t run = 0;
+      while (i + run < n && run < 128 && plane[i + run] == 0) run++;
+      if (run > 0) {
+        out->push_back(static_cast<char>(127 + run));
+        i += run;
+        continue;
+      }
+      size_t lit = 0;
+      // stop a literal at a pair of zeros, where a run becomes cheaper
+      while (i + lit < n && lit < 128 &&
+             !(plane[i + lit] == 0 && i + lit + 1 < n &&
+               plane[i + lit + 1] == 0)) {
+        lit++;
+      }
+      if (lit == 0) lit = 1;
+      out->push_back(static_cast<char>(lit - 1));
+      out->append(&plane[i], lit);
+      i += lit;
+    }
+  }
+
+  bool Decompress(const char *in, size_t n, size_t elem_size,
+                  size_t raw_size, char *out) const {
+    std::string plane(raw_size, '\0');
+    size_t i = 0, o = 0;
+    while (i < n) {
+      uint8_t c = static_cast<uint8_t>(in[i++]);
+      if (c >= 128) {
+        size_t run = c - 127;
+        if (o + run > raw_size) return false;
+        o += run;
+      } else {
+        size_t lit = c + 1;
+        if (o + lit > raw_size || i + lit > n) return false;
+        memcpy(&plane[o], in + i, lit);
+        o += lit;
+        i += lit;
+      }
+    }
+    if (o != raw_size) return false;
+    const size_t count = raw_size / elem_size;
+    for (size_t b = 0; b < elem_size; b++) {
+      for (size_t k = 0; k < count; k++) {
+        out[k * elem_size + b] = plane[b * count + k];
+      }
+    }
+    return true;
+  }
+};
+
+// Returns the built-in codec registered under id, or NULL.
+inline const SnapshotCodec *BuiltinSnapshotCodec(uint32_t id) {
+  static const NullCodec null_codec;
+  static const ShuffleRleCodec shuffle_rle_codec;
+  if (id == null_codec.Id()) return &null_codec;
+  if (id == shuffle_rle_codec.Id()) return &shuffle_rle_codec;
+  return NULL;
+}
+
+// Appends fixed-width values in host (little-endian) byte order.
+template <typename T>
+inline void SnapshotPut(std::string *out, const T &v) {
+  out->append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+// Bounds-checked reader over an encoded snapshot.
+class SnapshotReader {
+  const char *p_;
+  const char *end_;
+
+ public:
+  SnapshotReader(const char *p, size_t n) : p_(p), end_(p + n) {}
+
+  template <typename T>
+  bool Get(T *v) {
+    if (static_cast<size_t>(end_ - p_) < sizeof(T)) return false;
+    memcpy(v, p_, sizeof(T));
+    p_ += sizeof(T);
+    return true;
+  }
+
+  // returns a pointer to the next n bytes and skips them, or NULL
+  const char *Skip(size_t n) {
+    if (static_cast<size_t>(end_ - p_) < n) return NULL;
+    const char *p = p_;
+    p_ += n;
+    return p;
+  }
+};
+
+// LSB-first bit packing of fixed-width tags.
+class TagPacker {
+  std::string *out_;
+  uint64_t acc_;
+  size_t nbits_;
+
+ public:
+  explicit TagPacker(std::string *out) : out_(out), acc_(0), nbits_(0) {}
+
+  inline void Put(uint32_t tag, size_t bits) {
+    acc_ |= static_cast<uint64_t>(tag) << nbits_;
+    nbits_ += bits;
+    while (nbits_ >= 8) {
+      out_->push_back(static_cast<char>(acc_ & 0xff));
+      acc_ >>= 8;
+      nbits_ -= 8;
+    }
+  }
+
+  inline void Flush() {
+    if (nbits_ > 0) out_->push_back(static_cast<char>(acc_ & 0xff));
+    acc_ = 0;
+    nbits_ = 0;
+  }
+};
+
+class TagUnpacker {
+  const uint8_t *p_;
+  uint64_t acc_;
+  size_t nbits_;
+
+ public:
+  explicit TagUnpacker(const char *p)
+      : p_(reinterpret_cast<const uint8_t *>(p)), acc_(0), nbits_(0) {}
+
+  inline uint32_t Get(size_t bits) {
+    while (nbits_ < bits) {
+      acc_ |= static_cast<uint64_t>(*p_++) << nbits_;
+      nbits_ += 8;
+    }
+    uint32_t tag = acc_ & ((1ULL << bits) - 1);
+    acc_ >>= bits;
+    nbits_ -= bits;
+    return tag;
+  }
+};
+
+// number of bytes taken by n packed tags
+inline size_t PackedTagBytes(size_t n, size_t bits) {
+  return (n * bits + 7) / 8;
+}
+
+}  // namespace cuckoofilter
+
+#endif  // CUCKOO_FILTER_SNAPSHOT_H_